@@ -15,6 +15,7 @@
 // along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <QListView>
+#include <QListWidget>
 #include <QLineEdit>
 #include <QLabel>
 #include <QVBoxLayout>
@@ -24,6 +25,8 @@
 #include <QMenu>
 #include <QInputDialog>
 #include <QMessageBox>
+#include <QScrollBar>
+#include <QElapsedTimer>
 
 #include "browserwidget.h"
 #include "gallery.h"
@@ -31,15 +34,21 @@
 #include "tagquery.h"
 #include "tagcompleter.h"
 #include "imageinfodialog.h"
+#include "savedqueries.h"
+#include "tagfacets.h"
+
+//! Number of tags shown in the facet list
+static const int FACET_COUNT = 20;
 
 BrowserWidget::BrowserWidget(Gallery *gallery, QWidget *parent) :
-	QWidget(parent), m_gallery(gallery)
+	QWidget(parent), m_gallery(gallery), m_parsetime(0)
 {
 	QVBoxLayout *mainlayout = new QVBoxLayout(this);
 	setLayout(mainlayout);
 
 	m_model = new ThumbnailModel(gallery);
 	connect(m_model, SIGNAL(pictureCountChanged(int,int)), this, SIGNAL(pictureCountChanged(int,int)));
+	connect(m_model, SIGNAL(queryTimed(QString)), this, SLOT(modelQueryTimed(QString)));
 	m_model->setQuery(ThumbnailModel::QUERY_ALL);
 
 	m_view = new QListView();
@@ -54,7 +63,21 @@ BrowserWidget::BrowserWidget(Gallery *gallery, QWidget *parent) :
 	m_view->setDragEnabled(true);
 	m_view->setDragDropMode(QListView::DragOnly);
 	m_view->setMouseTracking(true); // mouse tracking must be enabled for status tips to work
-	mainlayout->addWidget(m_view);	
+
+	// The facet list shows the most common tags of the results
+	m_facets = new TagFacets(gallery->database());
+	m_facetlist = new QListWidget();
+	m_facetlist->setMaximumWidth(200);
+	m_facetlist->hide();
+	connect(m_model, SIGNAL(modelReset()), this, SLOT(resetFacets()));
+	connect(m_model, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(addFacets(QModelIndex,int,int)));
+	connect(m_facetlist, SIGNAL(itemActivated(QListWidgetItem*)), this, SLOT(facetActivated(QListWidgetItem*)));
+
+	QHBoxLayout *viewlayout = new QHBoxLayout();
+	viewlayout->setContentsMargins(0, 0, 0, 0);
+	viewlayout->addWidget(m_view, 1);
+	viewlayout->addWidget(m_facetlist);
+	mainlayout->addLayout(viewlayout);
 
 	m_viewctxmenu = new QMenu(this);
 	QAction *act_addtags = new QAction(tr("Add tags..."), this);
@@ -90,9 +113,15 @@ BrowserWidget::BrowserWidget(Gallery *gallery, QWidget *parent) :
 	mainlayout->addWidget(m_searchbox);
 
 	connect(m_view, SIGNAL(activated(QModelIndex)), this, SLOT(openPicture(QModelIndex)));
+	connect(m_view->verticalScrollBar(), SIGNAL(valueChanged(int)), this, SIGNAL(viewScrolled()));
 	connect(m_searchbox, SIGNAL(returnPressed()), this, SLOT(updateQuery()));
 }
 
+BrowserWidget::~BrowserWidget()
+{
+	delete m_facets;
+}
+
 void BrowserWidget::pictureContextMenu(const QPoint& point)
 {
 	QModelIndex index = m_view->indexAt(point);
@@ -124,6 +153,7 @@ void BrowserWidget::picSelectedAddtags()
 		t += tags;
 		list[i].saveTags(m_gallery->database(), t);
 	}
+	m_gallery->database()->saveRuleProfile();
 	m_model->refreshQuery();
 
 }
@@ -183,6 +213,11 @@ void BrowserWidget::openPicture(const QModelIndex& index)
 		emit pictureSelected(*pic);
 }
 
+QString BrowserWidget::getQuery() const
+{
+	return m_searchbox->text().trimmed();
+}
+
 void BrowserWidget::setQuery(const QString& query)
 {
 	m_searchbox->setText(query);
@@ -199,6 +234,11 @@ static QString getParam(const QString& query) {
 	return query.mid(open, end-open).trimmed();
 }
 
+bool BrowserWidget::isSpecialQuery(const QString& query)
+{
+	return query == ":untagged" || query == ":missing" || query == ":duplicate" || query.startsWith(":saved(");
+}
+
 void BrowserWidget::updateQuery()
 {
 	QString search = m_searchbox->text().trimmed().toLower();
@@ -208,33 +248,27 @@ void BrowserWidget::updateQuery()
 	if(search.length()==0) {
 		// No filter
 		m_model->setQuery(ThumbnailModel::QUERY_ALL);
-	} else if(search.at(0)==':') {
-		// Special queries
-		if(search == ":untagged")
-			m_model->setQuery(ThumbnailModel::QUERY_UNTAGGED);
-		else if(search == ":new")
-			m_model->setQuery(ThumbnailModel::QUERY_NEW);
-		else if(search == ":hidden")
-			m_model->setQuery(ThumbnailModel::QUERY_HIDDEN);
-		else if(search == ":missing")
-			m_model->setQuery(ThumbnailModel::QUERY_MISSING);
-		else if(search == ":duplicate")
-			m_model->setQuery(ThumbnailModel::QUERY_DUPLICATE);
-		else if(search.startsWith(":file(") || search.startsWith(":filename("))
-			m_model->setQuery(ThumbnailModel::QUERY_FILENAME, getParam(search));
-		else if(search.startsWith(":title("))
-			m_model->setQuery(ThumbnailModel::QUERY_TITLE, getParam(search));
-		else if(search.startsWith(":hash("))
-			m_model->setQuery(ThumbnailModel::QUERY_HASH, getParam(search));
-		else
-			ok = false;
+	} else if(search == ":untagged") {
+		m_model->setQuery(ThumbnailModel::QUERY_UNTAGGED);
+	} else if(search == ":missing") {
+		m_model->setQuery(ThumbnailModel::QUERY_MISSING);
+	} else if(search == ":duplicate") {
+		m_model->setQuery(ThumbnailModel::QUERY_DUPLICATE);
+	} else if(search.startsWith(":saved(")) {
+		m_gallery->database()->savedQueries()->refresh(getParam(search));
+		m_model->setQuery(ThumbnailModel::QUERY_SAVED, getParam(search));
 	} else {
-		// Normal query
+		// Normal query. Metadata predicates (e.g. :title()) are part of the query language.
+		QElapsedTimer timer;
+		timer.start();
 		TagQuery query(search);
 		query.init(m_gallery->database()->tags());
+		m_parsetime = timer.nsecsElapsed() / 1000;
 		ok = !query.isError();
-		if(ok)
+		if(ok) {
+			qDebug("Query plan (parsed in %lld us):\n%s", m_parsetime, qPrintable(query.explain()));
 			m_model->setQuery(query);
+		}
 		else
 			qDebug() << "BAD QUERY:" << query.errorMessage();
 	}
@@ -288,3 +322,63 @@ void BrowserWidget::selectPicture(int index)
 {
 	m_view->selectionModel()->setCurrentIndex(m_model->index(index), QItemSelectionModel::SelectCurrent);
 }
+
+void BrowserWidget::modelQueryTimed(const QString& summary)
+{
+	emit queryTimed(QString("parse %1 us, ").arg(m_parsetime) + summary);
+}
+
+void BrowserWidget::setFacetsVisible(bool visible)
+{
+	m_facetlist->setVisible(visible);
+	if(visible)
+		resetFacets();
+	else
+		m_facets->clear();
+}
+
+void BrowserWidget::resetFacets()
+{
+	// Counting is skipped while the list is hidden
+	if(m_facetlist->isHidden())
+		return;
+
+	m_facets->reset(m_model->pictureIds(0));
+	showFacets();
+}
+
+void BrowserWidget::addFacets(const QModelIndex& parent, int first, int last)
+{
+	Q_UNUSED(parent);
+	if(m_facetlist->isHidden())
+		return;
+
+	m_facets->add(m_model->pictureIds(first, last - first + 1));
+	showFacets();
+}
+
+void BrowserWidget::showFacets()
+{
+	m_facetlist->clear();
+	foreach(const TagFacet& facet, m_facets->top(FACET_COUNT)) {
+		QListWidgetItem *item = new QListWidgetItem(QString("%1 (%2)").arg(facet.name).arg(facet.count));
+		item->setData(Qt::UserRole, facet.name);
+		m_facetlist->addItem(item);
+	}
+}
+
+void BrowserWidget::facetActivated(QListWidgetItem *item)
+{
+	QString tag = item->data(Qt::UserRole).toString();
+	QString query = getQuery();
+
+	// Special queries can't be combined with tags
+	if(query.isEmpty() || isSpecialQuery(query))
+		query = tag;
+	else if(query.contains('|'))
+		query = "(" + query + "), " + tag;
+	else
+		query = query + ", " + tag;
+
+	setQuery(query);
+}
@@ -23,10 +23,13 @@ class QListView;
 class QLineEdit;
 class QModelIndex;
 class QMenu;
+class QListWidget;
+class QListWidgetItem;
 
 class Gallery;
 class Picture;
 class ThumbnailModel;
+class TagFacets;
 
 //! Image thumbnail browser widget
 class BrowserWidget : public QWidget
@@ -34,6 +37,7 @@ class BrowserWidget : public QWidget
     Q_OBJECT
 public:
 	explicit BrowserWidget(Gallery *gallery, QWidget *parent = 0);
+	~BrowserWidget();
 
 	//! Get the picture at the specific index
 	const Picture *getPictureAt(int index) const;
@@ -52,6 +56,15 @@ public:
 
 	ThumbnailModel *getThumbnailModel() { return m_model; }
 
+	//! Get the contents of the query box
+	QString getQuery() const;
+
+	//! Is this a special query (e.g. :untagged) that can't be combined with tags
+	static bool isSpecialQuery(const QString& query);
+
+	//! Show or hide the list of the most common tags in the results
+	void setFacetsVisible(bool visible);
+
 signals:
 	//! User selected a picture for closer viewing
 	void pictureSelected(const Picture& picture);
@@ -59,6 +72,12 @@ signals:
 	//! Number of shown pictures has changed
 	void pictureCountChanged(int shown, int total);
 
+	//! The thumbnail view was scrolled
+	void viewScrolled();
+
+	//! A tag query has been matched. The summary lists the time spent in each phase
+	void queryTimed(const QString& summary);
+
 public slots:
 	//! Make a new query
 	void setQuery(const QString& query);
@@ -85,12 +104,32 @@ protected slots:
 	void picSelectedDelete();
 	void picSelectedSetHidden(bool hidden);
 
+	//! Add the query parsing time to the model's query timing summary
+	void modelQueryTimed(const QString& summary);
+
+	//! Recount the tags of all results
+	void resetFacets();
+
+	//! Count the tags of newly appended results
+	void addFacets(const QModelIndex& parent, int first, int last);
+
+	//! Narrow down the query with the selected tag
+	void facetActivated(QListWidgetItem *item);
+
 private:
+	//! Fill the facet list with the most common tags
+	void showFacets();
+
 	Gallery *m_gallery;
 	QListView *m_view;
 	QLineEdit *m_searchbox;
 	ThumbnailModel *m_model;
 	QMenu *m_viewctxmenu;
+	QListWidget *m_facetlist;
+	TagFacets *m_facets;
+
+	//! Time spent parsing and initializing the last tag query (microseconds)
+	qint64 m_parsetime;
 };
 
 #endif // BROWSERWIDGET_H
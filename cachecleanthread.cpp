@@ -0,0 +1,142 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+#include <QDir>
+#include <QDateTime>
+#include <QImageReader>
+#include <QImage>
+#include <QSet>
+#include <QRegExp>
+#include <QMetaType>
+
+#include "cachecleanthread.h"
+
+#include "gallery.h"
+#include "database.h"
+
+//! Thumbnails younger than this (seconds) may still be being written and are left alone
+static const int MIN_AGE = 60;
+
+CacheCleanThread::CacheCleanThread(const Gallery *gallery, QObject *parent) :
+	QThread(parent), m_gallery(gallery), m_abortflag(false)
+{
+	// Needed for passing the reclaimed byte count across threads
+	qRegisterMetaType<qint64>("qint64");
+}
+
+// Thumbnail cache directories are named after the first two characters of the hash
+static bool isCacheDir(const QString& name)
+{
+	static const QRegExp hexpair("[0-9a-f]{2}");
+	return hexpair.exactMatch(name);
+}
+
+void CacheCleanThread::run()
+{
+	QString dbname = QString("cacheclean") + m_gallery->database()->name();
+
+	// Gather the set of live hashes. The hashes are stored in binary form to
+	// keep the set compact even for very large galleries.
+	QSet<QByteArray> live;
+	bool ok = true;
+	{
+		QSqlDatabase db = QSqlDatabase::cloneDatabase(m_gallery->database()->get(), dbname);
+		if(!db.open()) {
+			emit statusChanged(tr("Couldn't open database!"));
+			qDebug() << "Couldn't open clone database!";
+			return;
+		}
+
+		QSqlQuery q(db);
+		q.setForwardOnly(true);
+		if(!q.exec("SELECT hash FROM picture WHERE hash!=\"\" GROUP BY hash")) {
+			// Without the live hashes, every thumbnail would look orphaned
+			emit statusChanged(tr("Couldn't read picture hashes!"));
+			qDebug() << "Couldn't read picture hashes:" << q.lastError().text();
+			ok = false;
+		}
+		while(ok && q.next() && !m_abortflag)
+			live.insert(QByteArray::fromHex(q.value(0).toByteArray()));
+	}
+	QSqlDatabase::removeDatabase(dbname);
+
+	// An incomplete set of live hashes must not be used for sweeping
+	if(!ok || m_abortflag)
+		return;
+
+	// Sweep the thumbnail store one directory at a time
+	const QDir metadir = m_gallery->metadir();
+	const QStringList dirs = metadir.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+	const QDateTime cutoff = QDateTime::currentDateTime().addSecs(-MIN_AGE);
+
+	int orphans = 0;
+	int corrupt = 0;
+	qint64 bytes = 0;
+
+	emit statusChanged(tr("Cleaning thumbnail cache..."));
+	for(int i=0;i<dirs.count() && !m_abortflag;++i) {
+		emit progress(i, dirs.count());
+		if(!isCacheDir(dirs.at(i)))
+			continue;
+
+		QDir dir(metadir.absoluteFilePath(dirs.at(i)));
+		foreach(const QFileInfo& file, dir.entryInfoList(QStringList() << "*.png", QDir::Files)) {
+			if(m_abortflag)
+				break;
+
+			// A young thumbnail may still be being written, or belong to a
+			// picture added after the live hashes were read
+			if(file.lastModified() >= cutoff)
+				continue;
+
+			bool remove = false;
+			if(!live.contains(QByteArray::fromHex(file.completeBaseName().toLatin1()))) {
+				remove = true;
+				++orphans;
+			} else {
+				QImageReader reader(file.absoluteFilePath());
+				QImage image;
+				if(!reader.read(&image) || image.isNull()) {
+					qWarning("Corrupt thumbnail: %s (%s)", file.absoluteFilePath().toLocal8Bit().constData(), reader.errorString().toLocal8Bit().constData());
+					remove = true;
+					++corrupt;
+				}
+			}
+
+			if(remove) {
+				qint64 size = file.size();
+				if(QFile::remove(file.absoluteFilePath()))
+					bytes += size;
+			}
+		}
+
+		// Remove the directory if it was emptied
+		metadir.rmdir(dirs.at(i));
+	}
+	emit progress(dirs.count(), dirs.count());
+
+	emit cleaned(orphans, corrupt, bytes);
+	emit statusChanged(tr("Done."));
+}
+
+void CacheCleanThread::abort()
+{
+	m_abortflag = true;
+}
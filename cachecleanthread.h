@@ -0,0 +1,59 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef CACHECLEANTHREAD_H
+#define CACHECLEANTHREAD_H
+
+#include <QThread>
+
+class Gallery;
+
+//! Remove stale and broken thumbnails from the thumbnail cache in the background
+/**
+  Thumbnails are named after the hash of the picture they were made of.
+  A thumbnail whose hash no longer appears in the picture table (because the file
+  was edited, moved out of the gallery or removed by a rescan) is an orphan and is deleted.
+  Thumbnails that cannot be decoded are deleted too, so they will be regenerated.
+  */
+class CacheCleanThread : public QThread
+{
+    Q_OBJECT
+public:
+	CacheCleanThread(const Gallery *gallery, QObject *parent = 0);
+
+	void run();
+
+signals:
+	void statusChanged(const QString& status);
+	void progress(int done, int total);
+
+	/**
+	  \brief Emitted when the sweep is complete
+	  \param orphans number of orphaned thumbnails removed
+	  \param corrupt number of unreadable thumbnails removed
+	  \param bytes total size of the removed files
+	  */
+	void cleaned(int orphans, int corrupt, qint64 bytes);
+
+public slots:
+	void abort();
+
+private:
+	const Gallery *m_gallery;
+	bool m_abortflag;
+};
+
+#endif // CACHECLEANTHREAD_H
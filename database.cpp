@@ -27,11 +27,15 @@
 #include "database.h"
 #include "picture.h"
 #include "tags.h"
+#include "tagindex.h"
+#include "tagstore.h"
+#include "savedqueries.h"
+#include "tagrules.h"
 
 int Database::dbindex = 0;
 
 Database::Database(const QDir& metadir, QObject *parent) :
-    QObject(parent)
+    QObject(parent), m_tags(0), m_tagrules(0), m_rulegeneration(0), m_ruleprofile(0), m_tagrebuild(false)
 {
 	++dbindex;
 	m_dbname = QString("db") + QString::number(dbindex);
@@ -40,6 +44,10 @@ Database::Database(const QDir& metadir, QObject *parent) :
 	m_db = QSqlDatabase::addDatabase("QSQLITE", m_dbname);
 	m_db.setDatabaseName(metadir.absoluteFilePath("index.db"));
 
+	m_tagindex = new TagIndex(this, metadir.absoluteFilePath("tagindex.dat"));
+	m_tagstore = new TagStore(this);
+	m_savedqueries = new SavedQueries(this);
+
 	if(m_db.open()) {
 		// Make sure the necessary tables exist	delete m_tags;
 
@@ -97,6 +105,19 @@ Database::Database(const QDir& metadir, QObject *parent) :
 				   ")");
 		}
 
+		// Statistics of the last profiled tag rule evaluation
+		if(!tables.contains("ruleprofile")) {
+			QSqlQuery q(m_db);
+			q.exec("CREATE TABLE ruleprofile ("
+				   "rule TEXT NOT NULL,"
+				   "tags TEXT NOT NULL,"
+				   "evaluations INTEGER NOT NULL,"
+				   "matches INTEGER NOT NULL,"
+				   "added INTEGER NOT NULL,"
+				   "usecs INTEGER NOT NULL"
+				   ")");
+		}
+
 		// General program options
 		if(!tables.contains("option")) {
 			QSqlQuery q(m_db);
@@ -105,11 +126,116 @@ Database::Database(const QDir& metadir, QObject *parent) :
 				   "optvalue TEXT NOT NULL"
 				   ")");
 		}
+
+		// Saved queries and their results
+		m_savedqueries->createTables();
+
+		setRuleProfiling(getSetting("tagrules.profile").toBool());
 	}
 }
 
 Database::~Database()
 {
+	m_tagindex->save();
+	delete m_tagindex;
+	delete m_tagstore;
+	delete m_savedqueries;
+	delete m_tagrules;
+	delete m_ruleprofile;
+}
+
+void Database::tagMapChanged()
+{
+	// Once loaded, the tag index is kept in memory for the query matcher
+	const bool indexloaded = m_tagindex->isLoaded();
+	m_tagindex->invalidate();
+	if(indexloaded)
+		m_tagindex->load();
+
+	m_tagstore->invalidate();
+	m_savedqueries->invalidate();
+	m_tags->reloadFrequencies();
+
+	// The rules are planned using the tag frequencies
+	dropTagRules();
+}
+
+void Database::bumpTagMapGeneration(QSqlDatabase db)
+{
+	QSqlQuery q(db);
+	if(!q.exec("INSERT OR REPLACE INTO option (optkey, optvalue) "
+			   "SELECT 'tagmap.generation', COALESCE((SELECT optvalue FROM option WHERE optkey='tagmap.generation'), 0) + 1"))
+		qDebug() << "Couldn't bump tag map generation:" << q.lastError().text();
+}
+
+qint64 Database::tagMapGeneration() const
+{
+	return getSetting("tagmap.generation").toLongLong();
+}
+
+const TagImplications &Database::tagRules()
+{
+	if(m_tagrules==0)
+		m_tagrules = new TagImplications(TagImplications::load(this));
+	return *m_tagrules;
+}
+
+void Database::tagCreated()
+{
+	if(m_tagrules!=0 && m_tagrules->hasWildcards())
+		dropTagRules();
+}
+
+void Database::tagRulesChanged()
+{
+	dropTagRules();
+	++m_rulegeneration;
+}
+
+void Database::dropTagRules()
+{
+	// The profile refers to the rules by position
+	saveRuleProfile();
+
+	delete m_tagrules;
+	m_tagrules = 0;
+}
+
+void Database::setRuleProfiling(bool enable)
+{
+	if(enable && m_ruleprofile==0) {
+		m_ruleprofile = new TagRuleProfile();
+	} else if(!enable) {
+		saveRuleProfile();
+		delete m_ruleprofile;
+		m_ruleprofile = 0;
+	}
+}
+
+void Database::saveRuleProfile()
+{
+	if(m_ruleprofile==0 || m_ruleprofile->isEmpty())
+		return;
+
+	// A rebuild reports its own profile, which must not be replaced
+	// by the few pictures saved while it runs
+	if(m_tagrules!=0 && !m_tagrebuild)
+		m_tagrules->saveProfile(*m_ruleprofile, m_db);
+	m_ruleprofile->clear();
+}
+
+void Database::startTagRebuild()
+{
+	m_tagrebuild = true;
+	m_rebuildedits.clear();
+}
+
+QSet<int> Database::finishTagRebuild()
+{
+	m_tagrebuild = false;
+	QSet<int> edits = m_rebuildedits;
+	m_rebuildedits.clear();
+	return edits;
 }
 
 QString Database::esc(const QString& text) const
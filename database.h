@@ -19,10 +19,16 @@
 
 #include <QSqlDatabase>
 #include <QHash>
+#include <QSet>
 
 class QDir;
 class Picture;
 class Tags;
+class TagIndex;
+class TagStore;
+class SavedQueries;
+class TagImplications;
+class TagRuleProfile;
 
 //! Database access
 class Database : public QObject
@@ -49,6 +55,111 @@ public:
 
 	const Tags *tags() const { return m_tags; }
 
+	//! Get the inverted tag index. Note that the index is loaded lazily.
+	TagIndex *tagIndex() { return m_tagindex; }
+
+	const TagIndex *tagIndex() const { return m_tagindex; }
+
+	//! Get the in-memory tag store. Note that the store is loaded lazily.
+	TagStore *tagStore() { return m_tagstore; }
+
+	const TagStore *tagStore() const { return m_tagstore; }
+
+	//! Get the saved queries
+	SavedQueries *savedQueries() { return m_savedqueries; }
+
+	const SavedQueries *savedQueries() const { return m_savedqueries; }
+
+	/**
+	  \brief Notify that the tag map was changed behind TagIdSet::save's back
+
+	  The tag statistics, index and store are reloaded and the saved queries
+	  and tag rules recompiled. The tag rule generation does not change.
+	  */
+	void tagMapChanged();
+
+	/**
+	  \brief Bump the tag map generation
+
+	  Call this in the same transaction as any write to the tagmap table. The generation
+	  is kept in the option table, so it can be bumped on a cloned connection too.
+	  The tag index file is only reused if it was saved at the current generation.
+	  \param db the connection the tag map was changed on
+	  */
+	static void bumpTagMapGeneration(QSqlDatabase db);
+
+	//! Get the tag map generation
+	qint64 tagMapGeneration() const;
+
+	/**
+	  \brief Get the compiled tag rules
+
+	  The rules are compiled on first use and reused until tagRulesChanged() is called
+	  (or a new tag is created, if the rules have wildcard patterns). The reference is
+	  only valid until then.
+	  */
+	const TagImplications &tagRules();
+
+	/**
+	  \brief Notify that a new tag was created
+
+	  Compiled tag rules with wildcard patterns are discarded, so they are
+	  compiled again with the new tag. The rule generation does not change.
+	  */
+	void tagCreated();
+
+	/**
+	  \brief Notify that the tag rules or the tag IDs they refer to have changed
+
+	  The compiled rules are discarded and the rule generation is incremented.
+	  */
+	void tagRulesChanged();
+
+	/**
+	  \brief Get the tag rule generation
+
+	  This changes whenever the tag rules or the tag IDs they refer to change.
+	  Tags inferred with rules of an older generation may be out of date.
+	  */
+	int tagRuleGeneration() const { return m_rulegeneration; }
+
+	/**
+	  \brief Start recording the pictures whose tags are saved
+
+	  A background tag index rebuild works on a snapshot of the picture table.
+	  Pictures retagged in the meantime must be saved again once the new index is in place.
+	  */
+	void startTagRebuild();
+
+	//! Stop recording saved pictures and get the IDs of the pictures saved since startTagRebuild()
+	QSet<int> finishTagRebuild();
+
+	//! Is a background tag index rebuild in progress?
+	bool isRebuildingTags() const { return m_tagrebuild; }
+
+	//! Notify that the tags of a picture were saved. This is called by TagIdSet::save
+	void tagsSaved(int picid) { if(m_tagrebuild) m_rebuildedits.insert(picid); }
+
+	/**
+	  \brief Enable or disable tag rule profiling
+
+	  When enabled, the statistics of the rules applied while saving tags
+	  are gathered in the profile returned by ruleProfile().
+	  */
+	void setRuleProfiling(bool enable);
+
+	//! Get the tag rule profile to gather, or null if profiling is disabled
+	TagRuleProfile *ruleProfile() { return m_ruleprofile; }
+
+	/**
+	  \brief Report the gathered tag rule profile and start a new one
+
+	  Call this after saving the tags of a picture or a group of pictures.
+	  The profile is discarded during a tag index rebuild, which reports its own.
+	  \see TagImplications::saveProfile
+	  */
+	void saveRuleProfile();
+
 	//! Save a configuration value
 	void saveSetting(const QString& key, const QVariant& value) const;
 
@@ -63,11 +174,28 @@ signals:
 public slots:
 
 private:
+	//! Discard the compiled tag rules, so they are recompiled on next use
+	void dropTagRules();
+
 	static int dbindex;
 
 	QString m_dbname;
 	QSqlDatabase m_db;
 	Tags *m_tags;
+	TagIndex *m_tagindex;
+	TagStore *m_tagstore;
+	SavedQueries *m_savedqueries;
+
+	//! Compiled tag rules, or null if they must be (re)compiled
+	TagImplications *m_tagrules;
+	int m_rulegeneration;
+
+	//! Tag rule statistics gathered with m_tagrules, or null if profiling is disabled
+	TagRuleProfile *m_ruleprofile;
+
+	//! Pictures saved during a background tag index rebuild
+	bool m_tagrebuild;
+	QSet<int> m_rebuildedits;
 };
 
 #endif // DATABASE_H
@@ -20,6 +20,7 @@
 #include "iconcache.h"
 #include "gallery.h"
 #include "picture.h"
+#include "imagescaler.h"
 
 IconCache::IconCache()
 	: m_cache(255), m_placeholder(QPixmap(ICON_SIZE, ICON_SIZE))
@@ -85,6 +86,29 @@ void IconCache::remove(const Gallery *gallery, const Picture& picture)
 	m_cache.remove(cachefile);
 }
 
+bool IconCache::isCached(const Gallery *gallery, const Picture& picture) const
+{
+	const QString cachefile = cachefilepath(gallery, picture);
+	return !cachefile.isEmpty() && QFile::exists(cachefile);
+}
+
+void IconCache::generate(const Gallery *gallery, const Picture& picture)
+{
+	const QString cachefile = cachefilepath(gallery, picture);
+	if(cachefile.isEmpty())
+		return;
+
+	m_lock.lock();
+	if(m_loading.contains(cachefile)) {
+		m_lock.unlock();
+		return;
+	}
+	m_loading.insert(cachefile);
+	m_lock.unlock();
+
+	cacheImage(picture.fullpath(gallery), cachefile);
+}
+
 void IconCache::cacheImage(const QString &imagefile, const QString& cachefile)
 {
 	QImage img(imagefile);
@@ -93,7 +117,7 @@ void IconCache::cacheImage(const QString &imagefile, const QString& cachefile)
 	// If source image is larger than thumbnail size (as is usual),
 	// scale down
 	if(img.width() > ICON_SIZE || img.height() > ICON_SIZE) {
-		img = img.scaled(ICON_SIZE, ICON_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+		img = ImageScaler::scale(img, QSize(ICON_SIZE, ICON_SIZE), Qt::KeepAspectRatio);
 	}
 
 	// Square thumbnail if not already
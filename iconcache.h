@@ -46,6 +46,19 @@ public:
 	//! Delete a thumbnail
 	void remove(const Gallery *gallery, const Picture& picture);
 
+	//! Check if a thumbnail for the picture exists in the file system cache
+	bool isCached(const Gallery *gallery, const Picture& picture) const;
+
+	/**
+	 \brief Generate a thumbnail right away.
+
+	 This is used by the background thumbnail generator. The thumbnail is
+	 generated in the calling thread, unless it is already being generated.
+	 @param gallery the gallery the picture belongs to
+	 @param picture the picture whose thumbnail to generate
+	 */
+	void generate(const Gallery *gallery, const Picture& picture);
+
 private:
     IconCache();
 	IconCache(const IconCache& ic);
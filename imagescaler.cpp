@@ -0,0 +1,383 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QVector>
+#include <qmath.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The AVX2 loops are compiled for AVX2 on their own and chosen at run time,
+// so the program still runs on processors without it
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define IMAGESCALER_AVX2
+#include <immintrin.h>
+#endif
+
+#include "imagescaler.h"
+
+//! Fixed point precision of the filter weights
+static const int WEIGHT_BITS = 14;
+
+/**
+  Resampling filter coefficients for one dimension.
+
+  Each output pixel is a weighted sum of taps consecutive source pixels
+  starting from start[i]. The weights sum up to 1<<WEIGHT_BITS.
+  */
+struct FilterTable {
+	int taps;
+	QVector<int> start;
+	QVector<qint16> weights;
+};
+
+/**
+  Convert floating point weights to a fixed point filter table.
+  \param srclen source length
+  \param first first source pixel of each output pixel
+  \param weights (normalized) weights of each output pixel
+  */
+static FilterTable makeTable(int srclen, const QVector<int>& first, const QVector<QVector<double> >& weights)
+{
+	FilterTable table;
+
+	// Use an even number of taps when possible so the SIMD loops can work in pairs
+	int taps = 1;
+	for(int i=0;i<weights.count();++i)
+		taps = qMax(taps, weights.at(i).count());
+	table.taps = qMin(taps + (taps & 1), srclen);
+
+	table.start.resize(weights.count());
+	table.weights.fill(0, weights.count() * table.taps);
+
+	for(int i=0;i<weights.count();++i) {
+		const QVector<double>& w = weights.at(i);
+
+		// Shift the window left if it would extend past the end of the source
+		const int start = qMin(first.at(i), srclen - table.taps);
+		const int offset = first.at(i) - start;
+		table.start[i] = start;
+
+		qint16 *out = table.weights.data() + i * table.taps;
+		int sum = 0, largest = 0;
+		for(int j=0;j<w.count();++j) {
+			out[offset+j] = qRound(w.at(j) * (1<<WEIGHT_BITS));
+			sum += out[offset+j];
+			if(out[offset+j] > out[offset+largest])
+				largest = j;
+		}
+
+		// Put the rounding error in the largest weight, so that flat areas stay flat
+		out[offset+largest] += (1<<WEIGHT_BITS) - sum;
+	}
+	return table;
+}
+
+//! Area averaging filter
+static FilterTable boxFilter(int srclen, int dstlen)
+{
+	const double ratio = double(srclen) / dstlen;
+	QVector<int> first(dstlen);
+	QVector<QVector<double> > weights(dstlen);
+
+	for(int i=0;i<dstlen;++i) {
+		const double a = i * ratio;
+		const double b = qMin(double(srclen), (i+1) * ratio);
+		const int lo = qFloor(a);
+		const int hi = qMin(srclen, qCeil(b));
+
+		first[i] = lo;
+		for(int j=lo;j<hi;++j)
+			weights[i].append((qMin(b, j+1.0) - qMax(a, double(j))) / ratio);
+	}
+
+	return makeTable(srclen, first, weights);
+}
+
+static double lanczos3(double x)
+{
+	if(x==0)
+		return 1;
+	if(x <= -3 || x >= 3)
+		return 0;
+	const double px = M_PI * x;
+	return 3 * qSin(px) * qSin(px / 3) / (px * px);
+}
+
+//! Lanczos-3 filter, widened by the scaling ratio for antialiasing
+static FilterTable lanczosFilter(int srclen, int dstlen)
+{
+	const double ratio = double(srclen) / dstlen;
+	const double scale = qMax(1.0, ratio);
+	const double support = 3 * scale;
+
+	QVector<int> first(dstlen);
+	QVector<QVector<double> > weights(dstlen);
+
+	for(int i=0;i<dstlen;++i) {
+		const double center = (i + 0.5) * ratio;
+		const int lo = qMax(0, qFloor(center - support));
+		const int hi = qMin(srclen - 1, qCeil(center + support));
+
+		// Pixels beyond the edges are treated as copies of the edge pixels
+		QVector<double> w(hi - lo + 1, 0.0);
+		double sum = 0;
+		for(int j=qFloor(center - support);j<=qCeil(center + support);++j) {
+			const double v = lanczos3((j + 0.5 - center) / scale);
+			w[qBound(lo, j, hi) - lo] += v;
+			sum += v;
+		}
+		for(int j=0;j<w.count();++j)
+			w[j] /= sum;
+
+		first[i] = lo;
+		weights[i] = w;
+	}
+
+	return makeTable(srclen, first, weights);
+}
+
+// Convert a fixed point channel sum to a byte
+static inline quint32 channel(int acc)
+{
+	return qBound(0, (acc + (1<<(WEIGHT_BITS-1))) >> WEIGHT_BITS, 255);
+}
+
+// Make sure no color channel exceeds alpha (Lanczos can overshoot)
+static inline quint32 clampPremultiplied(quint32 p)
+{
+	const quint32 a = p >> 24;
+	quint32 r = qMin((p >> 16) & 0xff, a);
+	quint32 g = qMin((p >> 8) & 0xff, a);
+	quint32 b = qMin(p & 0xff, a);
+	return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+#ifdef __SSE2__
+// Two 16 bit weights, as the multiplier for _mm_madd_epi16
+static inline int weightPair(qint16 w0, qint16 w1)
+{
+	return int(quint32(quint16(w0)) | (quint32(quint16(w1)) << 16));
+}
+
+// Replicate the alpha of each pixel to all channels and clamp the colors to it
+static inline __m128i clampPremultiplied(__m128i p)
+{
+	__m128i a = _mm_srli_epi32(p, 24);
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+	return _mm_min_epu8(p, a);
+}
+#endif
+
+//! Resample each row of the source image horizontally
+static void horizontalPass(const quint32 *src, int height, int srcstride, quint32 *dst, int dstwidth, const FilterTable& table)
+{
+	const int taps = table.taps;
+
+	for(int y=0;y<height;++y) {
+		const quint32 *row = src + y * srcstride;
+		quint32 *out = dst + y * dstwidth;
+
+		for(int x=0;x<dstwidth;++x) {
+			const quint32 *p = row + table.start.at(x);
+			const qint16 *w = table.weights.constData() + x * taps;
+			int k=0;
+#ifdef __SSE2__
+			const __m128i zero = _mm_setzero_si128();
+			__m128i acc = _mm_set1_epi32(1<<(WEIGHT_BITS-1));
+			for(;k+1<taps;k+=2) {
+				// Interleave the channels of two neighbouring pixels and multiply-add with their weights
+				__m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p+k)), zero);
+				px = _mm_unpacklo_epi16(px, _mm_unpackhi_epi64(px, px));
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weightPair(w[k], w[k+1]))));
+			}
+			if(k<taps) {
+				__m128i px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), zero), zero);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weightPair(w[k], 0))));
+			}
+			acc = _mm_srai_epi32(acc, WEIGHT_BITS);
+			acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), zero);
+			out[x] = clampPremultiplied(quint32(_mm_cvtsi128_si32(acc)));
+#else
+			int acc[4] = {0, 0, 0, 0};
+			for(;k<taps;++k) {
+				const quint32 px = p[k];
+				acc[0] += w[k] * int(px & 0xff);
+				acc[1] += w[k] * int((px >> 8) & 0xff);
+				acc[2] += w[k] * int((px >> 16) & 0xff);
+				acc[3] += w[k] * int(px >> 24);
+			}
+			out[x] = clampPremultiplied(channel(acc[0]) | (channel(acc[1]) << 8) | (channel(acc[2]) << 16) | (channel(acc[3]) << 24));
+#endif
+		}
+	}
+}
+
+#ifdef IMAGESCALER_AVX2
+__attribute__((target("avx2")))
+static inline __m256i clampPremultiplied(__m256i p)
+{
+	__m256i a = _mm256_srli_epi32(p, 24);
+	a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+	a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+	return _mm256_min_epu8(p, a);
+}
+
+/**
+  The AVX2 version of the vertical pass for one output row, eight pixels at a time.
+  \return the number of pixels done
+  */
+__attribute__((target("avx2")))
+static int verticalPassAvx2(const quint32 *rows, int width, const qint16 *w, int taps, quint32 *out)
+{
+	int x=0;
+	const __m256i zero = _mm256_setzero_si256();
+	for(;x+8<=width;x+=8) {
+		__m256i acc0, acc1, acc2, acc3;
+		acc0 = acc1 = acc2 = acc3 = _mm256_set1_epi32(1<<(WEIGHT_BITS-1));
+		for(int k=0;k<taps;k+=2) {
+			const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows + k * width + x));
+			const __m256i b = k+1<taps ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows + (k+1) * width + x)) : zero;
+			const __m256i ww = _mm256_set1_epi32(weightPair(w[k], k+1<taps ? w[k+1] : 0));
+
+			const __m256i alo = _mm256_unpacklo_epi8(a, zero), blo = _mm256_unpacklo_epi8(b, zero);
+			const __m256i ahi = _mm256_unpackhi_epi8(a, zero), bhi = _mm256_unpackhi_epi8(b, zero);
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(alo, blo), ww));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(alo, blo), ww));
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(ahi, bhi), ww));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(ahi, bhi), ww));
+		}
+		const __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(acc0, WEIGHT_BITS), _mm256_srai_epi32(acc1, WEIGHT_BITS));
+		const __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(acc2, WEIGHT_BITS), _mm256_srai_epi32(acc3, WEIGHT_BITS));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), clampPremultiplied(_mm256_packus_epi16(lo, hi)));
+	}
+	return x;
+}
+
+static bool detectAvx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static const bool hasAvx2 = detectAvx2();
+#endif
+
+//! Resample columns of the horizontally scaled image
+static void verticalPass(const quint32 *src, int width, quint32 *dst, int dstheight, int dststride, const FilterTable& table)
+{
+	const int taps = table.taps;
+
+	for(int y=0;y<dstheight;++y) {
+		const quint32 *rows = src + table.start.at(y) * width;
+		const qint16 *w = table.weights.constData() + y * taps;
+		quint32 *out = dst + y * dststride;
+		int x=0;
+
+#ifdef IMAGESCALER_AVX2
+		if(hasAvx2)
+			x = verticalPassAvx2(rows, width, w, taps, out);
+#endif
+#ifdef __SSE2__
+		{
+			const __m128i zero = _mm_setzero_si128();
+			for(;x+4<=width;x+=4) {
+				// Process two source rows at a time, four pixels per row
+				__m128i acc0, acc1, acc2, acc3;
+				acc0 = acc1 = acc2 = acc3 = _mm_set1_epi32(1<<(WEIGHT_BITS-1));
+				for(int k=0;k<taps;k+=2) {
+					const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + k * width + x));
+					const __m128i b = k+1<taps ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + (k+1) * width + x)) : zero;
+					const __m128i ww = _mm_set1_epi32(weightPair(w[k], k+1<taps ? w[k+1] : 0));
+
+					const __m128i alo = _mm_unpacklo_epi8(a, zero), blo = _mm_unpacklo_epi8(b, zero);
+					const __m128i ahi = _mm_unpackhi_epi8(a, zero), bhi = _mm_unpackhi_epi8(b, zero);
+					acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), ww));
+					acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), ww));
+					acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), ww));
+					acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), ww));
+				}
+				const __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, WEIGHT_BITS), _mm_srai_epi32(acc1, WEIGHT_BITS));
+				const __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, WEIGHT_BITS), _mm_srai_epi32(acc3, WEIGHT_BITS));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), clampPremultiplied(_mm_packus_epi16(lo, hi)));
+			}
+		}
+#endif
+
+		// Scalar loop for the remaining pixels
+		for(;x<width;++x) {
+			int acc[4] = {0, 0, 0, 0};
+			for(int k=0;k<taps;++k) {
+				const quint32 px = rows[k * width + x];
+				acc[0] += w[k] * int(px & 0xff);
+				acc[1] += w[k] * int((px >> 8) & 0xff);
+				acc[2] += w[k] * int((px >> 16) & 0xff);
+				acc[3] += w[k] * int(px >> 24);
+			}
+			out[x] = clampPremultiplied(channel(acc[0]) | (channel(acc[1]) << 8) | (channel(acc[2]) << 16) | (channel(acc[3]) << 24));
+		}
+	}
+}
+
+typedef FilterTable (*FilterFunction)(int srclen, int dstlen);
+
+//! Resample a 32 bit image using the given filter
+static QImage resample(const QImage& src, const QSize& size, FilterFunction filter)
+{
+	QImage dst(size, src.format());
+
+	const FilterTable htable = filter(src.width(), size.width());
+	const FilterTable vtable = filter(src.height(), size.height());
+
+	QVector<quint32> tmp(size.width() * src.height());
+	horizontalPass(reinterpret_cast<const quint32*>(src.constBits()), src.height(), src.bytesPerLine() / 4, tmp.data(), size.width(), htable);
+	verticalPass(tmp.constData(), size.width(), reinterpret_cast<quint32*>(dst.bits()), size.height(), dst.bytesPerLine() / 4, vtable);
+
+	return dst;
+}
+
+QImage ImageScaler::scale(const QImage& image, const QSize& size, Qt::AspectRatioMode mode)
+{
+	if(image.isNull())
+		return image;
+
+	QSize target = image.size();
+	target.scale(size, mode);
+	if(target.isEmpty())
+		return QImage();
+	if(target == image.size())
+		return image;
+
+	// This is a downscaler only
+	if(target.width() > image.width() || target.height() > image.height())
+		return image.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+	// Filtering is done in premultiplied space so transparent pixels don't bleed color
+	QImage img = image;
+	if(img.format() != QImage::Format_RGB32 && img.format() != QImage::Format_ARGB32_Premultiplied)
+		img = img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+
+	// Large reductions are area averaged down to twice the target size first.
+	// Lanczos filtering cost grows with the scaling ratio while area averaging stays cheap.
+	const QSize intermediate(qMin(img.width(), target.width() * 2), qMin(img.height(), target.height() * 2));
+	if(intermediate != img.size())
+		img = resample(img, intermediate, boxFilter);
+
+	return resample(img, target, lanczosFilter);
+}
@@ -0,0 +1,49 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef IMAGESCALER_H
+#define IMAGESCALER_H
+
+#include <QImage>
+
+//! High quality image downscaler
+/**
+  Downscaling is done in two steps: large reductions are first area-averaged
+  to twice the target size and the remainder is done with a Lanczos-3 filter.
+  Both steps are separable and run in 14-bit fixed point. The inner loops are
+  vectorized with SSE2 (and AVX2, if the processor supports it.)
+
+  This is considerably faster than QImage::scaled(..., Qt::SmoothTransformation)
+  for large scaling ratios, e.g. when making thumbnails of camera images.
+  */
+class ImageScaler
+{
+public:
+	/**
+	 * \brief Scale an image down to the given size.
+	 *
+	 * If the target size is larger than the image in either dimension, the
+	 * image is scaled with QImage::scaled instead.
+	 * The returned image is in ARGB32_Premultiplied or RGB32 format.
+	 * \param image the image to scale
+	 * \param size the target size
+	 * \param mode aspect ratio mode, as in QImage::scaled()
+	 * \return scaled image
+	 */
+	static QImage scale(const QImage& image, const QSize& size, Qt::AspectRatioMode mode=Qt::IgnoreAspectRatio);
+};
+
+#endif // IMAGESCALER_H
@@ -198,6 +198,7 @@ void ImageView::saveTitle()
 void ImageView::saveTags()
 {
 	m_picture.saveTags(m_gallery->database(), m_ui->tagedit->text());
+	m_gallery->database()->saveRuleProfile();
 	m_ui->alltags->setText(TagSet::getForPicture(m_gallery->database(), m_picture.id()).toString());
 	emit changed();
 }
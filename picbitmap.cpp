@@ -0,0 +1,601 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDataStream>
+#include <QtAlgorithms>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "picbitmap.h"
+
+typedef PicBitmap::Container Container;
+
+//! Largest number of values kept in a sparse container
+static const int ARRAY_MAX = 4096;
+
+//! Number of 64 bit words in a dense container
+static const int BITMAP_WORDS = 65536 / 64;
+
+static inline int popcount(quint64 word)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(word);
+#else
+	word = word - ((word >> 1) & Q_UINT64_C(0x5555555555555555));
+	word = (word & Q_UINT64_C(0x3333333333333333)) + ((word >> 2) & Q_UINT64_C(0x3333333333333333));
+	word = (word + (word >> 4)) & Q_UINT64_C(0x0f0f0f0f0f0f0f0f);
+	return int((word * Q_UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+static inline bool testBit(const QVector<quint64> &bits, quint16 value)
+{
+	return bits.at(value >> 6) & (Q_UINT64_C(1) << (value & 63));
+}
+
+static int countBits(const QVector<quint64> &bits)
+{
+	int count = 0;
+	const quint64 *w = bits.constData();
+	for(int i=0;i<BITMAP_WORDS;++i)
+		count += popcount(w[i]);
+	return count;
+}
+
+//! Convert a sparse container to a dense one
+static void toBitmap(Container &c)
+{
+	c.bits.fill(0, BITMAP_WORDS);
+	quint64 *w = c.bits.data();
+	foreach(quint16 v, c.array)
+		w[v >> 6] |= Q_UINT64_C(1) << (v & 63);
+	c.array.clear();
+}
+
+//! Convert a dense container to a sparse one
+static void toArray(Container &c)
+{
+	c.array.clear();
+	c.array.reserve(c.card);
+	const quint64 *w = c.bits.constData();
+	for(int i=0;i<BITMAP_WORDS;++i) {
+		quint64 word = w[i];
+		while(word) {
+			const int bit = popcount((word & -word) - 1);
+			c.array.append(quint16(i * 64 + bit));
+			word &= word - 1;
+		}
+	}
+	c.bits.clear();
+}
+
+//! Make sure the container uses the appropriate representation for its size
+static void normalize(Container &c)
+{
+	if(c.isBitmap()) {
+		if(c.card <= ARRAY_MAX)
+			toArray(c);
+	} else if(c.card > ARRAY_MAX) {
+		toBitmap(c);
+	}
+}
+
+enum BitOp { AND, OR, ANDNOT };
+
+//! Combine two dense containers word by word
+static void combineBitmaps(Container &result, const Container &a, const Container &b, BitOp op)
+{
+	result.bits.resize(BITMAP_WORDS);
+	quint64 *r = result.bits.data();
+	const quint64 *wa = a.bits.constData();
+	const quint64 *wb = b.bits.constData();
+
+	int i=0;
+#ifdef __SSE2__
+	for(;i<BITMAP_WORDS;i+=2) {
+		const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(wa+i));
+		const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(wb+i));
+		__m128i vr;
+		switch(op) {
+		case AND: vr = _mm_and_si128(va, vb); break;
+		case OR: vr = _mm_or_si128(va, vb); break;
+		default: vr = _mm_andnot_si128(vb, va); break;
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(r+i), vr);
+	}
+#endif
+	for(;i<BITMAP_WORDS;++i) {
+		switch(op) {
+		case AND: r[i] = wa[i] & wb[i]; break;
+		case OR: r[i] = wa[i] | wb[i]; break;
+		default: r[i] = wa[i] & ~wb[i]; break;
+		}
+	}
+	result.card = countBits(result.bits);
+}
+
+//! Find the first position at or after pos where array[pos] >= value, by galloping search
+static int gallop(const QVector<quint16> &array, int pos, quint16 value)
+{
+	const int size = array.size();
+	int step = 1;
+	int hi = pos;
+	while(hi < size && array.at(hi) < value) {
+		pos = hi + 1;
+		hi += step;
+		step *= 2;
+	}
+	const quint16 *end = array.constData() + qMin(hi + 1, size);
+	return qLowerBound(array.constData() + pos, end, value) - array.constData();
+}
+
+static Container intersect(const Container &a, const Container &b)
+{
+	Container result;
+	result.key = a.key;
+
+	if(a.isBitmap() && b.isBitmap()) {
+		combineBitmaps(result, a, b, AND);
+		normalize(result);
+
+	} else if(a.isBitmap() || b.isBitmap()) {
+		// Filter the sparse container with the dense one
+		const Container &sparse = a.isBitmap() ? b : a;
+		const Container &dense = a.isBitmap() ? a : b;
+		result.array.reserve(sparse.card);
+		foreach(quint16 v, sparse.array)
+			if(testBit(dense.bits, v))
+				result.array.append(v);
+		result.card = result.array.size();
+
+	} else {
+		// Sorted list intersection. Gallop through the longer list if the sizes differ a lot.
+		const QVector<quint16> &small = a.card <= b.card ? a.array : b.array;
+		const QVector<quint16> &large = a.card <= b.card ? b.array : a.array;
+		result.array.reserve(small.size());
+		if(small.size() * 32 < large.size()) {
+			int pos = 0;
+			foreach(quint16 v, small) {
+				pos = gallop(large, pos, v);
+				if(pos >= large.size())
+					break;
+				if(large.at(pos) == v)
+					result.array.append(v);
+			}
+		} else {
+			int i=0, j=0;
+			while(i<small.size() && j<large.size()) {
+				if(small.at(i) < large.at(j))
+					++i;
+				else if(small.at(i) > large.at(j))
+					++j;
+				else {
+					result.array.append(small.at(i));
+					++i;
+					++j;
+				}
+			}
+		}
+		result.card = result.array.size();
+	}
+	return result;
+}
+
+static int intersectCount(const Container &a, const Container &b)
+{
+	int count = 0;
+
+	if(a.isBitmap() && b.isBitmap()) {
+		const quint64 *wa = a.bits.constData();
+		const quint64 *wb = b.bits.constData();
+		for(int i=0;i<BITMAP_WORDS;++i)
+			count += popcount(wa[i] & wb[i]);
+
+	} else if(a.isBitmap() || b.isBitmap()) {
+		const Container &sparse = a.isBitmap() ? b : a;
+		const Container &dense = a.isBitmap() ? a : b;
+		foreach(quint16 v, sparse.array)
+			if(testBit(dense.bits, v))
+				++count;
+
+	} else {
+		const QVector<quint16> &small = a.card <= b.card ? a.array : b.array;
+		const QVector<quint16> &large = a.card <= b.card ? b.array : a.array;
+		if(small.size() * 32 < large.size()) {
+			int pos = 0;
+			foreach(quint16 v, small) {
+				pos = gallop(large, pos, v);
+				if(pos >= large.size())
+					break;
+				if(large.at(pos) == v)
+					++count;
+			}
+		} else {
+			int i=0, j=0;
+			while(i<small.size() && j<large.size()) {
+				if(small.at(i) < large.at(j))
+					++i;
+				else if(small.at(i) > large.at(j))
+					++j;
+				else {
+					++count;
+					++i;
+					++j;
+				}
+			}
+		}
+	}
+	return count;
+}
+
+static Container unite(const Container &a, const Container &b)
+{
+	Container result;
+	result.key = a.key;
+
+	if(a.isBitmap() && b.isBitmap()) {
+		combineBitmaps(result, a, b, OR);
+
+	} else if(a.isBitmap() || b.isBitmap()) {
+		// Set the sparse container's bits in a copy of the dense one
+		const Container &sparse = a.isBitmap() ? b : a;
+		result = a.isBitmap() ? a : b;
+		quint64 *w = result.bits.data();
+		foreach(quint16 v, sparse.array) {
+			const quint64 mask = Q_UINT64_C(1) << (v & 63);
+			if(!(w[v >> 6] & mask)) {
+				w[v >> 6] |= mask;
+				++result.card;
+			}
+		}
+
+	} else {
+		result.array.reserve(a.card + b.card);
+		int i=0, j=0;
+		while(i<a.array.size() && j<b.array.size()) {
+			if(a.array.at(i) < b.array.at(j))
+				result.array.append(a.array.at(i++));
+			else if(a.array.at(i) > b.array.at(j))
+				result.array.append(b.array.at(j++));
+			else {
+				result.array.append(a.array.at(i++));
+				++j;
+			}
+		}
+		while(i<a.array.size())
+			result.array.append(a.array.at(i++));
+		while(j<b.array.size())
+			result.array.append(b.array.at(j++));
+		result.card = result.array.size();
+		normalize(result);
+	}
+	return result;
+}
+
+static Container subtract(const Container &a, const Container &b)
+{
+	Container result;
+	result.key = a.key;
+
+	if(a.isBitmap() && b.isBitmap()) {
+		combineBitmaps(result, a, b, ANDNOT);
+		normalize(result);
+
+	} else if(a.isBitmap()) {
+		// Clear the sparse container's bits from a copy of the dense one
+		result = a;
+		quint64 *w = result.bits.data();
+		foreach(quint16 v, b.array) {
+			const quint64 mask = Q_UINT64_C(1) << (v & 63);
+			if(w[v >> 6] & mask) {
+				w[v >> 6] &= ~mask;
+				--result.card;
+			}
+		}
+		normalize(result);
+
+	} else if(b.isBitmap()) {
+		result.array.reserve(a.card);
+		foreach(quint16 v, a.array)
+			if(!testBit(b.bits, v))
+				result.array.append(v);
+		result.card = result.array.size();
+
+	} else {
+		result.array.reserve(a.card);
+		int i=0, j=0;
+		while(i<a.array.size()) {
+			if(j>=b.array.size() || a.array.at(i) < b.array.at(j))
+				result.array.append(a.array.at(i++));
+			else if(a.array.at(i) > b.array.at(j))
+				++j;
+			else {
+				++i;
+				++j;
+			}
+		}
+		result.card = result.array.size();
+	}
+	return result;
+}
+
+PicBitmap::PicBitmap()
+{
+}
+
+PicBitmap PicBitmap::fromVector(const QVector<int>& ids)
+{
+	QVector<int> sorted = ids;
+	qSort(sorted);
+
+	PicBitmap bitmap;
+	foreach(int id, sorted)
+		bitmap.add(id);
+	return bitmap;
+}
+
+/**
+  \return index of the container or -(insertion point + 1) if not found
+  */
+int PicBitmap::find(quint16 key) const
+{
+	// Fast path for appending in ascending order
+	if(!m_containers.isEmpty() && m_containers.last().key == key)
+		return m_containers.size() - 1;
+
+	int lo=0, hi=m_containers.size()-1;
+	while(lo<=hi) {
+		const int mid = (lo + hi) / 2;
+		const quint16 k = m_containers.at(mid).key;
+		if(k < key)
+			lo = mid + 1;
+		else if(k > key)
+			hi = mid - 1;
+		else
+			return mid;
+	}
+	return -(lo + 1);
+}
+
+void PicBitmap::add(int id)
+{
+	Q_ASSERT(id>=0);
+	const quint16 key = quint16(id >> 16);
+	const quint16 value = quint16(id & 0xffff);
+
+	int i = find(key);
+	if(i<0) {
+		i = -i - 1;
+		Container c;
+		c.key = key;
+		m_containers.insert(i, c);
+	}
+
+	Container &c = m_containers[i];
+	if(c.isBitmap()) {
+		const quint64 mask = Q_UINT64_C(1) << (value & 63);
+		if(!(c.bits.at(value >> 6) & mask)) {
+			c.bits[value >> 6] |= mask;
+			++c.card;
+		}
+	} else {
+		if(c.array.isEmpty() || c.array.last() < value) {
+			// Fast path for adding in ascending order
+			c.array.append(value);
+		} else {
+			QVector<quint16>::iterator pos = qLowerBound(c.array.begin(), c.array.end(), value);
+			if(*pos == value)
+				return;
+			c.array.insert(pos, value);
+		}
+		++c.card;
+		normalize(c);
+	}
+}
+
+void PicBitmap::remove(int id)
+{
+	const int i = find(quint16(id >> 16));
+	if(i<0)
+		return;
+
+	const quint16 value = quint16(id & 0xffff);
+	Container &c = m_containers[i];
+	if(c.isBitmap()) {
+		const quint64 mask = Q_UINT64_C(1) << (value & 63);
+		if(c.bits.at(value >> 6) & mask) {
+			c.bits[value >> 6] &= ~mask;
+			--c.card;
+			normalize(c);
+		}
+	} else {
+		QVector<quint16>::iterator pos = qBinaryFind(c.array.begin(), c.array.end(), value);
+		if(pos != c.array.end()) {
+			c.array.erase(pos);
+			--c.card;
+		}
+	}
+
+	if(c.card==0)
+		m_containers.remove(i);
+}
+
+bool PicBitmap::contains(int id) const
+{
+	const int i = find(quint16(id >> 16));
+	if(i<0)
+		return false;
+
+	const quint16 value = quint16(id & 0xffff);
+	const Container &c = m_containers.at(i);
+	if(c.isBitmap())
+		return testBit(c.bits, value);
+	return qBinaryFind(c.array.constBegin(), c.array.constEnd(), value) != c.array.constEnd();
+}
+
+int PicBitmap::count() const
+{
+	int count = 0;
+	foreach(const Container &c, m_containers)
+		count += c.card;
+	return count;
+}
+
+QVector<int> PicBitmap::toVector() const
+{
+	QVector<int> ids;
+	ids.reserve(count());
+	foreach(const Container &c, m_containers) {
+		const int high = int(c.key) << 16;
+		if(c.isBitmap()) {
+			const quint64 *w = c.bits.constData();
+			for(int i=0;i<BITMAP_WORDS;++i) {
+				quint64 word = w[i];
+				while(word) {
+					ids.append(high | (i * 64 + popcount((word & -word) - 1)));
+					word &= word - 1;
+				}
+			}
+		} else {
+			foreach(quint16 v, c.array)
+				ids.append(high | v);
+		}
+	}
+	return ids;
+}
+
+PicBitmap PicBitmap::operator&(const PicBitmap &other) const
+{
+	PicBitmap result;
+	int i=0, j=0;
+	while(i<m_containers.size() && j<other.m_containers.size()) {
+		const Container &a = m_containers.at(i);
+		const Container &b = other.m_containers.at(j);
+		if(a.key < b.key)
+			++i;
+		else if(a.key > b.key)
+			++j;
+		else {
+			Container c = intersect(a, b);
+			if(c.card>0)
+				result.m_containers.append(c);
+			++i;
+			++j;
+		}
+	}
+	return result;
+}
+
+int PicBitmap::intersectionCount(const PicBitmap &other) const
+{
+	int count = 0;
+	int i=0, j=0;
+	while(i<m_containers.size() && j<other.m_containers.size()) {
+		const Container &a = m_containers.at(i);
+		const Container &b = other.m_containers.at(j);
+		if(a.key < b.key)
+			++i;
+		else if(a.key > b.key)
+			++j;
+		else {
+			count += intersectCount(a, b);
+			++i;
+			++j;
+		}
+	}
+	return count;
+}
+
+PicBitmap PicBitmap::operator|(const PicBitmap &other) const
+{
+	PicBitmap result;
+	int i=0, j=0;
+	while(i<m_containers.size() || j<other.m_containers.size()) {
+		if(j>=other.m_containers.size() || (i<m_containers.size() && m_containers.at(i).key < other.m_containers.at(j).key))
+			result.m_containers.append(m_containers.at(i++));
+		else if(i>=m_containers.size() || m_containers.at(i).key > other.m_containers.at(j).key)
+			result.m_containers.append(other.m_containers.at(j++));
+		else
+			result.m_containers.append(unite(m_containers.at(i++), other.m_containers.at(j++)));
+	}
+	return result;
+}
+
+PicBitmap PicBitmap::operator-(const PicBitmap &other) const
+{
+	PicBitmap result;
+	int j=0;
+	for(int i=0;i<m_containers.size();++i) {
+		const Container &a = m_containers.at(i);
+		while(j<other.m_containers.size() && other.m_containers.at(j).key < a.key)
+			++j;
+
+		if(j<other.m_containers.size() && other.m_containers.at(j).key == a.key) {
+			Container c = subtract(a, other.m_containers.at(j));
+			if(c.card>0)
+				result.m_containers.append(c);
+		} else {
+			result.m_containers.append(a);
+		}
+	}
+	return result;
+}
+
+bool PicBitmap::operator==(const PicBitmap &other) const
+{
+	if(m_containers.size() != other.m_containers.size())
+		return false;
+
+	for(int i=0;i<m_containers.size();++i) {
+		const Container &a = m_containers.at(i);
+		const Container &b = other.m_containers.at(i);
+		if(a.key != b.key || a.card != b.card || a.array != b.array || a.bits != b.bits)
+			return false;
+	}
+	return true;
+}
+
+QDataStream &operator<<(QDataStream &out, const PicBitmap &bitmap)
+{
+	out << quint32(bitmap.m_containers.size());
+	foreach(const Container &c, bitmap.m_containers)
+		out << c.key << c.array << c.bits;
+	return out;
+}
+
+QDataStream &operator>>(QDataStream &in, PicBitmap &bitmap)
+{
+	quint32 count;
+	in >> count;
+	bitmap.m_containers.clear();
+	for(quint32 i=0;i<count && in.status()==QDataStream::Ok;++i) {
+		Container c;
+		in >> c.key >> c.array >> c.bits;
+		if(c.isBitmap()) {
+			if(c.bits.size() != BITMAP_WORDS) {
+				in.setStatus(QDataStream::ReadCorruptData);
+				break;
+			}
+			c.card = countBits(c.bits);
+		} else {
+			c.card = c.array.size();
+		}
+		bitmap.m_containers.append(c);
+	}
+	return in;
+}
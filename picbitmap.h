@@ -0,0 +1,113 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef PICBITMAP_H
+#define PICBITMAP_H
+
+#include <QVector>
+
+class QDataStream;
+
+/**
+  \brief A compressed bitmap of picture IDs
+
+  The bitmap is split into containers of 65536 IDs keyed by the high 16 bits
+  of the ID (as in Roaring bitmaps.) A sparse container is stored as a sorted
+  array of the low 16 bits. When a container holds more than 4096 values, it is
+  converted to a plain 8 KiB bitmap.
+
+  Set operations work container by container, so their cost depends on the
+  size of the bitmaps, not the range of IDs.
+  */
+class PicBitmap
+{
+	friend QDataStream &operator<<(QDataStream &out, const PicBitmap &bitmap);
+	friend QDataStream &operator>>(QDataStream &in, PicBitmap &bitmap);
+public:
+	PicBitmap();
+
+	//! Construct from a list of IDs (need not be sorted)
+	static PicBitmap fromVector(const QVector<int>& ids);
+
+	//! Add an ID to the set
+	void add(int id);
+
+	//! Remove an ID from the set
+	void remove(int id);
+
+	//! Is the ID in the set
+	bool contains(int id) const;
+
+	//! Get the number of IDs in the set
+	int count() const;
+
+	//! Is the set empty
+	bool isEmpty() const { return m_containers.isEmpty(); }
+
+	//! Remove all IDs
+	void clear() { m_containers.clear(); }
+
+	//! Get the IDs in ascending order
+	QVector<int> toVector() const;
+
+	//! Intersection
+	PicBitmap operator&(const PicBitmap &other) const;
+
+	//! Union
+	PicBitmap operator|(const PicBitmap &other) const;
+
+	//! Difference
+	PicBitmap operator-(const PicBitmap &other) const;
+
+	//! Size of the intersection. This is faster than counting the result of operator&.
+	int intersectionCount(const PicBitmap &other) const;
+
+	PicBitmap &operator&=(const PicBitmap &other) { return *this = *this & other; }
+	PicBitmap &operator|=(const PicBitmap &other) { return *this = *this | other; }
+	PicBitmap &operator-=(const PicBitmap &other) { return *this = *this - other; }
+
+	bool operator==(const PicBitmap &other) const;
+	bool operator!=(const PicBitmap &other) const { return !(*this == other); }
+
+	//! A container of up to 65536 IDs sharing the same high bits
+	struct Container {
+		Container() : key(0), card(0) { }
+
+		bool isBitmap() const { return !bits.isEmpty(); }
+
+		//! The high 16 bits of the IDs
+		quint16 key;
+
+		//! Number of IDs in this container
+		int card;
+
+		//! The low 16 bits of the IDs in ascending order (sparse container)
+		QVector<quint16> array;
+
+		//! A bit for each possible ID (dense container)
+		QVector<quint64> bits;
+	};
+
+private:
+	int find(quint16 key) const;
+
+	QVector<Container> m_containers;
+};
+
+QDataStream &operator<<(QDataStream &out, const PicBitmap &bitmap);
+QDataStream &operator>>(QDataStream &in, PicBitmap &bitmap);
+
+#endif // PICBITMAP_H
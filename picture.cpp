@@ -22,6 +22,7 @@
 #include "gallery.h"
 #include "tagrules.h"
 #include "iconcache.h"
+#include "savedqueries.h"
 
 Picture::Picture()
 	: m_id(0), m_relativename(QString()), m_hidden(false), m_title(QString()), m_tags(QString()), m_rotation(0), m_hash(QString())
@@ -55,6 +56,7 @@ void Picture::deleteFile(Gallery *gallery)
 		Database::showError("Couldn't delete file!", q);
 		return;
 	}
+	gallery->database()->savedQueries()->removePicture(m_id);
 
 	QFile(fullpath(gallery)).remove();
 
@@ -108,7 +110,7 @@ void Picture::saveTags(Database *db, const QString& tags)
 
 	TagIdSet tagset = TagIdSet(TagSet::parse(tags), db->tags(), m_id);
 
-	TagImplications::load(db).apply(tagset);
+	db->tagRules().apply(tagset, db->ruleProfile());
 
 	tagset.save(db);
 }
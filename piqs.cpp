@@ -41,10 +41,14 @@
 #include "slideshowoptions.h"
 
 #include "rescandialog.h"
+#include "thumbnailthread.h"
+#include "cachecleanthread.h"
+#include "tagrebuildthread.h"
 #include "slideshow.h"
+#include "savedqueries.h"
 
 Piqs::Piqs(const QString& root, QWidget *parent)
-    : QMainWindow(parent)
+    : QMainWindow(parent), m_thumbnailer(0), m_cachecleaner(0), m_tagrebuilder(0)
 {
 	setAttribute(Qt::WA_DeleteOnClose, true);
 
@@ -59,6 +63,9 @@ Piqs::Piqs(const QString& root, QWidget *parent)
 	filemenu->addAction(m_act_quickscan);
 	filemenu->addAction(m_act_tagrules);
 	filemenu->addAction(m_act_taglist);
+	filemenu->addAction(m_act_ruleprofile);
+	filemenu->addAction(m_act_thumbnails);
+	filemenu->addAction(m_act_cleancache);
 	filemenu->addSeparator();
 	filemenu->addAction(m_act_exit);
 
@@ -72,6 +79,14 @@ Piqs::Piqs(const QString& root, QWidget *parent)
 	querymenu->addAction(makeQueryAction(tr("&File..."), ":file(%1)", tr("Show images in whose file names the given string appears"), tr("Filename")));
 	querymenu->addAction(makeQueryAction(tr("&Title..."), ":title(%1)", tr("Show images in whose titles the given string appears"), tr("Title")));
 	querymenu->addAction(makeQueryAction(tr("Ha&sh..."), ":hash(%1)", tr("Show images whose SHA-1 hash starts with the given string"), tr("SHA-1 hash")));
+	querymenu->addSeparator();
+	m_savedquerymenu = querymenu->addMenu(tr("Sa&ved queries"));
+	connect(m_savedquerymenu, SIGNAL(aboutToShow()), this, SLOT(updateSavedQueryMenu()));
+	querymenu->addAction(m_act_savequery);
+	querymenu->addAction(m_act_deletequery);
+	querymenu->addSeparator();
+	querymenu->addAction(m_act_querystats);
+	querymenu->addAction(m_act_facets);
 
 	connect(querymenu, SIGNAL(triggered(QAction*)), this, SLOT(queryMenuTriggered(QAction*)));
 
@@ -103,6 +118,8 @@ Piqs::Piqs(const QString& root, QWidget *parent)
 	this->setWindowTitle(QString("%1 - Piqs").arg(QDir(m_gallery->root().absolutePath()).dirName()));
 
 	// Create status bar widgets
+	m_jobstatus = new QLabel(this);
+	this->statusBar()->addPermanentWidget(m_jobstatus);
 	m_piccount = new QLabel(this);
 	this->statusBar()->addPermanentWidget(m_piccount);
 	m_message = new QLabel(this);
@@ -122,6 +139,7 @@ Piqs::Piqs(const QString& root, QWidget *parent)
 
 	connect(m_browser, SIGNAL(pictureSelected(Picture)), this, SLOT(showPicture(Picture)));
 	connect(m_browser, SIGNAL(pictureCountChanged(int,int)), this, SLOT(setPictureCount(int,int)));
+	connect(m_browser, SIGNAL(queryTimed(QString)), this, SLOT(showQueryStats(QString)));
 	connect(m_viewer, SIGNAL(exitView()), this, SLOT(showBrowser()));
 	connect(m_viewer, SIGNAL(requestNext()), this, SLOT(showNextPicture()));
 	connect(m_viewer, SIGNAL(requestPrev()), this, SLOT(showPreviousPicture()));
@@ -141,6 +159,23 @@ Piqs::Piqs(const QString& root, QWidget *parent)
 
 	m_viewer->setAutofit(m_gallery->database()->getSetting("viewer.autofit").toBool());
 
+	m_act_thumbnails->setChecked(m_gallery->database()->getSetting("thumbnails.pregenerate").toBool());
+	connect(m_act_thumbnails, SIGNAL(toggled(bool)), this, SLOT(setThumbnailGeneration(bool)));
+
+	m_act_ruleprofile->setChecked(m_gallery->database()->getSetting("tagrules.profile").toBool());
+	connect(m_act_ruleprofile, SIGNAL(toggled(bool)), this, SLOT(setRuleProfiling(bool)));
+
+	m_act_querystats->setChecked(m_gallery->database()->getSetting("query.showstats").toBool());
+	connect(m_act_querystats, SIGNAL(toggled(bool)), this, SLOT(setQueryStats(bool)));
+
+	m_act_facets->setChecked(m_gallery->database()->getSetting("browser.facets").toBool());
+	m_browser->setFacetsVisible(m_act_facets->isChecked());
+	connect(m_act_facets, SIGNAL(toggled(bool)), this, SLOT(setFacetsVisible(bool)));
+
+	// Flat queries and the tag facets use the bitmap index when it is in memory.
+	// It is normally read from tagindex.dat, so loading it up front is cheap.
+	m_gallery->database()->tagIndex()->load();
+
 	if(m_gallery->totalCount()==0)
 		rescan();
 }
@@ -195,7 +230,9 @@ bool Piqs::isGalleryDir(const QString& dir) const
 void Piqs::rescan()
 {
 	RescanDialog *rescan = new RescanDialog(m_gallery, this);
+	connect(rescan, SIGNAL(rescanComplete()), this, SLOT(tagMapChanged()));
 	connect(rescan, SIGNAL(rescanComplete()), m_browser, SLOT(refreshQuery()));
+	connect(rescan, SIGNAL(rescanComplete()), this, SLOT(startThumbnailGeneration()));
 	QTimer::singleShot(0, rescan, SLOT(rescan()));
 }
 
@@ -203,13 +240,217 @@ void Piqs::quickscan()
 {
 	RescanDialog *rescan = new RescanDialog(m_gallery, this);
 	rescan->setQuickmode(true);
+	connect(rescan, SIGNAL(rescanComplete()), this, SLOT(tagMapChanged()));
 	connect(rescan, SIGNAL(rescanComplete()), m_browser, SLOT(refreshQuery()));
+	connect(rescan, SIGNAL(rescanComplete()), this, SLOT(startThumbnailGeneration()));
 	QTimer::singleShot(0, rescan, SLOT(rescan()));
 }
 
+void Piqs::tagMapChanged()
+{
+	m_gallery->database()->tagMapChanged();
+}
+
+void Piqs::setThumbnailGeneration(bool enable)
+{
+	m_gallery->database()->saveSetting("thumbnails.pregenerate", enable);
+	if(enable)
+		startThumbnailGeneration();
+	else if(m_thumbnailer!=0)
+		m_thumbnailer->abort();
+}
+
+void Piqs::startThumbnailGeneration()
+{
+	if(m_thumbnailer!=0 || !m_act_thumbnails->isChecked())
+		return;
+
+	// Budgets are given as percentage of CPU time and kilobytes of source images read per second
+	bool ok;
+	int cpubudget = m_gallery->database()->getSetting("thumbnails.cpubudget").toInt(&ok);
+	if(!ok)
+		cpubudget = 25;
+	int iobudget = m_gallery->database()->getSetting("thumbnails.iobudget").toInt();
+
+	m_thumbnailer = new ThumbnailThread(m_gallery, cpubudget, iobudget, this);
+	connect(m_thumbnailer, SIGNAL(progress(int,int)), this, SLOT(thumbnailProgress(int,int)));
+	connect(m_thumbnailer, SIGNAL(finished()), this, SLOT(thumbnailGenerationFinished()));
+	connect(m_browser, SIGNAL(viewScrolled()), m_thumbnailer, SLOT(pause()));
+
+	m_thumbnailer->start(QThread::LowestPriority);
+}
+
+void Piqs::thumbnailProgress(int done, int total)
+{
+	if(done<total)
+		m_jobstatus->setText(tr("Generating thumbnails: %1/%2").arg(done).arg(total));
+	else
+		m_jobstatus->setText(QString());
+}
+
+void Piqs::thumbnailGenerationFinished()
+{
+	m_jobstatus->setText(QString());
+	m_thumbnailer->deleteLater();
+	m_thumbnailer = 0;
+}
+
+void Piqs::cleanThumbnailCache()
+{
+	if(m_cachecleaner!=0)
+		return;
+
+	m_cachecleaner = new CacheCleanThread(m_gallery, this);
+	connect(m_cachecleaner, SIGNAL(progress(int,int)), this, SLOT(cacheCleanProgress(int,int)));
+	connect(m_cachecleaner, SIGNAL(cleaned(int,int,qint64)), this, SLOT(cacheCleaned(int,int,qint64)));
+	connect(m_cachecleaner, SIGNAL(finished()), this, SLOT(cacheCleanFinished()));
+
+	m_act_cleancache->setEnabled(false);
+	m_cachecleaner->start(QThread::LowestPriority);
+}
+
+void Piqs::cacheCleanProgress(int done, int total)
+{
+	m_jobstatus->setText(tr("Cleaning thumbnail cache: %1%").arg(total>0 ? done * 100 / total : 100));
+}
+
+void Piqs::cacheCleaned(int orphans, int corrupt, qint64 bytes)
+{
+	statusBar()->showMessage(tr("Removed %1 orphaned and %2 corrupt thumbnails (%3 KiB reclaimed)")
+							 .arg(orphans).arg(corrupt).arg(bytes / 1024), 10000);
+}
+
+void Piqs::setQueryStats(bool enable)
+{
+	m_gallery->database()->saveSetting("query.showstats", enable);
+}
+
+void Piqs::setRuleProfiling(bool enable)
+{
+	m_gallery->database()->saveSetting("tagrules.profile", enable);
+	m_gallery->database()->setRuleProfiling(enable);
+}
+
+void Piqs::setFacetsVisible(bool visible)
+{
+	m_gallery->database()->saveSetting("browser.facets", visible);
+	m_browser->setFacetsVisible(visible);
+}
+
+void Piqs::showQueryStats(const QString& summary)
+{
+	if(m_act_querystats->isChecked())
+		statusBar()->showMessage(tr("Query: %1").arg(summary), 10000);
+}
+
+void Piqs::saveQuery()
+{
+	QString query = m_browser->getQuery();
+	if(query.isEmpty() || BrowserWidget::isSpecialQuery(query.toLower())) {
+		QMessageBox::information(this, tr("Save query"), tr("Only tag queries can be saved."));
+		return;
+	}
+
+	// Queries in the search box are lowercased, so the names must be too
+	QString name = QInputDialog::getText(this, tr("Save query"), tr("Name")).trimmed().toLower();
+	if(name.isEmpty())
+		return;
+
+	if(!m_gallery->database()->savedQueries()->save(name, query.toLower())) {
+		QMessageBox::warning(this, tr("Save query"), tr("Couldn't parse query."));
+		return;
+	}
+
+	showBrowser();
+	m_browser->setQuery(":saved(" + name + ")");
+}
+
+void Piqs::deleteSavedQuery()
+{
+	QStringList names = m_gallery->database()->savedQueries()->names();
+	if(names.isEmpty())
+		return;
+
+	bool ok;
+	QString name = QInputDialog::getItem(this, tr("Delete saved query"), tr("Query"), names, 0, false, &ok);
+	if(ok)
+		m_gallery->database()->savedQueries()->remove(name);
+}
+
+void Piqs::updateSavedQueryMenu()
+{
+	m_savedquerymenu->clear();
+
+	const SavedQueries *saved = m_gallery->database()->savedQueries();
+	foreach(const QString &name, saved->names()) {
+		QAction *act = makeQueryAction(name, ":saved(" + name + ")", saved->query(name));
+		// Owned by the menu, so clear() deletes it
+		act->setParent(m_savedquerymenu);
+		m_savedquerymenu->addAction(act);
+	}
+
+	if(m_savedquerymenu->isEmpty())
+		m_savedquerymenu->addAction(tr("(none)"))->setEnabled(false);
+}
+
+void Piqs::cacheCleanFinished()
+{
+	m_jobstatus->setText(QString());
+	m_act_cleancache->setEnabled(true);
+	m_cachecleaner->deleteLater();
+	m_cachecleaner = 0;
+}
+
+void Piqs::rebuildTagIndex()
+{
+	updateTagIndex(QVector<int>());
+}
+
+void Piqs::updateTagIndex(const QVector<int>& pictures)
+{
+	if(m_tagrebuilder!=0) {
+		// The rules changed again: everything is rebuilt when the current rebuild has stopped
+		m_tagrebuilder->abort();
+		return;
+	}
+
+	m_tagrebuilder = new TagRebuildThread(m_gallery, pictures, this);
+	connect(m_tagrebuilder, SIGNAL(progress(int,int)), this, SLOT(tagRebuildProgress(int,int)));
+	connect(m_tagrebuilder, SIGNAL(finished()), this, SLOT(tagRebuildFinished()));
+
+	m_tagrebuilder->start(QThread::LowestPriority);
+}
+
+void Piqs::tagRebuildProgress(int done, int total)
+{
+	m_jobstatus->setText(tr("Rebuilding tag index: %1%").arg(total>0 ? done * 100 / total : 100));
+}
+
+void Piqs::tagRebuildFinished()
+{
+	// Already finished by closeEvent
+	if(m_tagrebuilder==0)
+		return;
+
+	m_jobstatus->setText(QString());
+	if(m_tagrebuilder->finish()) {
+		m_browser->refreshQuery();
+		statusBar()->showMessage(tr("Tag index updated"), 10000);
+	}
+	const bool again = m_tagrebuilder->rulesChanged();
+	m_tagrebuilder->deleteLater();
+	m_tagrebuilder = 0;
+
+	// The rules were changed during the rebuild
+	if(again)
+		rebuildTagIndex();
+}
+
 void Piqs::showTagrules()
 {
 	TagDialog *dialog = new TagDialog(m_gallery, this);
+	connect(dialog, SIGNAL(rebuildRequested()), this, SLOT(rebuildTagIndex()));
+	connect(dialog, SIGNAL(updateRequested(QVector<int>)), this, SLOT(updateTagIndex(QVector<int>)));
 	dialog->setAttribute(Qt::WA_DeleteOnClose, true);
 	dialog->setModal(true);
 	dialog->show();
@@ -232,16 +473,32 @@ void Piqs::initActions()
 	m_act_quickscan = makeAction(tr("Quick scan"), "edit-redo", tr("Quickly find new and renamed images"));
 	m_act_tagrules = makeAction(tr("&Tag rules..."), "configure", tr("Edit tag inference rules"));
 	m_act_taglist = makeAction(tr("Tag list..."), 0, tr("List of all used tags"));
+	m_act_ruleprofile = makeAction(tr("Profile tag rules"), 0, tr("Record the cost of each tag rule in the ruleprofile table when tags are saved or rebuilt"));
+	m_act_ruleprofile->setCheckable(true);
+	m_act_thumbnails = makeAction(tr("Generate thumbnails"), 0, tr("Generate missing thumbnails in the background after scanning"));
+	m_act_thumbnails->setCheckable(true);
+	m_act_cleancache = makeAction(tr("Clean thumbnail cache"), 0, tr("Remove thumbnails of pictures that are no longer in the gallery"));
 	m_act_exit = makeAction(tr("E&xit"), "application-exit", tr("Exit application"), QKeySequence::Quit);
 
 	m_act_exit->setMenuRole(QAction::QuitRole);
 
+	m_act_querystats = makeAction(tr("Show query statistics"), 0, tr("Show the time spent in each phase of a tag query in the status bar"));
+	m_act_querystats->setCheckable(true);
+	m_act_facets = makeAction(tr("Show tag facets"), 0, tr("List the most common tags of the current results beside the thumbnails"));
+	m_act_facets->setCheckable(true);
+	m_act_savequery = makeAction(tr("Save query..."), 0, tr("Save the current tag query. Its results are kept up to date as tags change"));
+	m_act_deletequery = makeAction(tr("Delete saved query..."), 0, tr("Delete a saved query"));
+
+	connect(m_act_savequery, SIGNAL(triggered()), this, SLOT(saveQuery()));
+	connect(m_act_deletequery, SIGNAL(triggered()), this, SLOT(deleteSavedQuery()));
+
 	connect(m_act_open, SIGNAL(triggered()), this, SLOT(showOpenDialog()));
 	connect(m_act_rescan, SIGNAL(triggered()), this, SLOT(rescan()));
 	connect(m_act_quickscan, SIGNAL(triggered()), this, SLOT(quickscan()));
 	connect(m_act_exit, SIGNAL(triggered()), this, SLOT(close()));
 	connect(m_act_tagrules, SIGNAL(triggered()), this, SLOT(showTagrules()));
 	connect(m_act_taglist, SIGNAL(triggered()), this, SLOT(showTaglist()));
+	connect(m_act_cleancache, SIGNAL(triggered()), this, SLOT(cleanThumbnailCache()));
 
 	m_act_slideshow = makeAction(tr("&Start"), "media-playback-start", tr("Start slideshow"), QKeySequence("F9"));
 	m_act_slideselected = makeAction(tr("Limit to selection"), 0, tr("Limit slideshow to the current selection (if more than one picture is selected)"));
@@ -278,6 +535,22 @@ QAction *Piqs::makeQueryAction(const QString& title, const QString& query, const
 
 void Piqs::closeEvent(QCloseEvent *e)
 {
+	if(m_thumbnailer!=0) {
+		m_thumbnailer->abort();
+		m_thumbnailer->wait();
+	}
+	if(m_cachecleaner!=0) {
+		m_cachecleaner->abort();
+		m_cachecleaner->wait();
+	}
+	if(m_tagrebuilder!=0) {
+		m_tagrebuilder->abort();
+		m_tagrebuilder->wait();
+		m_tagrebuilder->finish();
+		m_tagrebuilder->deleteLater();
+		m_tagrebuilder = 0;
+	}
+
 	m_gallery->database()->saveSetting("window.geometry", saveGeometry().toBase64());
 	m_gallery->database()->saveSetting("viewer.autofit", m_viewer->isAutofit());
 	QMainWindow::closeEvent(e);
@@ -18,6 +18,7 @@
 #define PIQS_H
 
 #include <QMainWindow>
+#include <QVector>
 
 class QListView;
 class QStackedWidget;
@@ -27,7 +28,11 @@ class BrowserWidget;
 class ImageView;
 class Gallery;
 class Picture;
+class ThumbnailThread;
+class CacheCleanThread;
+class TagRebuildThread;
 class QAction;
+class QMenu;
 
 class Piqs : public QMainWindow
 {
@@ -80,6 +85,66 @@ protected slots:
 	//! Show dialog for opening a new main window instance
 	void showOpenDialog();
 
+	//! The tag map was changed by a rescan: reload the in-memory tag data
+	void tagMapChanged();
+
+	//! Enable or disable background thumbnail generation
+	void setThumbnailGeneration(bool enable);
+
+	//! Start generating missing thumbnails in the background, if enabled
+	void startThumbnailGeneration();
+
+	//! Show thumbnail generation progress in the status bar
+	void thumbnailProgress(int done, int total);
+
+	//! Background thumbnail generation has stopped
+	void thumbnailGenerationFinished();
+
+	//! Remove orphaned and corrupt thumbnails in the background
+	void cleanThumbnailCache();
+
+	//! Show thumbnail cache cleaning progress in the status bar
+	void cacheCleanProgress(int done, int total);
+
+	//! Report the results of thumbnail cache cleaning
+	void cacheCleaned(int orphans, int corrupt, qint64 bytes);
+
+	//! Thumbnail cache cleaning has stopped
+	void cacheCleanFinished();
+
+	//! Rebuild the tag index in the background. A running rebuild is restarted
+	void rebuildTagIndex();
+
+	//! Reapply the tag rules to the given pictures in the background
+	void updateTagIndex(const QVector<int>& pictures);
+
+	//! Show tag index rebuild progress in the status bar
+	void tagRebuildProgress(int done, int total);
+
+	//! Background tag index rebuild has stopped: take the new index into use
+	void tagRebuildFinished();
+
+	//! Enable or disable tag rule profiling
+	void setRuleProfiling(bool enable);
+
+	//! Enable or disable the query timing readout
+	void setQueryStats(bool enable);
+
+	//! Show or hide the most common tags of the current results
+	void setFacetsVisible(bool visible);
+
+	//! Show query timing in the status bar, if enabled
+	void showQueryStats(const QString& summary);
+
+	//! Save the current tag query under a name
+	void saveQuery();
+
+	//! Delete a saved query
+	void deleteSavedQuery();
+
+	//! Fill the saved query menu
+	void updateSavedQueryMenu();
+
 protected:
 	void closeEvent(QCloseEvent *e);
 
@@ -108,14 +173,37 @@ private:
 	//! Current permanent message on status bar (can be hidden by temporary messages)
 	QLabel *m_message;
 
+	//! Background job status label
+	QLabel *m_jobstatus;
+
+	//! Background thumbnail generator (if running)
+	ThumbnailThread *m_thumbnailer;
+
+	//! Background thumbnail cache cleaner (if running)
+	CacheCleanThread *m_cachecleaner;
+
+	//! Background tag index rebuilder (if running)
+	TagRebuildThread *m_tagrebuilder;
+
 	// Actions
 	QAction *m_act_open;
 	QAction *m_act_rescan;
 	QAction *m_act_quickscan;
 	QAction *m_act_tagrules;
 	QAction *m_act_taglist;
+	QAction *m_act_ruleprofile;
+	QAction *m_act_thumbnails;
+	QAction *m_act_cleancache;
 	QAction *m_act_exit;
 
+	QAction *m_act_querystats;
+	QAction *m_act_facets;
+	QAction *m_act_savequery;
+	QAction *m_act_deletequery;
+
+	//! Submenu listing the saved queries
+	QMenu *m_savedquerymenu;
+
 	QAction *m_act_slideshow;
 	QAction *m_act_slideselected;
 	QAction *m_act_slideshuffle;
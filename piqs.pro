@@ -19,9 +19,19 @@ SOURCES += main.cpp\
     browserwidget.cpp \
     imageview.cpp \
     rescanthread.cpp \
+    thumbnailthread.cpp \
+    cachecleanthread.cpp \
+    tagrebuildthread.cpp \
     rescandialog.cpp \
     tagset.cpp \
+    tagidvector.cpp \
+    picbitmap.cpp \
+    tagindex.cpp \
+    tagstore.cpp \
+    savedqueries.cpp \
+    tagfacets.cpp \
     util.cpp \
+    imagescaler.cpp \
     tagvalidator.cpp \
     tagquery.cpp \
     tagdialog.cpp \
@@ -42,9 +52,19 @@ HEADERS  += piqs.h \
     browserwidget.h \
     imageview.h \
     rescanthread.h \
+    thumbnailthread.h \
+    cachecleanthread.h \
+    tagrebuildthread.h \
     rescandialog.h \
     tagset.h \
+    tagidvector.h \
+    picbitmap.h \
+    tagindex.h \
+    tagstore.h \
+    savedqueries.h \
+    tagfacets.h \
     util.h \
+    imagescaler.h \
     tagvalidator.h \
     tagquery.h \
     tagdialog.h \
@@ -66,3 +86,7 @@ FORMS += \
 
 OTHER_FILES += \
     README.md
+
+# "make check" builds the tests and benchmarks in tests/ and runs the tests
+check.commands = $(MKDIR) tests && cd tests && $$QMAKE_QMAKE $$PWD/tests/tests.pro && $(MAKE) && ./tagrules/tst_tagrules
+QMAKE_EXTRA_TARGETS += check
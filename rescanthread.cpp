@@ -92,6 +92,9 @@ void RescanThread::run() {
 		emit foldersSearched(m_foldercount);
 		emit filesAdded(m_filecount);
 
+		// New pictures are untagged. Add them to the saved queries that match untagged pictures.
+		q.exec(QString("INSERT OR IGNORE INTO savedresult (queryid, picid) SELECT queryid, picid FROM savedquery, picture WHERE untagged!=0 AND stale=0 AND picid>%1").arg(latest));
+
 		// Find duplicate images
 		emit statusChanged(tr("Searching for duplicate images..."));
 		q.exec("DELETE FROM duplicate");
@@ -130,11 +133,17 @@ void RescanThread::run() {
 				q.exec();
 
 				q.exec("UPDATE tagmap SET picid=" + QString::number(newid) + " WHERE picid=" + QString::number(mp.first));
+
+				// The moved picture keeps its saved query memberships
+				q.exec("DELETE FROM savedresult WHERE picid=" + QString::number(newid));
+				q.exec("UPDATE savedresult SET picid=" + QString::number(newid) + " WHERE picid=" + QString::number(mp.first));
 				q.exec("DELETE FROM picture WHERE picid=" + QString::number(mp.first));
 				q.exec("DELETE FROM duplicate WHERE picid=" + QString::number(newid));
 				++moves;
 			}
 		}
+		if(moves>0)
+			Database::bumpTagMapGeneration(db);
 
 		// Count missing and duplicate files
 		int missing = 0;
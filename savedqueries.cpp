@@ -0,0 +1,274 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+#include <QtAlgorithms>
+
+#include "savedqueries.h"
+#include "database.h"
+#include "tags.h"
+#include "tagset.h"
+#include "tagstore.h"
+
+SavedQueries::SavedQueries(Database *database)
+	: m_database(database), m_loaded(false)
+{
+}
+
+void SavedQueries::createTables()
+{
+	QSqlQuery q(m_database->get());
+
+	q.exec("CREATE TABLE IF NOT EXISTS savedquery ("
+		   "queryid INTEGER PRIMARY KEY NOT NULL,"
+		   "name TEXT UNIQUE NOT NULL,"
+		   "query TEXT NOT NULL,"
+		   "untagged INTEGER NOT NULL,"
+		   "stale INTEGER NOT NULL"
+		   ")");
+
+	q.exec("CREATE TABLE IF NOT EXISTS savedresult ("
+		   "queryid INTEGER NOT NULL,"
+		   "picid INTEGER NOT NULL,"
+		   "PRIMARY KEY (queryid, picid)"
+		   ")");
+}
+
+QStringList SavedQueries::names() const
+{
+	QStringList names;
+	QSqlQuery q("SELECT name FROM savedquery ORDER BY name ASC", m_database->get());
+	while(q.next())
+		names << q.value(0).toString();
+	return names;
+}
+
+QString SavedQueries::query(const QString& name) const
+{
+	QSqlQuery q(m_database->get());
+	q.prepare("SELECT query FROM savedquery WHERE name=?");
+	q.bindValue(0, name);
+	if(q.exec() && q.next())
+		return q.value(0).toString();
+	return QString();
+}
+
+bool SavedQueries::includesHidden(const QString& name) const
+{
+	return compile(query(name)).includesHidden();
+}
+
+void SavedQueries::removePicture(int picid)
+{
+	QSqlQuery q(m_database->get());
+	if(!q.exec("DELETE FROM savedresult WHERE picid=" + QString::number(picid)))
+		qDebug() << "Couldn't delete saved query results of picture" << picid << q.lastError().text();
+}
+
+/**
+  Queries are compiled with TagQuery::queryInit, so that tags the query
+  refers to exist and keep their IDs even if no picture has them yet.
+  */
+TagQuery SavedQueries::compile(const QString& query) const
+{
+	TagQuery tq(query);
+	if(!tq.isError())
+		tq.queryInit(m_database->tags());
+	return tq;
+}
+
+bool SavedQueries::save(const QString& name, const QString& query)
+{
+	TagQuery tq = compile(query);
+	if(tq.isError())
+		return false;
+
+	remove(name);
+
+	QSqlQuery q(m_database->get());
+	q.prepare("INSERT INTO savedquery (name, query, untagged, stale) VALUES (?, ?, ?, 0)");
+	q.bindValue(0, name);
+	q.bindValue(1, query);
+	// New pictures can't be matched against metadata predicates by the rescan
+	q.bindValue(2, tq.matchesUntagged() && !tq.hasMetadata());
+	if(!q.exec()) {
+		Database::showError("Couldn't save query", q);
+		return false;
+	}
+
+	evaluate(q.lastInsertId().toInt(), tq);
+	invalidate();
+	return true;
+}
+
+void SavedQueries::remove(const QString& name)
+{
+	QSqlQuery q(m_database->get());
+	q.prepare("DELETE FROM savedresult WHERE queryid IN (SELECT queryid FROM savedquery WHERE name=?)");
+	q.bindValue(0, name);
+	q.exec();
+
+	q.prepare("DELETE FROM savedquery WHERE name=?");
+	q.bindValue(0, name);
+	if(!q.exec())
+		qDebug() << "Couldn't delete saved query" << name << q.lastError().text();
+
+	invalidate();
+}
+
+/**
+  Queries with metadata predicates are not kept up to date incrementally,
+  since metadata changes (e.g. a new title) are not tracked. They are
+  re-evaluated every time.
+  */
+void SavedQueries::refresh(const QString& name)
+{
+	QSqlQuery q(m_database->get());
+	q.prepare("SELECT queryid, query, stale FROM savedquery WHERE name=?");
+	q.bindValue(0, name);
+	if(!q.exec() || !q.next())
+		return;
+
+	const int id = q.value(0).toInt();
+	const TagQuery query = compile(q.value(1).toString());
+	if(q.value(2).toInt()==0 && !query.hasMetadata())
+		return;
+
+	evaluate(id, query);
+
+	q.exec("UPDATE savedquery SET stale=0 WHERE queryid=" + QString::number(id));
+	invalidate();
+}
+
+/**
+  All candidates in the tag store are matched, plus all untagged pictures
+  if the query matches those.
+  */
+void SavedQueries::evaluate(int id, const TagQuery& query)
+{
+	// This may be called while another transaction is open
+	const bool transaction = m_database->get().transaction();
+
+	QSqlQuery q(m_database->get());
+	q.exec("DELETE FROM savedresult WHERE queryid=" + QString::number(id));
+
+	if(!query.isError()) {
+		const TagStore *store = m_database->tagStore();
+		store->load();
+
+		q.prepare("INSERT INTO savedresult (queryid, picid) VALUES (?, ?)");
+		q.bindValue(0, id);
+		for(int i=0;i<store->count();++i) {
+			const TagStoreEntry tags = store->entry(i);
+			if(query.isCandidate(tags) && query.match(tags)) {
+				q.bindValue(1, tags.pictureId());
+				q.exec();
+			}
+		}
+
+		if(query.matchesUntagged()) {
+			if(!q.exec("INSERT INTO savedresult (queryid, picid) SELECT " + QString::number(id) +
+					   ", picid FROM picture WHERE (" + query.untaggedSql() + ") AND NOT EXISTS (SELECT 1 FROM tagmap WHERE tagmap.picid=picture.picid)"))
+				qDebug() << "Couldn't save untagged query results:" << q.lastError().text();
+		}
+	}
+
+	if(transaction)
+		m_database->get().commit();
+}
+
+void SavedQueries::load()
+{
+	if(m_loaded)
+		return;
+
+	m_queries.clear();
+	QSqlQuery q("SELECT queryid, query FROM savedquery WHERE stale=0", m_database->get());
+	while(q.next()) {
+		Saved saved;
+		saved.id = q.value(0).toInt();
+		saved.query = compile(q.value(1).toString());
+		saved.tags = saved.query.referencedTagIds();
+		qSort(saved.tags);
+		// Queries with metadata predicates are re-evaluated in refresh()
+		if(!saved.query.isError() && !saved.query.hasMetadata())
+			m_queries.append(saved);
+	}
+
+	m_loaded = true;
+}
+
+/**
+  Only the queries that refer to a tag the picture gained or lost are re-evaluated.
+  Queries that match untagged pictures are also re-evaluated when the picture
+  becomes tagged or untagged, and set queries when the tags are regrouped
+  (e.g. "[a], [b]" becomes "[a, b]").
+  */
+void SavedQueries::update(const TagIdSet& tags, const QVector<int>& oldtags, const QVector<int>& newtags, bool regrouped)
+{
+	load();
+	if(m_queries.isEmpty())
+		return;
+
+	QVector<int> changed;
+	foreach(int tag, oldtags)
+		if(!newtags.contains(tag))
+			changed.append(tag);
+	foreach(int tag, newtags)
+		if(!oldtags.contains(tag))
+			changed.append(tag);
+
+	if(changed.isEmpty() && !regrouped)
+		return;
+
+	const bool taggedChanged = oldtags.isEmpty() != newtags.isEmpty();
+
+	QSqlQuery insert(m_database->get());
+	insert.prepare("INSERT OR IGNORE INTO savedresult (queryid, picid) VALUES (?, ?)");
+	QSqlQuery remove(m_database->get());
+	remove.prepare("DELETE FROM savedresult WHERE queryid=? AND picid=?");
+
+	foreach(const Saved &saved, m_queries) {
+		bool affected = (taggedChanged && saved.query.matchesUntagged()) || (regrouped && saved.query.hasSets());
+		for(int i=0;!affected && i<changed.count();++i)
+			affected = qBinaryFind(saved.tags.constBegin(), saved.tags.constEnd(), changed.at(i)) != saved.tags.constEnd();
+		if(!affected)
+			continue;
+
+		QSqlQuery &q = saved.query.match(tags) ? insert : remove;
+		q.bindValue(0, saved.id);
+		q.bindValue(1, tags.pictureId());
+		if(!q.exec())
+			qDebug() << "Couldn't update saved query results:" << q.lastError().text();
+	}
+}
+
+void SavedQueries::clearResults()
+{
+	QSqlQuery q(m_database->get());
+	q.exec("DELETE FROM savedresult");
+	q.exec("UPDATE savedquery SET stale=1");
+	invalidate();
+}
+
+void SavedQueries::invalidate()
+{
+	m_loaded = false;
+	m_queries.clear();
+}
@@ -0,0 +1,124 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef SAVEDQUERIES_H
+#define SAVEDQUERIES_H
+
+#include <QStringList>
+#include <QList>
+#include <QVector>
+
+#include "tagquery.h"
+
+class Database;
+class TagIdSet;
+
+/**
+  \brief Named tag queries with persistent, incrementally maintained results
+
+  The results of each saved query are stored in the savedresult table.
+  When a picture's tags are saved, the picture is re-evaluated against the
+  queries that refer to the changed tags, so opening a saved query never
+  requires matching it again.
+
+  Results include hidden pictures. They are filtered out when the results are
+  shown, so hiding and showing pictures does not affect the saved results.
+
+  When the tag tables are recreated, the tag IDs change and all results are
+  marked stale. A stale query is evaluated from scratch when it is next opened.
+
+  Foreign keys are not enforced, so the results of deleted pictures and
+  queries are deleted explicitly.
+  */
+class SavedQueries
+{
+public:
+	SavedQueries(Database *database);
+
+	//! Create the saved query tables if they do not exist yet
+	void createTables();
+
+	//! Get the names of all saved queries in alphabetical order
+	QStringList names() const;
+
+	//! Get the query string of a saved query
+	QString query(const QString& name) const;
+
+	//! Should the results of a saved query include hidden pictures? (see TagQuery::includesHidden)
+	bool includesHidden(const QString& name) const;
+
+	/**
+	  \brief Save a query, replacing any saved query with the same name
+
+	  The query is evaluated immediately.
+	  \param name query name
+	  \param query the query string
+	  \return false if the query could not be parsed
+	  */
+	bool save(const QString& name, const QString& query);
+
+	//! Delete a saved query and its results
+	void remove(const QString& name);
+
+	/**
+	  \brief Make sure the results of a saved query are up to date
+
+	  Stale results are recomputed. Otherwise this does nothing.
+	  */
+	void refresh(const QString& name);
+
+	/**
+	  \brief Re-evaluate a picture whose tags have changed
+
+	  This is called by TagIdSet::save.
+	  \param tags the new tags of the picture
+	  \param oldtags the picture's previous tags (without duplicates)
+	  \param newtags the picture's current tags (without duplicates)
+	  \param regrouped were the tags grouped into tag sets differently before
+	  */
+	void update(const TagIdSet& tags, const QVector<int>& oldtags, const QVector<int>& newtags, bool regrouped);
+
+	//! Forget the results of a deleted picture
+	void removePicture(int picid);
+
+	//! Mark all results stale. This is called when the tag tables are recreated.
+	void clearResults();
+
+	//! Drop the compiled queries. They are recompiled when needed.
+	void invalidate();
+
+private:
+	struct Saved {
+		int id;
+		TagQuery query;
+		QVector<int> tags;
+	};
+
+	//! Compile the saved queries whose results are up to date
+	void load();
+
+	//! Compile a query string
+	TagQuery compile(const QString& query) const;
+
+	//! Recompute the results of a query from scratch
+	void evaluate(int id, const TagQuery& query);
+
+	Database *m_database;
+	bool m_loaded;
+	QList<Saved> m_queries;
+};
+
+#endif // SAVEDQUERIES_H
@@ -28,6 +28,7 @@
 #include "slideshow.h"
 #include "thumbnailmodel.h"
 #include "gallery.h"
+#include "imagescaler.h"
 
 Slideshow::Slideshow(Gallery *gallery, ThumbnailModel *model, QVector<int> selection, QWidget *parent) :
 	QGraphicsView(parent), m_gallery(gallery), m_model(model), m_selection(selection), m_picture(0)
@@ -253,17 +254,25 @@ void Slideshow::jumpSlide(int skip)
 		realpos = m_pos;
 
 	const Picture *pic = m_model->pictureAt(realpos);
-	QGraphicsPixmapItem *newpic = new QGraphicsPixmapItem(pic->fullpath(m_gallery));
+	QImage image(pic->fullpath(m_gallery));
+
+	// Scale image to fit screen, taking the rotation in account.
+	// Downscaling is done here in advance, since it looks much better than
+	// the scene's pixmap transformation. Upscaling is left to the scene.
+	QSizeF truesize = QTransform().rotate(pic->rotation()).mapRect(QRectF(image.rect())).size();
+	qreal scale = calcScale(truesize, view.size());
+	if(scale < 1) {
+		image = ImageScaler::scale(image, (QSizeF(image.size()) * scale).toSize().expandedTo(QSize(1, 1)));
+		scale = 1;
+	}
+
+	QGraphicsPixmapItem *newpic = new QGraphicsPixmapItem(QPixmap::fromImage(image));
 	QRectF bounds = newpic->boundingRect();
 
 	newpic->setTransformOriginPoint(bounds.width()/2, bounds.height()/2);
 
 	newpic->setPos(-bounds.width()/2.0, -bounds.height()/2.0);
 	newpic->setRotation(pic->rotation());
-
-	// Scale image to fit screen, taking the rotation in account
-	QRectF truebounds = newpic->mapRectToScene(bounds);
-	qreal scale = calcScale(truebounds.size(), view.size());
 	newpic->setScale(scale);
 
 	delete m_picture;
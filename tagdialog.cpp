@@ -18,7 +18,6 @@
 #include <QSqlQuery>
 #include <QTableWidgetItem>
 #include <QMessageBox>
-#include <QProgressDialog>
 #include <QVariant>
 #include <QBuffer>
 
@@ -28,6 +27,8 @@
 #include "tagset.h"
 #include "tagrules.h"
 #include "tags.h"
+#include "tagindex.h"
+#include "picbitmap.h"
 
 #include "gallery.h"
 #include "database.h"
@@ -78,6 +79,9 @@ void TagDialog::saveChanges()
 		return;
 	}
 
+	// The rules the tag index was built with
+	const QList<TagRuleExpression> oldrules = TagImplications::loadExpressions(m_gallery->database());
+
 	// Save original rule source code
 	m_gallery->database()->saveSetting("tagrules", rulestring);
 
@@ -105,60 +109,46 @@ void TagDialog::saveChanges()
 		}
 	}
 	m_gallery->database()->get().commit();
+	m_gallery->database()->tags()->reloadAliases();
+	m_gallery->database()->tagRulesChanged();
+
+	// If the earlier changes have been applied, only the pictures affected by this change need updating
+	QVector<int> affected;
+	QSet<int> tags;
+	bool partial = !m_gallery->database()->getSetting("tagrules.pending").toBool() &&
+			TagImplications::affectedTags(m_gallery->database(), oldrules, rules, tags);
+	if(partial) {
+		const TagIndex *index = m_gallery->database()->tagIndex();
+		index->load();
+		PicBitmap pictures;
+		foreach(int tag, tags)
+			pictures |= index->pictures(tag);
+		affected = pictures.toVector();
+
+		if(affected.isEmpty()) {
+			accept();
+			return;
+		}
+	}
 
 	// Rebuild tag index?
-	QMessageBox msgbox(QMessageBox::Question, tr("Tag rules changed"), tr("Rebuild tag index?"));
-	msgbox.setInformativeText(tr("This will apply the new rules to all existing tags."));
+	QMessageBox msgbox(QMessageBox::Question, tr("Tag rules changed"), partial ? tr("Update tag index?") : tr("Rebuild tag index?"));
+	if(partial)
+		msgbox.setInformativeText(tr("This will apply the new rules to the %n affected picture(s).", 0, affected.count()));
+	else
+		msgbox.setInformativeText(tr("This will apply the new rules to all existing tags."));
 	msgbox.setStandardButtons(QMessageBox::Yes | QMessageBox::No);
-	msgbox.setButtonText(QMessageBox::Yes, tr("Rebuild"));
+	msgbox.setButtonText(QMessageBox::Yes, partial ? tr("Update") : tr("Rebuild"));
 	msgbox.setButtonText(QMessageBox::No, tr("Not now"));
 	if(msgbox.exec() == QMessageBox::Yes) {
-		rebuildTagIndex();
+		if(partial)
+			emit updateRequested(affected);
+		else
+			emit rebuildRequested();
+	} else {
+		// The next change must rebuild the whole index to apply this one
+		m_gallery->database()->saveSetting("tagrules.pending", true);
 	}
 
 	accept();
 }
-
-void TagDialog::rebuildTagIndex()
-{
-	// Get the number of pictures. This is needed for the progress bar
-	// and sqlite doesn't return the size of the result set.
-	int filecount;
-	{
-		QSqlQuery q("SELECT COUNT(*) FROM picture WHERE tags!=\"\"", m_gallery->database()->get());
-		if(!q.next()) {
-			Database::showError("Couldn't get file count!", q);
-			return;
-		}
-		filecount = q.value(0).toInt();
-	}
-
-	// Show progress dialog
-	QProgressDialog progress(tr("Rebuilding tag index..."), tr("Abort"), 0, filecount);
-	progress.setMinimumDuration(100);
-
-	// Destroy and re-create tag index tables
-	m_gallery->database()->get().transaction();
-	m_gallery->database()->tags()->createTables(true);
-
-	TagImplications tagrules = TagImplications::load(m_gallery->database());
-
-	// Reinsert tags to index
-	QSqlQuery q(m_gallery->database()->get());
-	q.setForwardOnly(true);
-	q.exec("SELECT picid, tags FROM picture WHERE tags!=\"\"");
-	int pos=0;
-	while(q.next()) {
-		TagIdSet tagset(TagSet::parse(q.value(1).toString()), m_gallery->database()->tags(), q.value(0).toInt());
-		tagrules.apply(tagset);
-		tagset.save(m_gallery->database(), false);
-
-		progress.setValue(++pos);
-		if(progress.wasCanceled()) {
-			m_gallery->database()->get().rollback();
-			break;
-		}
-	}
-
-	m_gallery->database()->get().commit();
-}
@@ -18,6 +18,7 @@
 #define TAGDIALOG_H
 
 #include <QDialog>
+#include <QVector>
 
 namespace Ui {
     class TagDialog;
@@ -33,12 +34,17 @@ public:
 	explicit TagDialog(Gallery *gallery, QWidget *parent = 0);
     ~TagDialog();
 
+signals:
+	//! The user wants the tag index rebuilt with the new rules
+	void rebuildRequested();
+
+	//! The user wants the new rules applied to the pictures affected by the change
+	void updateRequested(const QVector<int>& pictures);
+
 protected slots:
 	void saveChanges();
 
 private:
-	void rebuildTagIndex();
-
 	Ui::TagDialog *m_ui;
 	Gallery *m_gallery;
 };
@@ -0,0 +1,109 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+#include <QStringList>
+#include <QtAlgorithms>
+
+#include "tagfacets.h"
+#include "database.h"
+#include "tagindex.h"
+#include "tagstore.h"
+#include "picbitmap.h"
+
+TagFacets::TagFacets(const Database *database)
+	: m_database(database), m_total(0)
+{
+}
+
+void TagFacets::reset(const QVector<int>& pictures)
+{
+	const TagIndex *index = m_database->tagIndex();
+	if(index->isLoaded()) {
+		m_counts = index->cooccurrence(PicBitmap::fromVector(pictures));
+		m_total = pictures.count();
+	} else {
+		clear();
+		add(pictures);
+	}
+}
+
+void TagFacets::add(const QVector<int>& pictures)
+{
+	const TagStore *store = m_database->tagStore();
+	store->load();
+
+	foreach(int picid, pictures) {
+		const int row = store->lowerBound(picid);
+		if(row < store->count() && store->entry(row).pictureId() == picid) {
+			foreach(int tag, store->entry(row).tags())
+				++m_counts[tag];
+		}
+	}
+	m_total += pictures.count();
+}
+
+void TagFacets::clear()
+{
+	m_counts.clear();
+	m_total = 0;
+}
+
+namespace {
+	bool moreCommon(const TagFacet &a, const TagFacet &b)
+	{
+		return a.count > b.count || (a.count == b.count && a.tagid < b.tagid);
+	}
+}
+
+QList<TagFacet> TagFacets::top(int k) const
+{
+	QList<TagFacet> facets;
+	for(QHash<int, int>::const_iterator i=m_counts.constBegin();i!=m_counts.constEnd();++i) {
+		if(i.value() < m_total) {
+			TagFacet facet;
+			facet.tagid = i.key();
+			facet.count = i.value();
+			facets.append(facet);
+		}
+	}
+
+	qSort(facets.begin(), facets.end(), moreCommon);
+	if(facets.count() > k)
+		facets = facets.mid(0, k);
+
+	// Look up the names of the top tags only
+	if(!facets.isEmpty()) {
+		QStringList ids;
+		foreach(const TagFacet &facet, facets)
+			ids << QString::number(facet.tagid);
+
+		QHash<int, QString> names;
+		QSqlQuery q(m_database->get());
+		if(!q.exec("SELECT tagid, tag FROM tag WHERE tagid IN (" + ids.join(",") + ")"))
+			qDebug() << "Couldn't get facet tag names:" << q.lastError().text();
+		while(q.next())
+			names.insert(q.value(0).toInt(), q.value(1).toString());
+
+		for(int i=0;i<facets.count();++i)
+			facets[i].name = names.value(facets.at(i).tagid);
+	}
+
+	return facets;
+}
@@ -0,0 +1,82 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef TAGFACETS_H
+#define TAGFACETS_H
+
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include <QString>
+
+class Database;
+
+//! A tag and the number of result pictures that have it
+struct TagFacet {
+	int tagid;
+	QString name;
+	int count;
+};
+
+/**
+  \brief Tag co-occurrence counts over a set of pictures
+
+  This is used to show the tags that appear most often in the current query
+  results. The counts of all tags are kept, so the counts can be updated
+  incrementally as results are added.
+  */
+class TagFacets
+{
+public:
+	TagFacets(const Database *database);
+
+	/**
+	  \brief Count the tags of a new set of pictures
+
+	  If the inverted tag index is loaded, the counts are computed with bitmap
+	  intersections. Otherwise the tags of each picture are counted.
+	  \param pictures picture IDs
+	  */
+	void reset(const QVector<int>& pictures);
+
+	/**
+	  \brief Add pictures to the set
+	  \param pictures picture IDs not already in the set
+	  */
+	void add(const QVector<int>& pictures);
+
+	//! Remove all pictures
+	void clear();
+
+	//! Get the number of pictures in the set
+	int total() const { return m_total; }
+
+	/**
+	  \brief Get the most common tags
+
+	  Tags that all pictures have are left out, since they don't narrow down the results.
+	  \param k maximum number of tags to return
+	  \return tags in descending order of count
+	  */
+	QList<TagFacet> top(int k) const;
+
+private:
+	const Database *m_database;
+	QHash<int, int> m_counts;
+	int m_total;
+};
+
+#endif // TAGFACETS_H
@@ -0,0 +1,126 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "tagidvector.h"
+
+TagIdVector::TagIdVector(const TagIdVector &other)
+	: m_size(0), m_capacity(INLINE_SIZE), m_data(m_inline)
+{
+	*this = other;
+}
+
+TagIdVector &TagIdVector::operator=(const TagIdVector &other)
+{
+	if(this != &other) {
+		m_size = 0;
+		reserve(other.m_size);
+		for(int i=0;i<other.m_size;++i)
+			m_data[i] = other.m_data[i];
+		m_size = other.m_size;
+	}
+	return *this;
+}
+
+void TagIdVector::reserve(int capacity)
+{
+	if(capacity <= m_capacity)
+		return;
+
+	int newcapacity = m_capacity * 2;
+	while(newcapacity < capacity)
+		newcapacity *= 2;
+
+	int *data = new int[newcapacity];
+	for(int i=0;i<m_size;++i)
+		data[i] = m_data[i];
+
+	if(m_data != m_inline)
+		delete [] m_data;
+	m_data = data;
+	m_capacity = newcapacity;
+}
+
+bool TagIdVector::insert(int tag)
+{
+	// Find the insertion point. Tags are usually added in ascending order.
+	int pos = m_size;
+	while(pos > 0 && m_data[pos-1] > tag)
+		--pos;
+	if(pos > 0 && m_data[pos-1] == tag)
+		return false;
+
+	reserve(m_size + 1);
+	for(int i=m_size;i>pos;--i)
+		m_data[i] = m_data[i-1];
+	m_data[pos] = tag;
+	++m_size;
+	return true;
+}
+
+void TagIdVector::unite(const TagIdVector &other)
+{
+	if(other.isSubsetOf(*this))
+		return;
+
+	// Merge the two sorted sets
+	int *merged = new int[m_size + other.m_size];
+	int n=0, i=0, j=0;
+	while(i<m_size || j<other.m_size) {
+		if(j>=other.m_size || (i<m_size && m_data[i] < other.m_data[j]))
+			merged[n++] = m_data[i++];
+		else if(i>=m_size || m_data[i] > other.m_data[j])
+			merged[n++] = other.m_data[j++];
+		else {
+			merged[n++] = m_data[i++];
+			++j;
+		}
+	}
+
+	reserve(n);
+	for(int k=0;k<n;++k)
+		m_data[k] = merged[k];
+	m_size = n;
+	delete [] merged;
+}
+
+/**
+  Both sets are sorted, so this is a single merge walk.
+  */
+bool TagIdVector::isSubsetOf(const TagIdVector &other) const
+{
+	if(m_size > other.m_size)
+		return false;
+
+	int j=0;
+	for(int i=0;i<m_size;++i) {
+		while(j<other.m_size && other.m_data[j] < m_data[i])
+			++j;
+		if(j>=other.m_size || other.m_data[j] != m_data[i])
+			return false;
+		++j;
+	}
+	return true;
+}
+
+bool TagIdVector::operator==(const TagIdVector &other) const
+{
+	if(m_size != other.m_size)
+		return false;
+	for(int i=0;i<m_size;++i)
+		if(m_data[i] != other.m_data[i])
+			return false;
+	return true;
+}
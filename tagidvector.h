@@ -0,0 +1,112 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef TAGIDVECTOR_H
+#define TAGIDVECTOR_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+  \brief A sorted set of tag IDs
+
+  Up to INLINE_SIZE tags are stored inside the object itself, so
+  most tag sets need no heap allocation. Membership is tested with
+  SIMD comparison for inline sets and branchless binary search for
+  larger ones.
+  */
+class TagIdVector
+{
+public:
+	typedef const int *const_iterator;
+
+	//! Number of tags stored without a heap allocation
+	static const int INLINE_SIZE = 8;
+
+	TagIdVector() : m_size(0), m_capacity(INLINE_SIZE), m_data(m_inline) { }
+	TagIdVector(const TagIdVector &other);
+	TagIdVector &operator=(const TagIdVector &other);
+	~TagIdVector() { if(m_data != m_inline) delete [] m_data; }
+
+	int size() const { return m_size; }
+	int count() const { return m_size; }
+	bool isEmpty() const { return m_size==0; }
+
+	//! Get the tag at the given index. Tags are in ascending order.
+	int at(int i) const { return m_data[i]; }
+
+	const_iterator begin() const { return m_data; }
+	const_iterator end() const { return m_data + m_size; }
+
+	//! Is the tag in the set
+	inline bool contains(int tag) const;
+
+	/**
+	  \brief Add a tag to the set
+	  \return false if the tag was already in the set
+	  */
+	bool insert(int tag);
+
+	//! Add all the given tags to the set
+	void unite(const TagIdVector &other);
+
+	//! Are all the tags of this set in the other set
+	bool isSubsetOf(const TagIdVector &other) const;
+
+	void clear() { m_size = 0; }
+
+	bool operator==(const TagIdVector &other) const;
+	bool operator!=(const TagIdVector &other) const { return !(*this == other); }
+
+private:
+	void reserve(int capacity);
+
+	int m_size;
+	int m_capacity;
+	int *m_data;
+	int m_inline[INLINE_SIZE];
+};
+
+bool TagIdVector::contains(int tag) const
+{
+	if(m_size==0)
+		return false;
+
+#ifdef __SSE2__
+	if(m_data == m_inline) {
+		// Compare all inline slots at once and mask out the unused ones
+		const __m128i needle = _mm_set1_epi32(tag);
+		const __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m_inline)), needle);
+		const __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m_inline + 4)), needle);
+		const unsigned int mask = unsigned(_mm_movemask_epi8(lo)) | (unsigned(_mm_movemask_epi8(hi)) << 16);
+		const unsigned int valid = m_size >= INLINE_SIZE ? 0xffffffffu : (1u << (m_size * 4)) - 1;
+		return (mask & valid) != 0;
+	}
+#endif
+
+	// Branchless binary search for the last tag not greater than the needle
+	const int *base = m_data;
+	int n = m_size;
+	while(n > 1) {
+		const int half = n / 2;
+		base = base[half] <= tag ? base + half : base;
+		n -= half;
+	}
+	return *base == tag;
+}
+
+#endif // TAGIDVECTOR_H
@@ -0,0 +1,183 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QFile>
+#include <QDataStream>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+#include <QTime>
+
+#include "tagindex.h"
+#include "database.h"
+
+//! Index file format identifier
+static const quint32 INDEX_MAGIC = 0x50515449;
+
+//! Index file format version
+static const quint32 INDEX_VERSION = 2;
+
+TagIndex::TagIndex(Database *database, const QString& file)
+	: m_database(database), m_file(file), m_loaded(false), m_dirty(false)
+{
+}
+
+PicBitmap TagIndex::visiblePictures() const
+{
+	PicBitmap pictures;
+	QSqlQuery q(m_database->get());
+	q.setForwardOnly(true);
+	if(!q.exec("SELECT picid FROM picture WHERE hidden=0 ORDER BY picid")) {
+		qDebug() << "Couldn't get visible pictures:" << q.lastError().text();
+		return pictures;
+	}
+	while(q.next())
+		pictures.add(q.value(0).toInt());
+	return pictures;
+}
+
+QHash<int, int> TagIndex::cooccurrence(const PicBitmap& pictures) const
+{
+	QHash<int, int> counts;
+	for(QHash<int, PicBitmap>::const_iterator i=m_tags.constBegin();i!=m_tags.constEnd();++i) {
+		const int count = i.value().intersectionCount(pictures);
+		if(count>0)
+			counts.insert(i.key(), count);
+	}
+	return counts;
+}
+
+void TagIndex::load() const
+{
+	if(m_loaded)
+		return;
+
+	QTime timer;
+	timer.start();
+
+	if(!loadFile())
+		rebuild();
+
+	m_loaded = true;
+	qDebug() << "Tag index loaded:" << m_tags.count() << "tags in" << timer.elapsed() << "ms";
+}
+
+bool TagIndex::loadFile() const
+{
+	QFile file(m_file);
+	if(!file.open(QIODevice::ReadOnly))
+		return false;
+
+	QDataStream in(&file);
+	in.setVersion(QDataStream::Qt_4_6);
+
+	quint32 magic, version;
+	in >> magic >> version;
+	if(magic != INDEX_MAGIC || version != INDEX_VERSION) {
+		qDebug() << "Unsupported tag index file";
+		return false;
+	}
+
+	qint64 generation;
+	in >> generation;
+	if(generation != m_database->tagMapGeneration()) {
+		qDebug() << "Tag index file is stale";
+		return false;
+	}
+
+	QHash<int, PicBitmap> tags;
+	in >> tags;
+	if(in.status() != QDataStream::Ok) {
+		qDebug() << "Tag index file is corrupt";
+		return false;
+	}
+
+	m_tags = tags;
+	m_dirty = false;
+	return true;
+}
+
+void TagIndex::rebuild() const
+{
+	m_tags.clear();
+
+	// Pictures are added in ascending order, which is the fast path for PicBitmap
+	QSqlQuery q(m_database->get());
+	q.setForwardOnly(true);
+	if(!q.exec("SELECT picid, tagid FROM tagmap ORDER BY picid"))
+		qDebug() << "Couldn't read tag map:" << q.lastError().text();
+
+	while(q.next())
+		m_tags[q.value(1).toInt()].add(q.value(0).toInt());
+
+	m_dirty = true;
+}
+
+void TagIndex::update(int picid, const QVector<int>& oldtags, const QVector<int>& newtags)
+{
+	if(!m_loaded)
+		return;
+
+	foreach(int tag, oldtags) {
+		if(!newtags.contains(tag)) {
+			QHash<int, PicBitmap>::iterator i = m_tags.find(tag);
+			if(i != m_tags.end()) {
+				i->remove(picid);
+				if(i->isEmpty())
+					m_tags.erase(i);
+			}
+		}
+	}
+
+	foreach(int tag, newtags)
+		if(tag>0)
+			m_tags[tag].add(picid);
+
+	m_dirty = true;
+}
+
+void TagIndex::clear()
+{
+	m_tags.clear();
+	m_loaded = true;
+	m_dirty = true;
+}
+
+void TagIndex::invalidate()
+{
+	m_tags.clear();
+	m_loaded = false;
+	m_dirty = false;
+}
+
+void TagIndex::save()
+{
+	if(!m_loaded || !m_dirty)
+		return;
+
+	QFile file(m_file);
+	if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << "Couldn't save tag index to" << m_file;
+		return;
+	}
+
+	QDataStream out(&file);
+	out.setVersion(QDataStream::Qt_4_6);
+	out << INDEX_MAGIC << INDEX_VERSION << m_database->tagMapGeneration() << m_tags;
+
+	m_dirty = false;
+}
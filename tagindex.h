@@ -0,0 +1,103 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef TAGINDEX_H
+#define TAGINDEX_H
+
+#include <QHash>
+
+#include "picbitmap.h"
+
+class Database;
+
+/**
+  \brief An in-memory inverted index from tag IDs to pictures
+
+  The index holds a bitmap of picture IDs for each tag. It is used to
+  evaluate flat tag queries with bitmap operations instead of fetching and
+  matching tag sets picture by picture.
+
+  The index is loaded lazily. It is persisted in the metadata directory
+  together with the tag map generation (see Database::bumpTagMapGeneration()),
+  so it can be reused on the next startup if the tag map has not been changed
+  behind its back. Otherwise the index is rebuilt from the tagmap table.
+  */
+class TagIndex
+{
+public:
+	/**
+	  \param database the database whose tag map is indexed
+	  \param file the file in which the index is persisted
+	  */
+	TagIndex(Database *database, const QString& file);
+
+	//! Is the index loaded into memory
+	bool isLoaded() const { return m_loaded; }
+
+	//! Make sure the index is loaded
+	void load() const;
+
+	//! Get the pictures that have the given tag (in any tag set)
+	PicBitmap pictures(int tagid) const { return m_tags.value(tagid); }
+
+	/**
+	  \brief Get all visible pictures, tagged or not
+
+	  This is the universe for negated queries. It is read from the database
+	  on each call, since hiding and rescanning pictures does not go through the index.
+	  */
+	PicBitmap visiblePictures() const;
+
+	/**
+	  \brief Count how many of the given pictures have each tag
+
+	  \param pictures the pictures to count
+	  \return tag ID -> number of pictures. Tags with no pictures are left out.
+	  */
+	QHash<int, int> cooccurrence(const PicBitmap& pictures) const;
+
+	/**
+	  \brief Update the index after a picture's tags have changed
+
+	  Does nothing if the index is not loaded.
+	  \param picid the picture ID
+	  \param oldtags the picture's previous tags
+	  \param newtags the picture's current tags
+	  */
+	void update(int picid, const QVector<int>& oldtags, const QVector<int>& newtags);
+
+	//! Empty the index. This is called when the tag tables are recreated.
+	void clear();
+
+	//! Drop the in-memory index. It will be reloaded when needed.
+	void invalidate();
+
+	//! Save the index if it has been changed
+	void save();
+
+private:
+	bool loadFile() const;
+	void rebuild() const;
+
+	Database *m_database;
+	QString m_file;
+	// The index is loaded on demand, even through a const reference
+	mutable bool m_loaded;
+	mutable bool m_dirty;
+	mutable QHash<int, PicBitmap> m_tags;
+};
+
+#endif // TAGINDEX_H
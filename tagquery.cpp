@@ -17,12 +17,22 @@
 #include <QStack>
 #include <QSharedPointer>
 #include <QSet>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVarLengthArray>
+#include <QtAlgorithms>
+#include <QThread>
+#include <QtConcurrentRun>
+#include <typeinfo>
 
 #include "tagquery.h"
 #include "util.h"
 #include "database.h"
 #include "tagset.h"
 #include "tags.h"
+#include "tagindex.h"
+#include "tagstore.h"
+#include "picbitmap.h"
 
 class ParseException {
 public:
@@ -31,8 +41,60 @@ public:
 	const QString message;
 };
 
+/**
+  A single instruction of a compiled tag query.
+
+  Queries are compiled into a flat program that is run by TagQueryPrivate::run().
+  The program operates on a single boolean accumulator. Boolean operators are
+  compiled into conditional jumps, which gives short circuit evaluation for free.
+  Tag set operators are compiled into a loop that tries the operand against each
+  unused tag set in turn.
+  */
+struct TagQueryOp {
+	enum Code {
+		//! acc = tag arg is in the current tag set (or any set if not limited)
+		TAG,
+		//! acc = true when recording match details, false otherwise (the ":any" pseudo tag)
+		ANY,
+		//! acc = the picture matches metadata predicate arg
+		META,
+		//! acc = !acc
+		NOT,
+		//! Jump to arg if acc is false
+		JUMP_IF_FALSE,
+		//! Jump to arg if acc is true
+		JUMP_IF_TRUE,
+		//! Start a tag set loop
+		SET_BEGIN,
+		//! Limit matching to the next unused tag set, or set acc=false and jump to arg if none are left
+		SET_NEXT,
+		//! If acc is true, mark the set used and exit the loop. Otherwise jump back to arg (SET_NEXT)
+		SET_END
+	};
+
+	TagQueryOp() : code(TAG), arg(0) { }
+	TagQueryOp(Code c, int a=0) : code(c), arg(a) { }
+
+	Code code;
+	int arg;
+};
+
+typedef QVector<TagQueryOp> TagQueryProgram;
+
+static QStringList set2list(const QSet<int> &set)
+{
+	QStringList list;
+	foreach(int i, set)
+		list.append(QString::number(i));
+	return list;
+}
+
+class TagQueryMetaNode;
+
 class TagQueryNode {
 public:
+	TagQueryNode() : m_estimate(-1) { }
+
 	virtual ~TagQueryNode() { }
 
 	virtual int precedence() const { return 0; }
@@ -55,27 +117,79 @@ public:
 	//! Check if this query contains any tag set operators
 	virtual bool hasSets() const { return false; }
 
+	//! Check if this query contains any wildcard patterns
+	virtual bool hasWildcards() const { return false; }
+
+	//! If this is a negation, get the negated node
+	virtual const TagQueryNode *negatedNode() const { return 0; }
+
+	//! Append the instructions for evaluating this node to the program
+	virtual void compile(TagQueryProgram &program) const = 0;
+
 	/**
-	  \param tags the tag set to match again
-	  \param limitset if nonzero, match only against the tags in that set. Otherwise, tags from all sets are matched.
-	  \param limitmask bitmask of sets that have been matched already
-	  */
-	virtual bool match(const TagIdSet &tags, int limitset, long &limitmask) const = 0;
+	 * \brief Convert this node into an SQL query returning picture IDs
+	 *
+	 * Only queries without tag sets can be converted.
+	 * \param universe the query that returns all candidate pictures. This is used for negation.
+	 */
+	virtual QString toSql(const QString& universe) const = 0;
 
 	/**
-	  A matcher that records details about how the query matches
-	  \param tags the tag set to match against
-	  \param limitmask if >=0, math only against the tags in that set.
-	  \param results query results are stored here
-	  */
-	virtual bool match(const TagIdSet &tags, int limitset, TagMatchResults &results) const = 0;
+	 * \brief Collect the tags of a chain of plain tags joined by the same operator
+	 * \param tags the tag IDs are inserted here
+	 * \param conjunction collect an AND chain if true, an OR chain otherwise
+	 * \return false if this node is not such a chain
+	 */
+	virtual bool flatTags(QSet<int>& tags, bool conjunction) const { Q_UNUSED(tags); Q_UNUSED(conjunction); return false; }
+
+	/**
+	 * \brief Plan the evaluation order using tag frequency statistics
+	 *
+	 * The operands of AND and OR chains are reordered so that the operand most likely to
+	 * decide the result is evaluated first. Chains containing tag sets are left alone,
+	 * since the order in which tag sets are matched is significant.
+	 * \return estimated number of matching pictures
+	 */
+	virtual int plan(const Tags *tags) = 0;
+
+	//! Collect the tags every matching picture must have
+	virtual void requiredTags(QSet<int>& tags) const = 0;
+
+	//! Collect all metadata predicates
+	virtual void gatherMetadata(QList<TagQueryMetaNode*>& nodes) { Q_UNUSED(nodes); }
+
+	//! Collect the metadata predicates every matching picture must satisfy
+	virtual void requiredMetadata(QList<const TagQueryMetaNode*>& nodes) const { Q_UNUSED(nodes); }
+
+	/**
+	 * \brief Get an SQL condition on the picture table that selects the untagged pictures this node matches
+	 *
+	 * Untagged pictures can only be matched by metadata predicates, so this is
+	 * only needed for queries that have some.
+	 */
+	virtual QString untaggedSql() const { return "0"; }
+
+	//! Append a description of the evaluation plan to the list
+	virtual void explain(QStringList& lines, int depth) const = 0;
+
+	//! Get the estimated number of matching pictures (set by plan())
+	int estimate() const { return m_estimate; }
+
+protected:
+	//! Format a plan line
+	QString explainLine(const QString& text, int depth) const
+	{
+		return QString(depth*2, ' ') + text + ", ~" + (m_estimate<0 ? QString("?") : QString::number(m_estimate)) + " pictures";
+	}
+
+	int m_estimate;
 };
 
 // Tag node
 class TagQueryLeafNode : public TagQueryNode
 {
 public:
-	TagQueryLeafNode(const QString& value) : m_value(value) { }
+	TagQueryLeafNode(const QString& value) : m_value(value), m_id(-1) { }
 
 	const QString& value() const { return m_value; }
 
@@ -106,36 +220,51 @@ public:
 			list.insert(m_id);
 	}
 
-	bool match(const TagIdSet &tags, int limitset, long &limitmask) const
+	void compile(TagQueryProgram &program) const
 	{
-		Q_UNUSED(limitmask);
+		// Some special pseudo tags are recognized here
+		if(m_id<=0 && m_value == ":any")
+			program.append(TagQueryOp(TagQueryOp::ANY));
+		else
+			program.append(TagQueryOp(TagQueryOp::TAG, m_id));
+	}
 
+	QString toSql(const QString& universe) const
+	{
+		Q_UNUSED(universe);
+		// Unknown tags and the :any pseudo tag never match
 		if(m_id<=0)
-			return false;
+			return "SELECT picid FROM tagmap WHERE 0";
+		return "SELECT picid FROM tagmap WHERE tagid=" + QString::number(m_id);
+	}
 
-		if(limitset<0) {
-			for(int i=0;i<=tags.sets();++i)
-				if(tags.tags(i).contains(m_id))
-					return true;
+	bool flatTags(QSet<int>& tags, bool conjunction) const
+	{
+		Q_UNUSED(conjunction);
+		if(m_id<=0)
 			return false;
-		} else {
-			return tags.tags(limitset).contains(m_id);
-		}
+		tags.insert(m_id);
+		return true;
 	}
 
-	bool match(const TagIdSet &tags, int limitset, TagMatchResults &results) const
+	int plan(const Tags *tags)
 	{
-		Q_UNUSED(results);
-		if(m_id<=0) {
-			// Some special pseudo tags are recognized here
-			if(m_value == ":any")
-				return true;
-			return false;
-		} else {
-			// Otherwise, match tags as usual
-			long unused=0;
-			return match(tags, limitset, unused);
-		}
+		m_estimate = m_id>0 ? tags->frequency(m_id) : 0;
+		return m_estimate;
+	}
+
+	void requiredTags(QSet<int>& tags) const
+	{
+		if(m_id>0)
+			tags.insert(m_id);
+	}
+
+	void explain(QStringList& lines, int depth) const
+	{
+		if(m_id>0)
+			lines << explainLine("tag " + m_value + " #" + QString::number(m_id), depth);
+		else
+			lines << explainLine("unknown tag " + m_value, depth);
 	}
 
 	void debug(QDebug &dbg) const
@@ -147,6 +276,257 @@ private:
 	int m_id;
 };
 
+/**
+  A wildcard pattern such as "cat*" or "*:portrait".
+  The pattern is expanded to the matching tags when the query is initialized,
+  and matches pictures that have any of them.
+  */
+class TagQueryWildcardNode : public TagQueryNode
+{
+public:
+	TagQueryWildcardNode(const QString& pattern) : m_pattern(pattern) { }
+
+	void init(const Tags *tags)
+	{
+		m_ids = tags->match(m_pattern);
+	}
+
+	void queryInit(Tags *tags)
+	{
+		// Wildcards never create new tags
+		init(tags);
+	}
+
+	bool hasWildcards() const
+	{
+		return true;
+	}
+
+	bool isTrivial() const
+	{
+		return false;
+	}
+
+	void gatherTagIds(QSet<int>& list, bool negate) const {
+		if(!negate)
+			foreach(int id, m_ids)
+				list.insert(id);
+	}
+
+	//! Compiled as an OR chain of the matching tags
+	void compile(TagQueryProgram &program) const
+	{
+		if(m_ids.isEmpty()) {
+			program.append(TagQueryOp(TagQueryOp::TAG, -1));
+			return;
+		}
+
+		QVector<int> jumps;
+		for(int i=0;i<m_ids.count();++i) {
+			program.append(TagQueryOp(TagQueryOp::TAG, m_ids.at(i)));
+			if(i < m_ids.count()-1) {
+				jumps.append(program.size());
+				program.append(TagQueryOp(TagQueryOp::JUMP_IF_TRUE));
+			}
+		}
+		foreach(int jump, jumps)
+			program[jump].arg = program.size();
+	}
+
+	QString toSql(const QString& universe) const
+	{
+		Q_UNUSED(universe);
+		if(m_ids.isEmpty())
+			return "SELECT picid FROM tagmap WHERE 0";
+
+		QStringList ids;
+		foreach(int id, m_ids)
+			ids << QString::number(id);
+		return "SELECT picid FROM tagmap WHERE tagid IN (" + ids.join(",") + ") GROUP BY picid";
+	}
+
+	bool flatTags(QSet<int>& tags, bool conjunction) const
+	{
+		// The expansion is a disjunction
+		if(m_ids.isEmpty() || (conjunction && m_ids.count()>1))
+			return false;
+		foreach(int id, m_ids)
+			tags.insert(id);
+		return true;
+	}
+
+	int plan(const Tags *tags)
+	{
+		// Pictures with several matching tags are counted more than once
+		m_estimate = 0;
+		foreach(int id, m_ids)
+			m_estimate += tags->frequency(id);
+		return m_estimate;
+	}
+
+	void requiredTags(QSet<int>& tags) const
+	{
+		if(m_ids.count()==1)
+			tags.insert(m_ids.first());
+	}
+
+	void explain(QStringList& lines, int depth) const
+	{
+		lines << explainLine(QString("wildcard %1 (%2 tags)").arg(m_pattern).arg(m_ids.count()), depth);
+	}
+
+	void debug(QDebug &dbg) const
+	{
+		dbg << m_pattern;
+	}
+
+private:
+	QString m_pattern;
+	QVector<int> m_ids;
+};
+
+/**
+  A predicate on picture metadata rather than tags, such as ":title(beach)" or ":hidden".
+  The pictures matching the predicate are looked up in SQL when the query is initialized.
+  */
+class TagQueryMetaNode : public TagQueryNode
+{
+public:
+	enum Field { FILENAME, TITLE, HASH, HIDDEN, NEW };
+
+	TagQueryMetaNode(Field field, const QString& param=QString()) : m_field(field), m_param(param), m_slot(-1) { }
+
+	/**
+	 * \brief Get the predicate for a token
+	 * \param name the token, e.g. ":title" or ":hidden"
+	 * \param field the predicate type is returned here
+	 * \param hasparam set to true if the predicate takes a parenthesized parameter
+	 * \return false if the token is not a metadata predicate
+	 */
+	static bool lookup(const QString& name, Field &field, bool &hasparam)
+	{
+		hasparam = true;
+		if(name == ":file" || name == ":filename")
+			field = FILENAME;
+		else if(name == ":title")
+			field = TITLE;
+		else if(name == ":hash")
+			field = HASH;
+		else {
+			hasparam = false;
+			if(name == ":hidden")
+				field = HIDDEN;
+			else if(name == ":new")
+				field = NEW;
+			else
+				return false;
+		}
+		return true;
+	}
+
+	Field field() const { return m_field; }
+
+	//! Get the SQL condition on the picture table
+	const QString& filter() const { return m_filter; }
+
+	//! Get the matching pictures (hidden ones included)
+	const PicBitmap& pictures() const { return m_pictures; }
+
+	//! Set the index of this predicate in the compiled program
+	void setSlot(int slot) { m_slot = slot; }
+
+	void init(const Tags *tags)
+	{
+		const Database *db = tags->database();
+		switch(m_field) {
+		case FILENAME: m_filter = "filename GLOB " + db->esc("*" + m_param + "*"); break;
+		case TITLE: m_filter = "title LIKE " + db->esc("%" + m_param + "%"); break;
+		case HASH: m_filter = "hash LIKE " + db->esc(m_param + "%"); break;
+		case HIDDEN: m_filter = "hidden=1"; break;
+		case NEW: m_filter = "picid>" + QString::number(db->getSetting("lastnewid").toInt()); break;
+		}
+
+		m_pictures.clear();
+		QSqlQuery q(db->get());
+		q.setForwardOnly(true);
+		if(!q.exec("SELECT picid FROM picture WHERE " + m_filter + " ORDER BY picid"))
+			qWarning("Couldn't match metadata predicate %s: %s", qPrintable(m_filter), qPrintable(q.lastError().text()));
+		while(q.next())
+			m_pictures.add(q.value(0).toInt());
+	}
+
+	void queryInit(Tags *tags)
+	{
+		init(tags);
+	}
+
+	bool isTrivial() const
+	{
+		return false;
+	}
+
+	void gatherTagIds(QSet<int>& list, bool negate) const
+	{
+		Q_UNUSED(list);
+		Q_UNUSED(negate);
+	}
+
+	void gatherMetadata(QList<TagQueryMetaNode*>& nodes)
+	{
+		nodes.append(this);
+	}
+
+	void requiredMetadata(QList<const TagQueryMetaNode*>& nodes) const
+	{
+		nodes.append(this);
+	}
+
+	void compile(TagQueryProgram &program) const
+	{
+		program.append(TagQueryOp(TagQueryOp::META, m_slot));
+	}
+
+	QString toSql(const QString& universe) const
+	{
+		Q_UNUSED(universe);
+		return "SELECT picid FROM picture WHERE " + m_filter;
+	}
+
+	QString untaggedSql() const
+	{
+		return m_filter;
+	}
+
+	int plan(const Tags *tags)
+	{
+		Q_UNUSED(tags);
+		m_estimate = m_pictures.count();
+		return m_estimate;
+	}
+
+	void requiredTags(QSet<int>& tags) const
+	{
+		Q_UNUSED(tags);
+	}
+
+	void explain(QStringList& lines, int depth) const
+	{
+		lines << explainLine("metadata " + m_filter, depth);
+	}
+
+	void debug(QDebug &dbg) const
+	{
+		dbg << m_filter;
+	}
+
+private:
+	Field m_field;
+	QString m_param;
+	QString m_filter;
+	PicBitmap m_pictures;
+	int m_slot;
+};
+
 class TagQueryBinaryNode : public TagQueryNode
 {
 public:
@@ -179,6 +559,11 @@ public:
 		m_right->gatherTagIds(list, negate);
 	}
 
+	void gatherMetadata(QList<TagQueryMetaNode*>& nodes) {
+		m_left->gatherMetadata(nodes);
+		m_right->gatherMetadata(nodes);
+	}
+
 	void setLeft(TagQueryNode *node) {
 		m_left = node;
 	}
@@ -191,7 +576,99 @@ public:
 		return m_left->hasSets() || m_right->hasSets();
 	}
 
+	bool hasWildcards() const {
+		return m_left->hasWildcards() || m_right->hasWildcards();
+	}
+
+	int plan(const Tags *tags)
+	{
+		const int total = tags->taggedCount();
+
+		// Tag set matching depends on the order of the operands
+		if(hasSets()) {
+			m_estimate = combineEstimates(m_left->plan(tags), m_right->plan(tags), total);
+			return m_estimate;
+		}
+
+		// Flatten the chain of this operator and plan the operands
+		QList<TagQueryNode*> operands;
+		QList<TagQueryBinaryNode*> joints;
+		collectChain(operands, joints);
+		foreach(TagQueryNode *node, operands)
+			node->plan(tags);
+
+		qStableSort(operands.begin(), operands.end(), evaluateFirst());
+
+		// Rebuild the chain left-deep, so the operands are evaluated in the sorted order
+		const int n = operands.count();
+		for(int i=n-2;i>=0;--i) {
+			TagQueryBinaryNode *joint = joints.at(i);
+			joint->m_left = i==n-2 ? operands.at(0) : joints.at(i+1);
+			joint->m_right = operands.at(n-1-i);
+			joint->m_estimate = combineEstimates(joint->m_left->estimate(), joint->m_right->estimate(), total);
+		}
+
+		return m_estimate;
+	}
+
+	void explain(QStringList& lines, int depth) const
+	{
+		QList<TagQueryNode*> operands;
+		QList<TagQueryBinaryNode*> joints;
+		const_cast<TagQueryBinaryNode*>(this)->collectChain(operands, joints);
+
+		lines << explainLine(operatorName(), depth);
+		foreach(const TagQueryNode *node, operands)
+			node->explain(lines, depth+1);
+	}
+
 protected:
+	typedef bool (*EstimateOrder)(const TagQueryNode *a, const TagQueryNode *b);
+
+	//! Get the order in which the operands of this operator should be evaluated
+	virtual EstimateOrder evaluateFirst() const = 0;
+
+	//! Estimate the number of pictures matching this operator
+	virtual int combineEstimates(int left, int right, int total) const = 0;
+
+	virtual QString operatorName() const = 0;
+
+	static bool fewestFirst(const TagQueryNode *a, const TagQueryNode *b) { return a->estimate() < b->estimate(); }
+	static bool mostFirst(const TagQueryNode *a, const TagQueryNode *b) { return a->estimate() > b->estimate(); }
+
+	//! Collect the operands of a chain of the same operator, in evaluation order
+	void collectChain(QList<TagQueryNode*>& operands, QList<TagQueryBinaryNode*>& joints)
+	{
+		joints.append(this);
+		TagQueryNode *sides[] = { m_left, m_right };
+		for(int i=0;i<2;++i) {
+			TagQueryBinaryNode *bin = dynamic_cast<TagQueryBinaryNode*>(sides[i]);
+			if(bin!=0 && typeid(*bin)==typeid(*this))
+				bin->collectChain(operands, joints);
+			else
+				operands.append(sides[i]);
+		}
+	}
+
+	/**
+	  Join the left and right hand side queries with a compound operator.
+	  SQLite does not allow parenthesized compound selects, so the operands are wrapped in subqueries.
+	  */
+	QString compound(const QString& op, const QString& universe) const
+	{
+		return "SELECT picid FROM (" + m_left->toSql(universe) + ") " + op + " SELECT picid FROM (" + m_right->toSql(universe) + ")";
+	}
+
+	//! Compile as left <jump> right, where the jump skips the right side
+	void compileShortCircuit(TagQueryProgram &program, TagQueryOp::Code jump) const
+	{
+		m_left->compile(program);
+		const int jumpop = program.size();
+		program.append(TagQueryOp(jump));
+		m_right->compile(program);
+		program[jumpop].arg = program.size();
+	}
+
 	TagQueryNode *m_left, *m_right;
 };
 
@@ -220,12 +697,20 @@ public:
 		m_node->gatherTagIds(list, negate);
 	}
 
+	void gatherMetadata(QList<TagQueryMetaNode*>& nodes) {
+		m_node->gatherMetadata(nodes);
+	}
+
 	void setNode(TagQueryNode *node) { m_node = node; }
 
 	bool hasSets() const {
 		return m_node->hasSets();
 	}
 
+	bool hasWildcards() const {
+		return m_node->hasWildcards();
+	}
+
 protected:
 	TagQueryNode *m_node;
 };
@@ -251,15 +736,61 @@ public:
 		return false;
 	}
 
-	bool match(const TagIdSet &tags, int limitset, long &limitmask) const
+	void compile(TagQueryProgram &program) const
+	{
+		compileShortCircuit(program, TagQueryOp::JUMP_IF_FALSE);
+	}
+
+	QString toSql(const QString& universe) const
+	{
+		// A conjunction of plain tags can be matched in a single pass over the tag map
+		QSet<int> tags;
+		if(flatTags(tags, true))
+			return "SELECT picid FROM tagmap WHERE tagid IN (" + set2list(tags).join(",") + ") GROUP BY picid HAVING COUNT(DISTINCT tagid)=" + QString::number(tags.count());
+
+		// A AND NOT B is A EXCEPT B: the complement of B is never needed
+		const TagQueryNode *left = m_left, *right = m_right;
+		if(left->negatedNode()!=0 && right->negatedNode()==0)
+			qSwap(left, right);
+		if(right->negatedNode()!=0)
+			return "SELECT picid FROM (" + left->toSql(universe) + ") EXCEPT SELECT picid FROM (" + right->negatedNode()->toSql(universe) + ")";
+
+		return compound("INTERSECT", universe);
+	}
+
+	bool flatTags(QSet<int>& tags, bool conjunction) const
 	{
-		return m_left->match(tags, limitset, limitmask) && m_right->match(tags, limitset, limitmask);
+		return conjunction && m_left->flatTags(tags, true) && m_right->flatTags(tags, true);
 	}
 
-	bool match(const TagIdSet &tags, int limitset, TagMatchResults &results) const
+	void requiredTags(QSet<int>& tags) const
 	{
-		return m_left->match(tags, limitset, results) && m_right->match(tags, limitset, results);
+		m_left->requiredTags(tags);
+		m_right->requiredTags(tags);
 	}
+
+	void requiredMetadata(QList<const TagQueryMetaNode*>& nodes) const
+	{
+		m_left->requiredMetadata(nodes);
+		m_right->requiredMetadata(nodes);
+	}
+
+	QString untaggedSql() const
+	{
+		return "(" + m_left->untaggedSql() + " AND " + m_right->untaggedSql() + ")";
+	}
+
+protected:
+	// The operand least likely to match can cut the evaluation short
+	EstimateOrder evaluateFirst() const { return fewestFirst; }
+
+	int combineEstimates(int left, int right, int total) const
+	{
+		// Assume the operands are independent
+		return total>0 ? qRound(double(left) * right / total) : 0;
+	}
+
+	QString operatorName() const { return "AND"; }
 };
 
 class TagQueryOrNode : public TagQueryBinaryNode
@@ -282,15 +813,50 @@ public:
 		return m_left->isTrivial() && m_right->isTrivial();
 	}
 
-	bool match(const TagIdSet &tags, int limitset, long &limitmask) const
+	void compile(TagQueryProgram &program) const
+	{
+		compileShortCircuit(program, TagQueryOp::JUMP_IF_TRUE);
+	}
+
+	QString toSql(const QString& universe) const
 	{
-		return m_left->match(tags, limitset, limitmask) || m_right->match(tags, limitset, limitmask);
+		QSet<int> tags;
+		if(flatTags(tags, false))
+			return "SELECT picid FROM tagmap WHERE tagid IN (" + set2list(tags).join(",") + ") GROUP BY picid";
+
+		return compound("UNION", universe);
+	}
+
+	bool flatTags(QSet<int>& tags, bool conjunction) const
+	{
+		return !conjunction && m_left->flatTags(tags, false) && m_right->flatTags(tags, false);
+	}
+
+	void requiredTags(QSet<int>& tags) const
+	{
+		QSet<int> left, right;
+		m_left->requiredTags(left);
+		m_right->requiredTags(right);
+		tags.unite(left.intersect(right));
+	}
+
+	QString untaggedSql() const
+	{
+		return "(" + m_left->untaggedSql() + " OR " + m_right->untaggedSql() + ")";
 	}
 
-	bool match(const TagIdSet &tags, int limitset, TagMatchResults &results) const
+protected:
+	// The operand most likely to match can cut the evaluation short
+	EstimateOrder evaluateFirst() const { return mostFirst; }
+
+	int combineEstimates(int left, int right, int total) const
 	{
-		return m_left->match(tags, limitset, results) || m_right->match(tags, limitset, results);
+		if(total<=0)
+			return qMax(left, right);
+		return left + right - qRound(double(left) * right / total);
 	}
+
+	QString operatorName() const { return "OR"; }
 };
 
 class TagQueryNotNode : public TagQueryUnaryNode
@@ -317,14 +883,39 @@ public:
 		m_node->gatherTagIds(list, !negate);
 	}
 
-	bool match(const TagIdSet &tags, int limitset, long &limitmask) const
+	const TagQueryNode *negatedNode() const { return m_node; }
+
+	void compile(TagQueryProgram &program) const
 	{
-		return !m_node->match(tags, limitset, limitmask);
+		m_node->compile(program);
+		program.append(TagQueryOp(TagQueryOp::NOT));
 	}
 
-	bool match(const TagIdSet &tags, int limitset, TagMatchResults &results) const
+	QString toSql(const QString& universe) const
 	{
-		return !m_node->match(tags, limitset, results);
+		return "SELECT picid FROM (" + universe + ") EXCEPT SELECT picid FROM (" + m_node->toSql(universe) + ")";
+	}
+
+	int plan(const Tags *tags)
+	{
+		m_estimate = qMax(0, tags->taggedCount() - m_node->plan(tags));
+		return m_estimate;
+	}
+
+	void requiredTags(QSet<int>& tags) const
+	{
+		Q_UNUSED(tags);
+	}
+
+	QString untaggedSql() const
+	{
+		return "NOT (" + m_node->untaggedSql() + ")";
+	}
+
+	void explain(QStringList& lines, int depth) const
+	{
+		lines << explainLine("NOT", depth);
+		m_node->explain(lines, depth+1);
 	}
 };
 
@@ -343,38 +934,52 @@ public:
 		return false;
 	}
 
-	bool match(const TagIdSet &tags, int limitset, long &limitmask) const
+	/*
+	  The operand is matched against each unused tag set in turn.
+	  The first set it matches is marked as used.
+	  Although the grammar allows nested tag sets, other limitations prevent their use.
+	*/
+	void compile(TagQueryProgram &program) const
 	{
-		Q_UNUSED(limitset); // Although the grammar allows nested tag sets, other limitations prevent their use.
+		program.append(TagQueryOp(TagQueryOp::SET_BEGIN));
+		const int next = program.size();
+		program.append(TagQueryOp(TagQueryOp::SET_NEXT));
+		m_node->compile(program);
+		program.append(TagQueryOp(TagQueryOp::SET_END, next));
+		program[next].arg = program.size();
+	}
 
-		for(int i=1;i<=tags.sets();++i) {
-			if(! (limitmask & (1<<i))) {
-				if(m_node->match(tags, i, limitmask)) {
-					limitmask |= (1<<i);
-					return  true;
-				}
-			}
-		}
-		return false;
+	bool hasSets() const {
+		return true;
 	}
 
-	bool match(const TagIdSet &tags, int limitset, TagMatchResults &results) const
+	QString toSql(const QString& universe) const
 	{
-		Q_UNUSED(limitset); // Although the grammar allows nested tag sets, other limitations prevent their use.
-		for(int i=1;i<=tags.sets();++i) {
-			if(!results.tagsets.contains(i)) {
-				bool m = m_node->match(tags, i, results);
-				if(m) {
-					results.tagsets.append(i);
-					return true;
-				}
-			}
-		}
-		return false;
+		Q_UNUSED(universe);
+		qWarning("Tag set queries cannot be converted to SQL");
+		return "SELECT picid FROM tagmap WHERE 0";
 	}
 
-	bool hasSets() const {
-		return true;
+	int plan(const Tags *tags)
+	{
+		m_estimate = m_node->plan(tags);
+		return m_estimate;
+	}
+
+	void requiredTags(QSet<int>& tags) const
+	{
+		m_node->requiredTags(tags);
+	}
+
+	void requiredMetadata(QList<const TagQueryMetaNode*>& nodes) const
+	{
+		m_node->requiredMetadata(nodes);
+	}
+
+	void explain(QStringList& lines, int depth) const
+	{
+		lines << explainLine("TAG SET", depth);
+		m_node->explain(lines, depth+1);
 	}
 };
 
@@ -469,8 +1074,33 @@ void TagQueryParser::parseP() {
 		pushOperator(new TagQueryNotNode());
 		consume();
 		parseP();
+	} else if(next().startsWith(':')) {
+		TagQueryMetaNode::Field field;
+		bool hasparam;
+		if(!TagQueryMetaNode::lookup(next(), field, hasparam)) {
+			// Pseudo tags such as :any
+			m_operands.push(new TagQueryLeafNode(next()));
+			consume();
+			return;
+		}
+		consume();
+
+		QString param;
+		if(hasparam) {
+			// The parameter is a single raw token (see tokenizeQuery)
+			expect("(");
+			if(next() != ")") {
+				param = next();
+				consume();
+			}
+			expect(")");
+		}
+		m_operands.push(new TagQueryMetaNode(field, param));
 	} else {
-		m_operands.push(new TagQueryLeafNode(next()));
+		if(next().contains('*'))
+			m_operands.push(new TagQueryWildcardNode(next()));
+		else
+			m_operands.push(new TagQueryLeafNode(next()));
 		consume();
 	}
 }
@@ -505,14 +1135,337 @@ void TagQueryParser::expect(const QString& token) {
 }
 
 struct TagQueryPrivate {
+	TagQueryPrivate() : hasSets(false), matchesUntagged(false), candidate(-1), candidateEstimate(-1),
+		includesHidden(false), hasMetaCandidates(false) { }
+
+	//! Compile the (initialized) query tree
+	void compile();
+
+	//! Plan the evaluation order and pick the candidate tag
+	void plan(const Tags *tags);
+
+	/**
+	  Run the compiled query.
+	  \param tags the tags to match against (TagIdSetView or TagStoreEntry)
+	  \param limitset if nonnegative, match only against the tags in that set
+	  \param results if not null, details about the match are recorded here
+	  \return true if query matched
+	  */
+	template<class TagSource> bool run(const TagSource &tags, int limitset, TagMatchResults *results) const;
+
+	//! The parse tree. This is used for debugging output and SQL generation
 	QSharedPointer<TagQueryNode> node;
 	QString error;
+
+	//! The compiled query used for matching
+	TagQueryProgram program;
+
+	//! Tag IDs mentioned in the query (excluding negated ones)
+	QSet<int> tagids;
+
+	//! Negated tag IDs
+	QSet<int> nottagids;
+
+	//! Does the query contain tag set operators
+	bool hasSets;
+
+	//! Does the query match pictures without any tags
+	bool matchesUntagged;
+
+	//! The rarest tag every match must have, or -1 if there is no such tag
+	int candidate;
+
+	//! Number of pictures with the candidate tag
+	int candidateEstimate;
+
+	//! The pictures matching each metadata predicate, indexed by the META instruction argument
+	QVector<PicBitmap> metadata;
+
+	//! Does the query have a :hidden predicate (hidden pictures are not left out)
+	bool includesHidden;
+
+	//! The pictures matched by the :hidden predicate
+	PicBitmap hiddenPictures;
+
+	//! SQL conditions of the metadata predicates every match must satisfy
+	QStringList requiredFilters;
+
+	//! Is metaCandidates set
+	bool hasMetaCandidates;
+
+	//! The pictures satisfying all required metadata predicates
+	PicBitmap metaCandidates;
 };
 
+void TagQueryPrivate::plan(const Tags *tags)
+{
+	candidate = -1;
+	candidateEstimate = -1;
+	if(node==0)
+		return;
+
+	node->plan(tags);
+
+	QSet<int> required;
+	node->requiredTags(required);
+	foreach(int tag, required) {
+		const int freq = tags->frequency(tag);
+		if(candidate<0 || freq < candidateEstimate) {
+			candidate = tag;
+			candidateEstimate = freq;
+		}
+	}
+}
+
+namespace {
+	//! The tags of an untagged picture
+	class NoTags {
+	public:
+		int pictureId() const { return -1; }
+		int sets() const { return 0; }
+		bool contains(int set, int tag) const { Q_UNUSED(set); Q_UNUSED(tag); return false; }
+		bool contains(int tag) const { Q_UNUSED(tag); return false; }
+	};
+}
+
+void TagQueryPrivate::compile()
+{
+	program.clear();
+	tagids.clear();
+	nottagids.clear();
+	hasSets = false;
+	matchesUntagged = false;
+	metadata.clear();
+	includesHidden = false;
+	hiddenPictures.clear();
+	requiredFilters.clear();
+	hasMetaCandidates = false;
+	metaCandidates.clear();
+
+	if(node!=0) {
+		QList<TagQueryMetaNode*> metanodes;
+		node->gatherMetadata(metanodes);
+		for(int i=0;i<metanodes.count();++i) {
+			metanodes.at(i)->setSlot(i);
+			metadata.append(metanodes.at(i)->pictures());
+			if(metanodes.at(i)->field() == TagQueryMetaNode::HIDDEN) {
+				includesHidden = true;
+				hiddenPictures = metanodes.at(i)->pictures();
+			}
+		}
+
+		// The required metadata predicates are pushed down: only pictures
+		// satisfying all of them are matched against the tags.
+		QList<const TagQueryMetaNode*> required;
+		node->requiredMetadata(required);
+		foreach(const TagQueryMetaNode *meta, required) {
+			requiredFilters << meta->filter();
+			if(hasMetaCandidates)
+				metaCandidates &= meta->pictures();
+			else
+				metaCandidates = meta->pictures();
+			hasMetaCandidates = true;
+		}
+
+		node->compile(program);
+		node->gatherTagIds(tagids, false);
+		node->gatherTagIds(nottagids, true);
+		hasSets = node->hasSets();
+
+		// Untagged pictures either all match or none do, unless
+		// the query has metadata predicates (see TagQuery::untaggedSql())
+		matchesUntagged = !metadata.isEmpty() || run(NoTags(), -1, 0);
+	}
+}
+
+namespace {
+	//! The state of a tag set loop
+	struct SetFrame {
+		int set;
+		int outerlimit;
+	};
+
+	//! A bitset of the tag sets already matched by a tag set operator
+	class UsedSets {
+	public:
+		UsedSets(int sets) : m_words((sets >> 6) + 1)
+		{
+			for(int i=0;i<m_words.size();++i)
+				m_words[i] = 0;
+		}
+
+		bool test(int set) const { return m_words[set >> 6] & (Q_UINT64_C(1) << (set & 63)); }
+
+		void set(int set) { m_words[set >> 6] |= Q_UINT64_C(1) << (set & 63); }
+
+	private:
+		// 256 sets fit without a heap allocation
+		QVarLengthArray<quint64, 4> m_words;
+	};
+
+	//! Gives TagIdSet the same interface as TagStoreEntry for TagQueryPrivate::run()
+	class TagIdSetView {
+	public:
+		TagIdSetView(const TagIdSet &tags) : m_tags(tags) { }
+
+		int pictureId() const { return m_tags.pictureId(); }
+
+		int sets() const { return m_tags.sets(); }
+
+		bool contains(int set, int tag) const { return m_tags.tags(set).contains(tag); }
+
+		bool contains(int tag) const
+		{
+			for(int i=0;i<=m_tags.sets();++i)
+				if(m_tags.tags(i).contains(tag))
+					return true;
+			return false;
+		}
+
+	private:
+		const TagIdSet &m_tags;
+	};
+}
+
+template<class TagSource> bool TagQueryPrivate::run(const TagSource &tags, int limitset, TagMatchResults *results) const
+{
+	const TagQueryOp *code = program.constData();
+	const int length = program.size();
+
+	// Sets used by tag set operators. When details are recorded, the order is also kept in the results.
+	UsedSets used(tags.sets());
+	QVarLengthArray<SetFrame, 8> frames;
+
+	bool acc = false;
+	int pc = 0;
+	while(pc < length) {
+		const TagQueryOp &op = code[pc];
+		switch(op.code) {
+		case TagQueryOp::TAG:
+			acc = false;
+			if(op.arg>0) {
+				if(limitset<0)
+					acc = tags.contains(op.arg);
+				else
+					acc = tags.contains(limitset, op.arg);
+			}
+			break;
+		case TagQueryOp::ANY:
+			acc = results!=0;
+			break;
+		case TagQueryOp::META:
+			acc = metadata.at(op.arg).contains(tags.pictureId());
+			break;
+		case TagQueryOp::NOT:
+			acc = !acc;
+			break;
+		case TagQueryOp::JUMP_IF_FALSE:
+			if(!acc) {
+				pc = op.arg;
+				continue;
+			}
+			break;
+		case TagQueryOp::JUMP_IF_TRUE:
+			if(acc) {
+				pc = op.arg;
+				continue;
+			}
+			break;
+		case TagQueryOp::SET_BEGIN: {
+			SetFrame frame = {0, limitset};
+			frames.append(frame);
+			break;
+		}
+		case TagQueryOp::SET_NEXT: {
+			SetFrame &frame = frames.last();
+			int set = frame.set + 1;
+			while(set<=tags.sets() && used.test(set))
+				++set;
+
+			if(set > tags.sets()) {
+				// No more sets to try
+				acc = false;
+				limitset = frame.outerlimit;
+				frames.removeLast();
+				pc = op.arg;
+				continue;
+			}
+			frame.set = set;
+			limitset = set;
+			break;
+		}
+		case TagQueryOp::SET_END:
+			if(acc) {
+				const SetFrame &frame = frames.last();
+				used.set(frame.set);
+				if(results!=0)
+					results->tagsets.append(frame.set);
+				limitset = frame.outerlimit;
+				frames.removeLast();
+			} else {
+				pc = op.arg;
+				continue;
+			}
+			break;
+		}
+		++pc;
+	}
+
+	return acc;
+}
+
+/**
+  Split a query string into tokens.
+
+  The parameters of metadata predicates are kept as they were written:
+  the parameter of ":title(a, b)" is the single token "a, b". The
+  parameter ends at the matching closing parenthesis, which may be left out
+  at the end of the query.
+  */
+static QStringList tokenizeQuery(const QString& query)
+{
+	static const QString separators = "()[]!,|";
+	QStringList tokens;
+
+	int pos = 0;
+	int open;
+	while((open = query.indexOf('(', pos)) >= 0) {
+		// The word before the parenthesis
+		int start = open;
+		while(start>pos && !separators.contains(query.at(start-1)))
+			--start;
+
+		tokens += Util::tokenize(query.mid(pos, open + 1 - pos), separators, true);
+		pos = open + 1;
+
+		TagQueryMetaNode::Field field;
+		bool hasparam;
+		if(!TagQueryMetaNode::lookup(query.mid(start, open - start).trimmed(), field, hasparam) || !hasparam)
+			continue;
+
+		int end = pos;
+		for(int depth=1;end<query.length();++end) {
+			if(query.at(end) == '(')
+				++depth;
+			else if(query.at(end) == ')' && --depth == 0)
+				break;
+		}
+
+		const QString param = query.mid(pos, end - pos).trimmed();
+		if(!param.isEmpty())
+			tokens.append(param);
+		tokens.append(")");
+		pos = end + 1;
+	}
+
+	tokens += Util::tokenize(query.mid(pos), separators, true);
+	return tokens;
+}
+
 TagQuery::TagQuery(const QString& query)
 	: m_p(new TagQueryPrivate())
 {
-	QStringList tokens = Util::tokenize(query, "()[]!,|", true);
+	QStringList tokens = tokenizeQuery(query);
 
 	// TODO add naive parenthesis balancing for user friendliness
 	try {
@@ -562,6 +1515,8 @@ void TagQuery::init(const Tags *tags)
 		} catch(const ParseException& e) {
 			m_p->error = e.message;
 		}
+		m_p->plan(tags);
+		m_p->compile();
 	}
 }
 
@@ -573,17 +1528,10 @@ void TagQuery::queryInit(Tags *tags)
 		} catch(const ParseException& e) {
 			m_p->error = e.message;
 		}
+		m_p->compile();
 	}
 }
 
-static QStringList set2list(const QSet<int> &set)
-{
-	QStringList list;
-	foreach(int i, set)
-		list.append(QString::number(i));
-	return list;
-}
-
 static QString gettag(const QSet<int> &set)
 {
 	Q_ASSERT(set.count()==1);
@@ -592,12 +1540,92 @@ static QString gettag(const QSet<int> &set)
 
 QStringList TagQuery::mentionedTagIds() const
 {
-	if(m_p->node!=0) {
-		QSet<int> ids;
-		m_p->node->gatherTagIds(ids, false);
-		return set2list(ids);
+	return set2list(m_p->tagids);
+}
+
+QVector<int> TagQuery::referencedTagIds() const
+{
+	return (m_p->tagids + m_p->nottagids).toList().toVector();
+}
+
+bool TagQuery::isMonotonic() const
+{
+	foreach(const TagQueryOp &op, m_p->program)
+		if(op.code == TagQueryOp::NOT || op.code == TagQueryOp::ANY)
+			return false;
+	return true;
+}
+
+int TagQuery::singleTag() const
+{
+	if(dynamic_cast<const TagQueryLeafNode*>(m_p->node.data())==0 || m_p->tagids.count()!=1)
+		return -1;
+	return *m_p->tagids.constBegin();
+}
+
+/**
+  Unless the query matches untagged pictures, only pictures with at least one of the
+  (non-negated) mentioned tags can match. If the query has required tags, the candidates
+  are narrowed down to the pictures with the rarest one.
+  Queries that match untagged pictures have all visible pictures as candidates.
+  The candidates are further narrowed down with the required metadata predicates.
+  */
+QString TagQuery::candidateSql() const
+{
+	const QString metafilter = m_p->requiredFilters.join(" AND ");
+
+	if(m_p->candidate>0) {
+		QString sql = "SELECT picid FROM tagmap WHERE tagid=" + QString::number(m_p->candidate);
+		if(!metafilter.isEmpty())
+			sql += " AND picid IN (SELECT picid FROM picture WHERE " + metafilter + ")";
+		return sql + " GROUP BY picid";
+	}
+	if(m_p->matchesUntagged) {
+		QStringList filters;
+		if(!m_p->includesHidden)
+			filters << "hidden=0";
+		if(!metafilter.isEmpty())
+			filters << metafilter;
+		if(filters.isEmpty())
+			return "SELECT picid FROM picture";
+		return "SELECT picid FROM picture WHERE " + filters.join(" AND ");
+	}
+	if(m_p->tagids.isEmpty())
+		return "SELECT picid FROM tagmap WHERE 0";
+	return "SELECT picid FROM tagmap WHERE tagid IN (" + set2list(m_p->tagids).join(",") + ") GROUP BY picid";
+}
+
+QString TagQuery::explain() const
+{
+	QStringList lines;
+	if(isError()) {
+		lines << "Error: " + m_p->error;
+	} else if(m_p->node==0) {
+		lines << "Empty query: all pictures";
+	} else {
+		if(m_p->hasSets)
+			lines << "Matched per picture (query has tag sets)";
+		else if(isTrivial())
+			lines << "Matched in SQL (trivial query)";
+		else
+			lines << "Matched in SQL or with the tag index";
+
+		m_p->node->explain(lines, 1);
+
+		if(m_p->candidate>0)
+			lines << QString("Candidates: pictures with tag #%1, ~%2 pictures").arg(m_p->candidate).arg(m_p->candidateEstimate);
+		else if(m_p->matchesUntagged)
+			lines << "Candidates: all visible pictures (query matches untagged pictures)";
+		else
+			lines << "Candidates: pictures with any of the tags " + mentionedTagIds().join(",");
+
+		if(m_p->hasMetaCandidates)
+			lines << QString("Candidates narrowed down to pictures with %1, %2 pictures").arg(m_p->requiredFilters.join(" AND ")).arg(m_p->metaCandidates.count());
+
+		if(!m_p->hasSets)
+			lines << "SQL: " + toSql();
 	}
-	return QStringList();
+	return lines.join("\n");
 }
 
 bool TagQuery::isTrivial() const
@@ -607,13 +1635,55 @@ bool TagQuery::isTrivial() const
 	return m_p->node->isTrivial();
 }
 
+bool TagQuery::hasSets() const
+{
+	return m_p->hasSets;
+}
+
+bool TagQuery::matchesUntagged() const
+{
+	return m_p->matchesUntagged;
+}
+
+bool TagQuery::hasMetadata() const
+{
+	// The parse tree is checked, so this works before init() too
+	QList<TagQueryMetaNode*> nodes;
+	if(m_p->node!=0)
+		m_p->node->gatherMetadata(nodes);
+	return !nodes.isEmpty();
+}
+
+bool TagQuery::hasWildcards() const
+{
+	return m_p->node!=0 && m_p->node->hasWildcards();
+}
+
+bool TagQuery::includesHidden() const
+{
+	return m_p->includesHidden;
+}
+
+QString TagQuery::untaggedSql() const
+{
+	if(m_p->node==0 || m_p->metadata.isEmpty())
+		return m_p->matchesUntagged ? "1" : "0";
+	return m_p->node->untaggedSql();
+}
+
 QString TagQuery::toSql() const
 {
-	if(m_p->node!=0) {
-		// Gather tag IDs
-		QSet<int> tags, nottags;
-		m_p->node->gatherTagIds(tags, false);
-		m_p->node->gatherTagIds(nottags, true);
+	if(m_p->node!=0 && !m_p->node->isTrivial()) {
+		// Negation is relative to the candidate pictures
+		return m_p->node->toSql(candidateSql());
+
+	} else if(m_p->node!=0) {
+		const QSet<int> &tags = m_p->tagids;
+		const QSet<int> &nottags = m_p->nottagids;
+
+		// Negation is relative to all visible pictures. Negated tags are
+		// excluded with an anti-join, so untagged pictures are included.
+		const QString universe = "SELECT picid FROM picture WHERE hidden=0";
 
 		// Check if we are in "OR" mode. If this is a trivial query, the ! is
 		// not used for groups, therefore if the query contains a | operator,
@@ -621,32 +1691,28 @@ QString TagQuery::toSql() const
 		bool ormode = dynamic_cast<TagQueryOrNode*>(m_p->node.data()) != 0;
 
 		if(ormode) {
-			if(nottags.count()>1) {
-				// Special case sanity check: ¬A ∪ ¬B = U
-				return "SELECT picid FROM picture";
+			if(nottags.isEmpty()) {
+				// A negated unknown tag matches everything
+				if(m_p->matchesUntagged)
+					return universe;
+				return "SELECT picid FROM tagmap WHERE tagid IN (" + set2list(tags).join(",") + ") GROUP BY picid";
 			}
 
-			QString sql = "SELECT picid FROM tagmap WHERE";
-			if(tags.count()>0) {
-				sql = sql + " tagid IN (" + set2list(tags).join(",") + ")";
-			}
-			if(nottags.count()==1) {
-				if(tags.count()>0)
-					sql = sql + " OR picid NOT IN (SELECT picid FROM tagmap WHERE tagid=" + gettag(nottags) + ")";
-				else
-					sql = sql + " tagid!=" + gettag(nottags);
-			}
-			sql += " GROUP BY picid";
-			return sql;
+			// ¬A ∪ ¬B ∪ C = U - ((A ∩ B) - C)
+			QString exclude = "SELECT picid FROM tagmap WHERE tagid IN (" + set2list(nottags).join(",") + ") GROUP BY picid HAVING COUNT(DISTINCT tagid)=" + QString::number(nottags.count());
+			if(tags.count()>0)
+				exclude += " EXCEPT SELECT picid FROM tagmap WHERE tagid IN (" + set2list(tags).join(",") + ")";
+			return universe + " AND picid NOT IN (" + exclude + ")";
 		} else {
 			// If not in OR mode, we can match only one tag at a time
-			Q_ASSERT(tags.count() + nottags.count() == 1);
-			QString sql;
+			Q_ASSERT(tags.count() + nottags.count() <= 1);
 			if(tags.count()>0)
-				sql = "SELECT picid FROM tagmap WHERE tagid=" + gettag(tags) + " GROUP BY picid";
-			else
-				sql = "SELECT picid FROM tagmap WHERE tagid!=" + gettag(nottags) + " GROUP BY picid";
-			return sql;
+				return "SELECT picid FROM tagmap WHERE tagid=" + gettag(tags) + " GROUP BY picid";
+			else if(nottags.count()>0)
+				return universe + " AND NOT EXISTS (SELECT 1 FROM tagmap WHERE tagmap.picid=picture.picid AND tagid=" + gettag(nottags) + ")";
+
+			// Unknown tag or its negation
+			return m_p->matchesUntagged ? universe : "SELECT picid FROM tagmap WHERE 0";
 		}
 	} else {
 		// Empty query matches everything
@@ -661,13 +1727,159 @@ QString TagQuery::toSql() const
   */
 bool TagQuery::match(const TagIdSet &tags) const
 {
-	if(m_p->node!=0) {
-		long limitmask=0;
-		return m_p->node->match(tags, -1, limitmask);
-	}
+	return m_p->run(TagIdSetView(tags), -1, 0);
+}
+
+bool TagQuery::match(const TagStoreEntry &tags) const
+{
+	return m_p->run(tags, -1, 0);
+}
+
+bool TagQuery::isCandidate(const TagStoreEntry &tags) const
+{
+	if(m_p->hasMetaCandidates && !m_p->metaCandidates.contains(tags.pictureId()))
+		return false;
+	if(m_p->candidate>0)
+		return tags.contains(m_p->candidate);
+	if(m_p->matchesUntagged)
+		return true;
+
+	foreach(int tag, m_p->tagids)
+		if(tags.contains(tag))
+			return true;
 	return false;
 }
 
+namespace {
+	//! Below this many pictures, matching is not worth spreading across threads
+	const int PARALLEL_MATCH_MIN = 2000;
+
+	//! Match a range of the tag store. This is run in parallel on the global thread pool.
+	QVector<int> matchRange(const TagQuery *query, const TagStore *store, int begin, int end)
+	{
+		QVector<int> matches;
+		for(int i=begin;i<end;++i) {
+			const TagStoreEntry tags = store->entry(i);
+			if(query->isCandidate(tags) && query->match(tags))
+				matches.append(tags.pictureId());
+		}
+		return matches;
+	}
+}
+
+/**
+  The range of the tag store is split into chunks that are matched in parallel.
+  The results are concatenated in chunk order, so they stay in picture ID order.
+  */
+QVector<int> TagQuery::match(const TagStore &store, int first, int last) const
+{
+	const int count = last - first;
+	if(count < PARALLEL_MATCH_MIN)
+		return matchRange(this, &store, first, last);
+
+	// Use a few chunks per core to even out the load
+	const int chunks = qMax(1, QThread::idealThreadCount()) * 4;
+	const int chunksize = (count + chunks - 1) / chunks;
+
+	QList<QFuture<QVector<int> > > futures;
+	for(int begin=first;begin<last;begin+=chunksize)
+		futures.append(QtConcurrent::run(matchRange, this, &store, begin, qMin(begin + chunksize, last)));
+
+	QVector<int> matches;
+	foreach(const QFuture<QVector<int> > &future, futures)
+		matches += future.result();
+	return matches;
+}
+
+namespace {
+	//! A short circuit operator waiting for its right hand side to be evaluated
+	struct PendingOp {
+		PicBitmap left;
+		TagQueryOp::Code code;
+		int target;
+	};
+}
+
+/**
+  The flat program is run once for all pictures, with bitmaps of picture IDs
+  in place of the boolean accumulator. Since all operands must be evaluated,
+  a conditional jump just saves its left operand. The operands are combined
+  when the jump target is reached.
+
+  \param index the tag index
+  \return matching pictures
+  */
+PicBitmap TagQuery::match(const TagIndex &index) const
+{
+	Q_ASSERT(!m_p->hasSets);
+
+	// Only the candidate pictures can match. This is also the universe for negation.
+	PicBitmap universe;
+	if(m_p->candidate>0) {
+		universe = index.pictures(m_p->candidate);
+		if(m_p->hasMetaCandidates)
+			universe &= m_p->metaCandidates;
+	} else if(m_p->hasMetaCandidates) {
+		universe = m_p->metaCandidates;
+	} else if(m_p->matchesUntagged) {
+		universe = index.visiblePictures();
+		if(m_p->includesHidden)
+			universe |= m_p->hiddenPictures;
+	} else {
+		foreach(int tag, m_p->tagids)
+			universe |= index.pictures(tag);
+	}
+
+	const TagQueryOp *code = m_p->program.constData();
+	const int length = m_p->program.size();
+
+	QStack<PendingOp> pending;
+	PicBitmap acc;
+	for(int pc=0;;++pc) {
+		while(!pending.isEmpty() && pending.top().target == pc) {
+			const PendingOp op = pending.pop();
+			if(op.code == TagQueryOp::JUMP_IF_FALSE)
+				acc &= op.left;
+			else
+				acc |= op.left;
+		}
+
+		if(pc >= length)
+			break;
+
+		const TagQueryOp &op = code[pc];
+		switch(op.code) {
+		case TagQueryOp::TAG:
+			if(op.arg>0)
+				acc = index.pictures(op.arg) & universe;
+			else
+				acc.clear();
+			break;
+		case TagQueryOp::ANY:
+			// :any never matches in plain matching mode
+			acc.clear();
+			break;
+		case TagQueryOp::META:
+			acc = m_p->metadata.at(op.arg) & universe;
+			break;
+		case TagQueryOp::NOT:
+			acc = universe - acc;
+			break;
+		case TagQueryOp::JUMP_IF_FALSE:
+		case TagQueryOp::JUMP_IF_TRUE: {
+			PendingOp p = {acc, op.code, op.arg};
+			pending.push(p);
+			break;
+		}
+		default:
+			qWarning("TagQuery::match(TagIndex): unexpected tag set operator");
+			return PicBitmap();
+		}
+	}
+
+	return acc;
+}
+
 /**
   This is used for tag analysis in tag induction.
   \param tags the tag set to match against
@@ -676,17 +1888,17 @@ bool TagQuery::match(const TagIdSet &tags) const
 TagMatchResults TagQuery::query(const TagIdSet &tags) const
 {
 	TagMatchResults results;
-	if(m_p->node!=0) {
-		if(m_p->node->hasSets()) {
+	if(!m_p->program.isEmpty()) {
+		if(m_p->hasSets) {
 			// If query has tag sets, match the usual way
 			results.matchsets = true;
-			if(m_p->node->match(tags, -1, results))
+			if(m_p->run(TagIdSetView(tags), -1, &results))
 				results.matched = true;
 
 		} else {
 			// If it is flat, try querying the tag sets separately first
 			for(int i=0;i<=tags.sets();++i) {
-				if(m_p->node->match(tags, i, results)) {
+				if(m_p->run(TagIdSetView(tags), i, &results)) {
 					results.matched = true;
 					results.tagsets.append(i);
 				}
@@ -695,7 +1907,7 @@ TagMatchResults TagQuery::query(const TagIdSet &tags) const
 			// If no matches have been found so far, try querying
 			// without set borders.
 			if(results.matched==false && tags.sets()>0) {
-				if(m_p->node->match(tags, -1, results))
+				if(m_p->run(TagIdSetView(tags), -1, &results))
 					results.matched = true;
 			}
 		}
@@ -24,6 +24,10 @@
 class TagQueryPrivate;
 class Tags;
 class TagIdSet;
+class TagIndex;
+class TagStoreEntry;
+class TagStore;
+class PicBitmap;
 
 /**
  * \brief Results of a tag matching operation
@@ -78,6 +82,19 @@ QDebug operator<<(QDebug dbg, const TagMatchResults &r);
   U --> "!"
  </pre>
  <p>
+ A tag name v may contain * wildcards, in which case it matches any of the tags
+ matching the pattern (see Tags::match()).
+ <p>
+ A term v may also be a predicate on picture metadata instead of a tag:
+ <pre>
+ :file(text)   file name contains text (also :filename)
+ :title(text)  title contains text
+ :hash(text)   SHA-1 hash starts with text
+ :hidden       picture is hidden
+ :new          picture was added in the last rescan
+ </pre>
+ Hidden pictures are left out of the results, unless the query has a :hidden predicate.
+ <p>
  Before using, call init() and then check if an error was reported.
 
  \see http://www.engr.mun.ca/~theo/Misc/exp_parsing.htm
@@ -110,6 +127,9 @@ public:
 	/**
 	 * \brief Look up tag IDs in preparation for query matching.
 	 *
+	 * The evaluation order is planned using the tag frequency statistics, and the
+	 * query is compiled into a flat program over tag IDs that is used by
+	 * match(TagIdSet) and query(TagIdSet).
 	 * \param tags tag collection
 	 */
 	void init(const Tags *tags);
@@ -132,6 +152,48 @@ public:
 	 */
 	QStringList mentionedTagIds() const;
 
+	/**
+	 * \brief Get the IDs of all tags the query refers to
+	 *
+	 * A picture whose tags from this list do not change keeps matching (or not matching) the query.
+	 * \return tags used in the query, including negated tags
+	 */
+	QVector<int> referencedTagIds() const;
+
+	/**
+	 * \brief Is this query monotonic
+	 *
+	 * Adding tags to a tag set can never make a monotonic query stop matching,
+	 * and new tag sets without any of the referenced tags don't change its results.
+	 * Queries with negations or the :any pseudo tag are not monotonic.
+	 * \return true if query is monotonic
+	 */
+	bool isMonotonic() const;
+
+	/**
+	 * \brief Get the tag of a query that consists of a single plain tag
+	 * \return tag ID, or -1 if this is not a single tag query
+	 */
+	int singleTag() const;
+
+	/**
+	 * \brief Get an SQL query that returns the candidate pictures for this query
+	 *
+	 * All pictures matching the query are among the candidates.
+	 * This is the shortlist for queries that must be matched picture by picture.
+	 * \return SQL query returning picture IDs
+	 */
+	QString candidateSql() const;
+
+	/**
+	 * \brief Describe how this query is evaluated
+	 *
+	 * The description includes the planned evaluation order, estimated match counts,
+	 * the candidate tag and the generated SQL. Call init() first.
+	 * \return human readable query plan
+	 */
+	QString explain() const;
+
 	/**
 	 * \brief Is this a "trivial" query.
 	 * A query if considered trivial if it satisfies one of the following criteria:
@@ -144,17 +206,73 @@ public:
 	 */
 	bool isTrivial() const;
 
+	/**
+	 * \brief Does this query contain tag set operators?
+	 *
+	 * Flat queries (those without tag sets) can be converted to SQL or matched against the inverted tag index.
+	 * \return true if query contains tag sets
+	 */
+	bool hasSets() const;
+
+	/**
+	 * \brief Does this query match pictures that have no tags
+	 *
+	 * Such queries (e.g. "!a") are matched against all visible pictures,
+	 * not just the ones with the mentioned tags.
+	 * Queries with metadata predicates may match some untagged pictures.
+	 * \return true if untagged pictures (may) match
+	 */
+	bool matchesUntagged() const;
+
+	/**
+	 * \brief Does this query have metadata predicates (e.g. ":title(x)")
+	 *
+	 * Whether an untagged picture matches such a query depends on the picture.
+	 * Use untaggedSql() to find the untagged pictures that match.
+	 * \return true if query has metadata predicates
+	 */
+	bool hasMetadata() const;
+
+	/**
+	 * \brief Does this query have wildcard patterns (e.g. "cat*")
+	 *
+	 * The tags matching a pattern are looked up when the query is initialized,
+	 * so tags created after that are not matched.
+	 * \return true if query has wildcards
+	 */
+	bool hasWildcards() const;
+
+	/**
+	 * \brief Does this query decide on the visibility of hidden pictures itself
+	 *
+	 * Hidden pictures are normally left out of the results. Queries with the
+	 * :hidden predicate include them.
+	 * \return true if hidden pictures should not be filtered out
+	 */
+	bool includesHidden() const;
+
+	/**
+	 * \brief Get an SQL condition on the picture table that selects the matching untagged pictures
+	 *
+	 * For queries without metadata predicates, this is a constant ("1" or "0").
+	 * \pre matchesUntagged() == true
+	 */
+	QString untaggedSql() const;
+
 	/**
 	 * \brief Convert this query to SQL.
 	 *
-	 * This is only implemented for simple queries, so check that isTrivial() returns true before calling this.
-	 * It should be possible to perform all queries in pure SQL, but for complex queries the resulting SQL code would be monstrous.
+	 * Trivial queries are converted into a simple select. Other queries without tag sets
+	 * are converted into compound INTERSECT/UNION/EXCEPT queries over the tag map. The results
+	 * are the same as with match(TagIdSet).
 	 *
-	 * If the query is nontrivial, you must iterate through each tag id set and match them individually using match(TagIdSet).
-	 * You can use mentionedTagIds() to generate a shortlist so you don't need to go through the entire database.
+	 * Queries with tag sets cannot be expressed in SQL. For those, you must iterate through each tag id set and
+	 * match them individually using match(TagIdSet). You can use mentionedTagIds() to generate a shortlist
+	 * so you don't need to go through the entire database.
+	 * Flat queries can also be matched against the inverted tag index with match(TagIndex).
 	 *
 	 * The query returns a list of picture IDs.
-	 * \pre isTrivial() == true
+	 * \pre hasSets() == false
 	 */
 	QString toSql() const;
 
@@ -166,6 +284,47 @@ public:
 	 */
 	bool match(const TagIdSet &tags) const;
 
+	/**
+	 * \brief Does this query match the tags of a picture in the tag store?
+	 *
+	 * This is the same as match(TagIdSet), without converting the tags first.
+	 * \param tags the tags to match this query against
+	 * \return true if query matches the tags
+	 */
+	bool match(const TagStoreEntry &tags) const;
+
+	/**
+	 * \brief Is the picture one of the candidates for this query?
+	 *
+	 * Only candidate pictures (see candidateSql()) may match. Use this to filter the
+	 * tag store before calling match(TagStoreEntry).
+	 * \param tags the tags of the picture
+	 * \return true if picture is a candidate
+	 */
+	bool isCandidate(const TagStoreEntry &tags) const;
+
+	/**
+	 * \brief Find the pictures in a range of the tag store that match this query
+	 *
+	 * Large ranges are matched in parallel on the global thread pool.
+	 * \param store a loaded tag store
+	 * \param first the first row to match
+	 * \param last the row after the last row to match
+	 * \return IDs of the matching pictures in ascending order
+	 */
+	QVector<int> match(const TagStore &store, int first, int last) const;
+
+	/**
+	 * \brief Find all pictures matching this query using the inverted tag index
+	 *
+	 * The result is the same as matching each picture that has at least one of the
+	 * mentionedTagIds() with match(TagIdSet).
+	 * \param index a loaded tag index
+	 * \return IDs of the matching pictures
+	 * \pre hasSets() == false
+	 */
+	PicBitmap match(const TagIndex &index) const;
+
 	/**
 	 * \brief Match against the given ID set and return details
 	 *
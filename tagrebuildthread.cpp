@@ -0,0 +1,346 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+#include <QSet>
+#include <QtConcurrentRun>
+
+#include "tagrebuildthread.h"
+
+#include "gallery.h"
+#include "database.h"
+#include "tags.h"
+#include "tagset.h"
+#include "savedqueries.h"
+
+//! Number of pictures read, processed and written at a time
+static const int REBUILD_CHUNK = 4096;
+
+//! Parse and normalize a range of tag strings. This is run in parallel on the global thread pool.
+static QVector<TagSet> parseRange(const QStringList *tagstrings, const QHash<QString, QString> *aliases, int begin, int end)
+{
+	QVector<TagSet> sets;
+	sets.reserve(end - begin);
+	for(int i=begin;i<end;++i)
+		sets.append(TagSet::parse(tagstrings->at(i)).normalized(*aliases));
+	return sets;
+}
+
+/**
+  Apply the tag rules to a range of tag sets. This is run in parallel on the global thread pool.
+  \return rule statistics, if profiling
+  */
+static TagRuleProfile inferRange(const TagImplications *rules, TagIdSet *sets, int count, bool profiling)
+{
+	TagRuleProfile profile;
+	for(int i=0;i<count;++i)
+		rules->apply(sets[i], profiling ? &profile : 0);
+	return profile;
+}
+
+//! Get the size of the slices a chunk of the given size is split into
+static int sliceSize(int count)
+{
+	// Use a few slices per core to even out the load
+	const int slices = qMax(1, QThread::idealThreadCount()) * 4;
+	return qMax(1, (count + slices - 1) / slices);
+}
+
+//! Get a comma separated list of picture IDs for use in SQL
+static QString idList(const QVector<int>& ids, int begin, int end)
+{
+	QStringList list;
+	for(int i=begin;i<end;++i)
+		list.append(QString::number(ids.at(i)));
+	return list.join(",");
+}
+
+TagRebuildThread::TagRebuildThread(Gallery *gallery, const QVector<int>& pictures, QObject *parent) :
+	QThread(parent), m_gallery(gallery), m_rules(gallery->database()->tagRules()), m_pictures(pictures),
+	m_rulegeneration(gallery->database()->tagRuleGeneration()), m_profiling(gallery->database()->ruleProfile()!=0), m_abortflag(false), m_completed(false)
+{
+	// The current rules are not fully applied until the rebuild completes
+	m_pending = m_gallery->database()->getSetting("tagrules.pending").toBool();
+	m_gallery->database()->saveSetting("tagrules.pending", true);
+
+	m_gallery->database()->startTagRebuild();
+}
+
+void TagRebuildThread::run()
+{
+	QString dbname = QString("tagrebuild") + m_gallery->database()->name();
+	{
+		QSqlDatabase db = QSqlDatabase::cloneDatabase(m_gallery->database()->get(), dbname);
+		if(!db.open()) {
+			emit statusChanged(tr("Couldn't open database!"));
+			qDebug() << "Couldn't open clone database!";
+			return;
+		}
+
+		rebuild(db);
+	}
+	QSqlDatabase::removeDatabase(dbname);
+}
+
+/**
+  Tag IDs are kept as they are, so the tag rules compiled in the main thread
+  stay valid. New tags are created in this thread only: TagSet::normalized
+  does all the work that can be done without the tag table.
+  */
+void TagRebuildThread::rebuild(QSqlDatabase &db)
+{
+	QSqlQuery q(db);
+	q.setForwardOnly(true);
+
+	int total = m_pictures.count();
+	if(m_pictures.isEmpty() && q.exec("SELECT COUNT(*) FROM picture WHERE tags!=\"\"") && q.next())
+		total = q.value(0).toInt();
+
+	q.exec("DROP TABLE IF EXISTS tagmap_new");
+	if(!q.exec(Tags::tagMapSql("tagmap_new"))) {
+		emit statusChanged(tr("Couldn't create new tag map!"));
+		qDebug() << "Couldn't create new tag map:" << q.lastError().text();
+		return;
+	}
+
+	QHash<QString, QString> aliases;
+	q.exec("SELECT alias, tag FROM tagalias");
+	while(q.next())
+		aliases.insert(q.value(0).toString(), q.value(1).toString());
+
+	QHash<QString, int> tagids;
+	q.exec("SELECT tagid, tag FROM tag");
+	while(q.next())
+		tagids.insert(q.value(1).toString(), q.value(0).toInt());
+
+	QSqlQuery newtag(db);
+	newtag.prepare("INSERT OR IGNORE INTO tag (tag) VALUES (?)");
+	QSqlQuery gettag(db);
+	gettag.prepare("SELECT tagid FROM tag WHERE tag=?");
+	QSqlQuery insert(db);
+	insert.prepare("INSERT INTO tagmap_new (picid, tagid, tagset) VALUES (?, ?, ?)");
+
+	emit statusChanged(tr("Rebuilding tag index..."));
+	emit progress(0, total);
+
+	// Tags created during the rebuild. The wildcard patterns of the rules don't match them.
+	QSet<QString> newtags;
+
+	TagRuleProfile profile;
+	int done = 0;
+	int lastid = 0;
+	while(!m_abortflag) {
+		// Read the next chunk of pictures
+		QVector<int> picids;
+		QStringList tagstrings;
+		if(m_pictures.isEmpty()) {
+			q.prepare("SELECT picid, tags FROM picture WHERE tags!=\"\" AND picid>? ORDER BY picid LIMIT ?");
+			q.addBindValue(lastid);
+			q.addBindValue(REBUILD_CHUNK);
+		} else {
+			if(done >= m_pictures.count())
+				break;
+			q.prepare("SELECT picid, tags FROM picture WHERE picid IN (" + idList(m_pictures, done, qMin(done + REBUILD_CHUNK, m_pictures.count())) + ")");
+		}
+		if(!q.exec()) {
+			qDebug() << "Couldn't read pictures:" << q.lastError().text();
+			return;
+		}
+		while(q.next()) {
+			picids.append(q.value(0).toInt());
+			tagstrings.append(q.value(1).toString());
+		}
+		if(m_pictures.isEmpty()) {
+			if(picids.isEmpty())
+				break;
+			lastid = picids.last();
+		}
+
+		const int count = picids.count();
+		const int slice = sliceSize(count);
+
+		// Parse the tag strings
+		QVector<TagSet> tagsets;
+		{
+			QList<QFuture<QVector<TagSet> > > futures;
+			for(int begin=0;begin<count;begin+=slice)
+				futures.append(QtConcurrent::run(parseRange, &tagstrings, &aliases, begin, qMin(begin + slice, count)));
+			foreach(const QFuture<QVector<TagSet> > &future, futures)
+				tagsets += future.result();
+		}
+
+		// Create the tags seen for the first time
+		QVector<TagIdSet> idsets;
+		idsets.reserve(count);
+		for(int i=0;i<count;++i) {
+			const TagSet &tagset = tagsets.at(i);
+			bool hasnew = false;
+			for(int set=0;set<=tagset.sets();++set) {
+				foreach(const QString& tag, tagset.tags(set)) {
+					if(newtags.contains(tag))
+						hasnew = true;
+					if(tag.isEmpty() || tagids.contains(tag))
+						continue;
+					newtag.bindValue(0, tag);
+					gettag.bindValue(0, tag);
+					if(!newtag.exec() || !gettag.exec() || !gettag.next()) {
+						qDebug() << "Couldn't create tag" << tag << gettag.lastError().text();
+						continue;
+					}
+					tagids.insert(tag, gettag.value(0).toInt());
+					gettag.finish();
+					if(m_rules.hasWildcards()) {
+						newtags.insert(tag);
+						hasnew = true;
+					}
+				}
+			}
+			if(hasnew)
+				m_newtagpictures.append(picids.at(i));
+			idsets.append(TagIdSet(tagset, tagids, picids.at(i)));
+		}
+
+		// Apply the tag rules
+		{
+			TagIdSet *sets = idsets.data();
+			QList<QFuture<TagRuleProfile> > futures;
+			for(int begin=0;begin<count;begin+=slice)
+				futures.append(QtConcurrent::run(inferRange, &m_rules, sets + begin, qMin(slice, count - begin), m_profiling));
+			foreach(const QFuture<TagRuleProfile> &future, futures)
+				profile.merge(future.result());
+		}
+
+		// Write the chunk in one transaction, so the main thread is not locked out for long
+		db.transaction();
+		foreach(const TagIdSet &tagset, idsets) {
+			insert.bindValue(0, tagset.pictureId());
+			for(int set=0;set<=tagset.sets();++set) {
+				insert.bindValue(2, set);
+				foreach(int tag, tagset.tags(set)) {
+					insert.bindValue(1, tag);
+					if(!insert.exec())
+						qDebug() << "Couldn't save tags for tag set" << set << "for picture" << tagset.pictureId();
+				}
+			}
+		}
+		db.commit();
+
+		done += m_pictures.isEmpty() ? count : qMin(REBUILD_CHUNK, m_pictures.count() - done);
+		emit progress(qMin(done, total), total);
+	}
+
+	if(m_profiling)
+		m_rules.saveProfile(profile, db);
+
+	if(!m_abortflag) {
+		m_completed = true;
+		emit statusChanged(tr("Done."));
+	}
+}
+
+/**
+  Pictures deleted during the rebuild are dropped from the new tag map and
+  pictures tagged during the rebuild (or added by a rescan) are saved again.
+  So are pictures with tags created by the rebuild, if the rules have wildcards.
+  If the rules changed during the rebuild, the new tag map is still taken
+  into use, but the change remains pending (see rulesChanged()).
+  After a full rebuild, tags no longer used by any picture are deleted, as they
+  would be by recreating the tag tables.
+  */
+bool TagRebuildThread::finish()
+{
+	Database *database = m_gallery->database();
+	QSet<int> redo = database->finishTagRebuild();
+	QSqlQuery q(database->get());
+
+	if(!m_completed) {
+		q.exec("DROP TABLE IF EXISTS tagmap_new");
+		return false;
+	}
+
+	foreach(int picid, m_newtagpictures)
+		redo.insert(picid);
+
+	if(m_pictures.isEmpty()) {
+		q.exec("SELECT picid FROM picture WHERE tags!=\"\" AND NOT EXISTS (SELECT 1 FROM tagmap_new WHERE tagmap_new.picid=picture.picid)");
+		while(q.next())
+			redo.insert(q.value(0).toInt());
+	}
+
+	database->get().transaction();
+	q.exec("DELETE FROM tagmap_new WHERE picid NOT IN (SELECT picid FROM picture)");
+	if(m_pictures.isEmpty()) {
+		if(!q.exec("DROP TABLE tagmap") || !q.exec("ALTER TABLE tagmap_new RENAME TO tagmap")) {
+			Database::showError("Couldn't replace the tag map", q);
+			database->get().rollback();
+			q.exec("DROP TABLE IF EXISTS tagmap_new");
+			return false;
+		}
+		q.exec("DELETE FROM tag WHERE tagid NOT IN (SELECT tagid FROM tagmap)");
+	} else {
+		for(int i=0;i<m_pictures.count();i+=REBUILD_CHUNK)
+			q.exec("DELETE FROM tagmap WHERE picid IN (" + idList(m_pictures, i, qMin(i + REBUILD_CHUNK, m_pictures.count())) + ")");
+		if(!q.exec("INSERT INTO tagmap SELECT picid, tagid, tagset FROM tagmap_new")) {
+			Database::showError("Couldn't update the tag map", q);
+			database->get().rollback();
+			q.exec("DROP TABLE IF EXISTS tagmap_new");
+			return false;
+		}
+		q.exec("DROP TABLE tagmap_new");
+	}
+	Database::bumpTagMapGeneration(database->get());
+	database->get().commit();
+
+	database->tags()->reload();
+	database->savedQueries()->clearResults();
+	database->tagMapChanged();
+
+	if(!redo.isEmpty()) {
+		database->get().transaction();
+		foreach(int picid, redo) {
+			q.prepare("SELECT tags FROM picture WHERE picid=?");
+			q.addBindValue(picid);
+			if(!q.exec() || !q.next())
+				continue;
+
+			TagIdSet tagset(TagSet::parse(q.value(0).toString()), database->tags(), picid);
+			// Not profiled: the profile of the whole rebuild is already saved.
+			// Creating a tag may have discarded the compiled rules, so they are fetched each time.
+			database->tagRules().apply(tagset);
+			tagset.save(database, false);
+		}
+		database->get().commit();
+	}
+
+	// A full rebuild applies all rule changes made before it started.
+	// A partial one leaves the earlier ones as they were.
+	database->saveSetting("tagrules.pending", rulesChanged() || (!m_pictures.isEmpty() && m_pending));
+
+	return true;
+}
+
+bool TagRebuildThread::rulesChanged() const
+{
+	return m_gallery->database()->tagRuleGeneration() != m_rulegeneration;
+}
+
+void TagRebuildThread::abort()
+{
+	m_abortflag = true;
+}
@@ -0,0 +1,99 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef TAGREBUILDTHREAD_H
+#define TAGREBUILDTHREAD_H
+
+#include <QThread>
+#include <QVector>
+
+#include "tagrules.h"
+
+class Gallery;
+class QSqlDatabase;
+
+//! Rebuild the tag index in the background
+/**
+  The tags of every picture are parsed and the tag rules applied on the global
+  thread pool, a chunk of pictures at a time. This thread is the only writer:
+  it creates the new tags and inserts the results into a fresh tag map table,
+  which finish() swaps in place of the old one. The old tag map stays in use
+  until then, so the gallery can be browsed and tagged during the rebuild.
+
+  The rebuild can be limited to the pictures affected by a change in the tag
+  rules (see TagImplications::affectedTags). Then the new table holds just
+  the new tags of those pictures, and finish() replaces their old tags with them.
+  */
+class TagRebuildThread : public QThread
+{
+    Q_OBJECT
+public:
+	/**
+	  \brief Prepare a rebuild using the current tag rules
+
+	  Saved pictures are recorded from here on (see Database::startTagRebuild)
+	  \param gallery the gallery whose tag index to rebuild
+	  \param pictures the pictures to reapply the rules to. If empty, the whole index is rebuilt.
+	  \param parent parent object
+	  */
+	TagRebuildThread(Gallery *gallery, const QVector<int>& pictures = QVector<int>(), QObject *parent = 0);
+
+	void run();
+
+	/**
+	  \brief Take the new tag map into use
+
+	  This must be called in the main thread after the thread has finished.
+	  If the rebuild was aborted, the new tag map is discarded. Pictures
+	  whose tags were saved during the rebuild are saved again with the new index.
+	  \return true if the new tag map was taken into use
+	  */
+	bool finish();
+
+	//! Have the tag rules changed since this rebuild was started? (see Database::tagRuleGeneration)
+	bool rulesChanged() const;
+
+signals:
+	void statusChanged(const QString& status);
+	void progress(int done, int total);
+
+public slots:
+	void abort();
+
+private:
+	//! Build the new tag map table
+	void rebuild(QSqlDatabase &db);
+
+	Gallery *m_gallery;
+	TagImplications m_rules;
+	QVector<int> m_pictures;
+
+	//! The generation of the rules in m_rules
+	int m_rulegeneration;
+
+	//! Gather and save tag rule statistics (see Database::setRuleProfiling)
+	bool m_profiling;
+
+	//! Pictures with tags created during the rebuild, if the rules have wildcards
+	QVector<int> m_newtagpictures;
+
+	//! Were earlier rule changes waiting to be applied (see the tagrules.pending setting)
+	bool m_pending;
+	bool m_abortflag;
+	bool m_completed;
+};
+
+#endif // TAGREBUILDTHREAD_H
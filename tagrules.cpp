@@ -15,7 +15,11 @@
 // along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <QSqlQuery>
+#include <QSqlError>
 #include <QVariant>
+#include <QElapsedTimer>
+#include <QPair>
+#include <QtAlgorithms>
 #include <QFile>
 #include <QDir>
 
@@ -24,6 +28,7 @@
 #include "database.h"
 
 TagImplications::TagImplications()
+	: m_haswildcards(false)
 {
 }
 
@@ -37,7 +42,7 @@ TagImplications TagImplications::load(Database *database)
 		TagQuery query = TagQuery(q.value(0).toString());
 		TagSet set = TagSet::parse(q.value(1).toString());
 
-		ti.m_rules.append(TagImplication(query, set));
+		ti.m_rules.append(TagImplication(q.value(0).toString(), query, set));
 	}
 	q.finish();
 
@@ -48,7 +53,7 @@ TagImplications TagImplications::load(Database *database)
 	while(iterator.hasNext()) {
 		TagImplication &i = iterator.next();
 		i.query.queryInit(database->tags());
-		if(i.query.isError()) {
+		if(i.query.isError() || i.query.hasMetadata()) {
 			qDebug() << "Bad tag rule:" << i.query;
 			iterator.remove();
 		} else {
@@ -56,24 +61,438 @@ TagImplications TagImplications::load(Database *database)
 		}
 	}
 
+	ti.compile();
 	return ti;
 }
 
-void TagImplications::apply(TagIdSet &tagset) const
+QList<TagRuleExpression> TagImplications::loadExpressions(const Database *database)
 {
-	int lastcount=0;
-	while(tagset.totalCount() > lastcount) {
-		lastcount = tagset.totalCount();
+	QList<TagRuleExpression> rules;
+	QSqlQuery q(database->get());
+	q.setForwardOnly(true);
 
-		foreach(TagImplication rule, m_rules) {
+	q.exec("SELECT alias, tag FROM tagalias");
+	while(q.next()) {
+		TagRuleExpression expr;
+		expr.type = TagRuleExpression::ALIAS;
+		expr.rule = q.value(0).toString();
+		expr.tagset = q.value(1).toString();
+		rules.append(expr);
+	}
+
+	q.exec("SELECT rule, tags FROM tagrule ORDER BY ruleorder ASC");
+	while(q.next()) {
+		TagRuleExpression expr;
+		expr.type = TagRuleExpression::IMPLICATION;
+		expr.rule = q.value(0).toString();
+		expr.tagset = q.value(1).toString();
+		rules.append(expr);
+	}
+
+	return rules;
+}
+
+namespace {
+	//! Rules are compared by their source text
+	inline QString ruleKey(const TagRuleExpression& expr)
+	{
+		return QString::number(expr.type) + '\n' + expr.rule + '\n' + expr.tagset;
+	}
+
+	/**
+	  Does the result of a rule stay the same no matter when its tags are added?
+	  A flat monotonic query with at most one tag matches the same tag sets whenever
+	  it is evaluated. Negations, set queries, cross-set matches of several tags
+	  and new tag sets all depend on what the picture had at the time.
+	  */
+	bool isOrderIndependent(const TagQuery &query, const TagSet &tags)
+	{
+		return query.isMonotonic() && !query.hasSets() && tags.sets()==0 &&
+				query.referencedTagIds().count()<=1;
+	}
+}
+
+/**
+  A picture's tags only change if a removed rule had added tags to it, or an
+  added rule now matches it. Rules only ever add tags, so the tags a removed rule
+  added are still in the index. A monotonic query that doesn't match untagged
+  pictures can only start matching a picture that has one of the tags it refers to.
+  If that tag is not in the index yet, it is added by another added rule, which
+  must have matched the picture first.
+
+  Moving rules around changes the results only if some rule depends on the order
+  the tags are added in (e.g. "a, !x --> y" before or after "a --> x".) Such a
+  change can affect any picture.
+  */
+bool TagImplications::affectedTags(Database *database, const QList<TagRuleExpression>& oldrules, const QList<TagRuleExpression>& newrules, QSet<int> &tags)
+{
+	// Count the old rules up and the new rules down: what's left was changed
+	QHash<QString, int> changes;
+	foreach(const TagRuleExpression& expr, oldrules)
+		++changes[ruleKey(expr)];
+	foreach(const TagRuleExpression& expr, newrules)
+		--changes[ruleKey(expr)];
+
+	// Removed rules
+	foreach(const TagRuleExpression& expr, oldrules) {
+		int &count = changes[ruleKey(expr)];
+		if(count<=0)
+			continue;
+		--count;
+
+		if(expr.type == TagRuleExpression::ALIAS)
+			return false;
+
+		const TagIdSet implied(TagSet::parse(expr.tagset), database->tags());
+		for(int set=0;set<=implied.sets();++set) {
+			const TagIdVector &ids = implied.tags(set);
+			for(int i=0;i<ids.count();++i)
+				if(ids.at(i)>0)
+					tags.insert(ids.at(i));
+		}
+	}
+
+	// Added rules
+	foreach(const TagRuleExpression& expr, newrules) {
+		int &count = changes[ruleKey(expr)];
+		if(count>=0)
+			continue;
+		++count;
+
+		if(expr.type == TagRuleExpression::ALIAS)
+			return false;
+
+		TagQuery query(expr.rule);
+		query.queryInit(database->tags());
+		if(query.isError() || query.hasMetadata())
+			continue; // Bad rules are not loaded (see load())
+
+		if(!query.isMonotonic() || query.matchesUntagged())
+			return false;
+
+		foreach(int tag, query.referencedTagIds())
+			if(tag>0)
+				tags.insert(tag);
+	}
+
+	// The rules that were kept, in their old and new order
+	QSet<QString> oldkeys, newkeys;
+	foreach(const TagRuleExpression& expr, oldrules)
+		oldkeys.insert(ruleKey(expr));
+	foreach(const TagRuleExpression& expr, newrules)
+		newkeys.insert(ruleKey(expr));
+
+	QStringList oldorder, neworder;
+	foreach(const TagRuleExpression& expr, oldrules)
+		if(expr.type == TagRuleExpression::IMPLICATION && newkeys.contains(ruleKey(expr)))
+			oldorder.append(ruleKey(expr));
+	foreach(const TagRuleExpression& expr, newrules)
+		if(expr.type == TagRuleExpression::IMPLICATION && oldkeys.contains(ruleKey(expr)))
+			neworder.append(ruleKey(expr));
+
+	if(oldorder != neworder) {
+		QList<TagRuleExpression> rules = oldrules;
+		rules += newrules;
+		foreach(const TagRuleExpression& expr, rules) {
+			if(expr.type != TagRuleExpression::IMPLICATION)
+				continue;
+			TagQuery query(expr.rule);
+			query.queryInit(database->tags());
+			if(!query.isError() && !isOrderIndependent(query, TagSet::parse(expr.tagset)))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+  A rule like "a --> b, c" adds b and c to every tag set that contains a.
+  The transitive closure of such rules can be precomputed, so the
+  implications of a tag are added in one step, without evaluating a query.
+
+  This changes when the implied tags are added, so only rules whose tags
+  can't affect an order dependent rule (even through other rules) are collapsed.
+  The others stay in the general list in their original order.
+  */
+void TagImplications::compile()
+{
+	m_haswildcards = false;
+	foreach(const TagImplication &rule, m_rules)
+		m_haswildcards = m_haswildcards || rule.query.hasWildcards();
+
+	// Tags whose addition time can change the results, and
+	// tag ID -> tags of the queries of the rules that add it
+	QSet<int> ordered;
+	QHash<int, QVector<int> > impliedby;
+	foreach(const TagImplication &rule, m_rules) {
+		const QVector<int> referenced = rule.query.referencedTagIds();
+		if(!isOrderIndependent(rule.query, rule.tagset)) {
+			foreach(int tag, referenced)
+				ordered.insert(tag);
+		}
+
+		for(int set=0;set<=rule.idset.sets();++set) {
+			const TagIdVector &tags = rule.idset.tags(set);
+			for(int i=0;i<tags.count();++i) {
+				impliedby[tags.at(i)] += referenced;
+				// Whether a new tag set is added depends on the contents of the old ones
+				if(set>0)
+					ordered.insert(tags.at(i));
+			}
+		}
+	}
+
+	// Tags that lead to order dependent tags
+	QVector<int> stack = ordered.toList().toVector();
+	while(!stack.isEmpty()) {
+		const int tag = stack.last();
+		stack.removeLast();
+		foreach(int source, impliedby.value(tag)) {
+			if(!ordered.contains(source)) {
+				ordered.insert(source);
+				stack.append(source);
+			}
+		}
+	}
+
+	// Direct implications of the single tag rules that can be collapsed
+	QHash<int, QVector<int> > implies;
+	QMutableListIterator<TagImplication> iterator(m_rules);
+	while(iterator.hasNext()) {
+		const TagImplication &rule = iterator.next();
+		const int tag = rule.query.singleTag();
+		if(tag<=0 || rule.idset.sets()>0)
+			continue;
+
+		const TagIdVector &tags = rule.idset.tags(0);
+		bool collapse = true;
+		for(int i=0;i<tags.count() && collapse;++i)
+			collapse = !ordered.contains(tags.at(i));
+		if(!collapse)
+			continue;
+
+		for(int i=0;i<tags.count();++i)
+			implies[tag].append(tags.at(i));
+		iterator.remove();
+	}
+
+	// Follow the implication chains from each tag
+	m_closure.clear();
+	for(QHash<int, QVector<int> >::const_iterator i=implies.constBegin();i!=implies.constEnd();++i) {
+		TagIdVector &closure = m_closure[i.key()];
+		QVector<int> stack = i.value();
+		while(!stack.isEmpty()) {
+			const int tag = stack.last();
+			stack.removeLast();
+			if(tag != i.key() && closure.insert(tag))
+				stack += implies.value(tag);
+		}
+	}
+
+	m_triggers.clear();
+	m_setsensitive.clear();
+
+	for(int i=0;i<m_rules.count();++i) {
+		const TagQuery &query = m_rules.at(i).query;
+		foreach(int tag, query.referencedTagIds())
+			m_triggers[tag].append(i);
+		if(!query.isMonotonic())
+			m_setsensitive.append(i);
+	}
+}
+
+namespace {
+	//! Mark rules for re-evaluation
+	inline void markDirty(const QVector<int>& rules, QVector<bool>& dirty, int &pending)
+	{
+		foreach(int rule, rules) {
+			if(!dirty.at(rule)) {
+				dirty[rule] = true;
+				++pending;
+			}
+		}
+	}
+}
+
+void TagImplications::addImplied(TagIdSet &tagset, int set, const TagIdVector &tags) const
+{
+	if(m_closure.isEmpty())
+		return;
+
+	// The closure is transitive, so the implied tags need no expanding of their own
+	TagIdVector implied;
+	for(int i=0;i<tags.count();++i) {
+		QHash<int, TagIdVector>::const_iterator closure = m_closure.constFind(tags.at(i));
+		if(closure != m_closure.constEnd())
+			implied.unite(closure.value());
+	}
+	tagset.insertTags(implied, set);
+}
+
+/**
+  Rules can only add tags, so a rule gives the same results and adds nothing new
+  unless one of the tags its query refers to has been added to some tag set since
+  it was last evaluated. Such rules are skipped (semi-naive evaluation).
+  Non-monotonic rules are also re-evaluated when a new tag set appears.
+
+  Otherwise the evaluation order is the same as when all rules are evaluated on
+  every pass: a rule triggered by an earlier rule is evaluated later in the same
+  pass, and one triggered by a later rule (or itself) on the next pass.
+  */
+void TagImplications::apply(TagIdSet &tagset, TagRuleProfile *profile) const
+{
+	QElapsedTimer timer;
+	int count = 0;
+	if(profile) {
+		timer.start();
+		count = tagset.totalCount();
+	}
+
+	// Single tag rules are applied in one step using the closure table
+	for(int set=0;set<=tagset.sets();++set)
+		addImplied(tagset, set, TagIdVector(tagset.tags(set)));
+
+	if(profile) {
+		TagRuleStats &stats = profile->singleTagRules();
+		++stats.evaluations;
+		if(tagset.totalCount() > count) {
+			++stats.matches;
+			stats.added += tagset.totalCount() - count;
+		}
+		stats.nsecs += timer.nsecsElapsed();
+	}
+
+	// Every other rule is evaluated at least once
+	QVector<bool> dirty(m_rules.count(), true);
+	int pending = m_rules.count();
+
+	while(pending>0) {
+		for(int i=0;i<m_rules.count();++i) {
+			if(!dirty.at(i))
+				continue;
+			dirty[i] = false;
+			--pending;
+
+			if(profile)
+				timer.start();
+
+			const TagImplication &rule = m_rules.at(i);
 			TagMatchResults result = rule.query.query(tagset);
-			if(result.matched) {
-				applyRule(tagset, result, rule.idset);
+			if(!result.matched) {
+				if(profile) {
+					TagRuleStats &stats = profile->rule(i);
+					++stats.evaluations;
+					stats.nsecs += timer.nsecsElapsed();
+				}
+				continue;
+			}
+
+			const TagIdSet before = tagset;
+			applyRule(tagset, result, rule.idset);
+
+			// Add the implications of the new tags
+			for(int set=0;set<=tagset.sets();++set) {
+				if(set>before.sets() || tagset.tags(set).count() != before.tags(set).count())
+					addImplied(tagset, set, TagIdVector(tagset.tags(set)));
+			}
+
+			// Trigger the rules that refer to the added tags
+			for(int set=0;set<=tagset.sets();++set) {
+				const TagIdVector &tags = tagset.tags(set);
+				if(set<=before.sets() && tags.count() == before.tags(set).count())
+					continue;
+				for(int t=0;t<tags.count();++t) {
+					if(set>before.sets() || !before.tags(set).contains(tags.at(t)))
+						markDirty(m_triggers.value(tags.at(t)), dirty, pending);
+				}
+			}
+
+			if(tagset.sets() > before.sets())
+				markDirty(m_setsensitive, dirty, pending);
+
+			if(profile) {
+				TagRuleStats &stats = profile->rule(i);
+				++stats.evaluations;
+				++stats.matches;
+				stats.added += tagset.totalCount() - before.totalCount();
+				stats.nsecs += timer.nsecsElapsed();
 			}
 		}
 	}
 }
 
+//! Number of rules listed in the debug log by saveProfile
+static const int PROFILE_REPORT_RULES = 20;
+
+/**
+  The rules are sorted by the time spent on them. The single tag rules
+  are reported together as one rule, since they are applied in one step.
+  */
+void TagImplications::saveProfile(const TagRuleProfile &profile, QSqlDatabase db) const
+{
+	// (time, rule index). The single tag rules have index -1
+	QList<QPair<qint64, int> > order;
+	order.append(qMakePair(profile.singleTagRules().nsecs, -1));
+	for(int i=0;i<profile.rules().count() && i<m_rules.count();++i)
+		order.append(qMakePair(profile.rules().at(i).nsecs, i));
+	qSort(order.begin(), order.end(), qGreater<QPair<qint64, int> >());
+
+	QSqlQuery q(db);
+	db.transaction();
+	q.exec("DELETE FROM ruleprofile");
+	q.prepare("INSERT INTO ruleprofile (rule, tags, evaluations, matches, added, usecs) VALUES (?, ?, ?, ?, ?, ?)");
+
+	qDebug() << "Tag rule profile (evaluations, matches, tags added, ms):";
+	for(int i=0;i<order.count();++i) {
+		const int index = order.at(i).second;
+		const TagRuleStats &stats = index<0 ? profile.singleTagRules() : profile.rules().at(index);
+		const QString rule = index<0 ? QString("(single tag rules)") : m_rules.at(index).source;
+		const QString tags = index<0 ? QString() : m_rules.at(index).tagset.toString();
+
+		if(i<PROFILE_REPORT_RULES && stats.evaluations>0)
+			qDebug() << rule << "-->" << tags << stats.evaluations << stats.matches << stats.added << stats.nsecs / 1000000.0;
+
+		q.bindValue(0, rule);
+		q.bindValue(1, tags);
+		q.bindValue(2, stats.evaluations);
+		q.bindValue(3, stats.matches);
+		q.bindValue(4, stats.added);
+		q.bindValue(5, stats.nsecs / 1000);
+		if(!q.exec())
+			qDebug() << "Couldn't save rule profile:" << q.lastError().text();
+	}
+	db.commit();
+}
+
+void TagRuleStats::merge(const TagRuleStats &other)
+{
+	evaluations += other.evaluations;
+	matches += other.matches;
+	added += other.added;
+	nsecs += other.nsecs;
+}
+
+TagRuleStats &TagRuleProfile::rule(int index)
+{
+	if(index >= m_rules.count())
+		m_rules.resize(index + 1);
+	return m_rules[index];
+}
+
+void TagRuleProfile::merge(const TagRuleProfile &other)
+{
+	for(int i=0;i<other.m_rules.count();++i)
+		rule(i).merge(other.m_rules.at(i));
+	m_singletag.merge(other.m_singletag);
+}
+
+void TagRuleProfile::clear()
+{
+	m_rules.clear();
+	m_singletag = TagRuleStats();
+}
+
 void TagImplications::applyRule(TagIdSet &tagset, const TagMatchResults &results, const TagIdSet &newtags) const
 {
 	if(results.matchsets) {
@@ -188,6 +607,9 @@ QList<TagRuleExpression> TagImplications::parseRuleFile(const QString& file, QIO
 				} else if(token=="-->") {
 					newexpr.type = TagRuleExpression::IMPLICATION;
 					state = EXPECT_NEWTAGSET;
+					// Metadata predicates are evaluated when the rules are compiled, and the rules are kept
+					if(TagQuery(newexpr.rule).hasMetadata())
+						throw TagRuleParseException(file, linenum, QObject::tr("Metadata predicates can't be used in tag rules: %1").arg(newexpr.rule));
 					// TODO check rule syntax
 				} else {
 					// Continuation of LEFT?
@@ -17,16 +17,22 @@
 #ifndef TAGIMPLICATIONS_H
 #define TAGIMPLICATIONS_H
 
+#include <QHash>
+#include <QSet>
+
 #include "tagquery.h"
 #include "tagset.h"
 
 //! A single tag implication rule
 struct TagImplication {
-	TagImplication(const TagQuery& rule, const TagSet& tags)
-		: query(rule), tagset(tags)
+	TagImplication(const QString& text, const TagQuery& rule, const TagSet& tags)
+		: source(text), query(rule), tagset(tags)
 	{
 	}
 
+	//! The rule query as written
+	QString source;
+
 	//! The query for matching a tag set
 	TagQuery query;
 
@@ -36,6 +42,59 @@ struct TagImplication {
 	TagIdSet idset;
 };
 
+//! Evaluation statistics of a tag rule
+struct TagRuleStats {
+	TagRuleStats() : evaluations(0), matches(0), added(0), nsecs(0) { }
+
+	//! Number of times the rule was evaluated
+	int evaluations;
+
+	//! Number of times the rule matched
+	int matches;
+
+	//! Number of tags added by the rule, including their single tag implications
+	int added;
+
+	//! Time spent evaluating and applying the rule
+	qint64 nsecs;
+
+	void merge(const TagRuleStats &other);
+};
+
+/**
+  \brief Per rule statistics gathered by TagImplications::apply
+
+  The rules are identified by their position in the TagImplications the profile
+  was gathered with. A profile must not be shared between threads: each thread
+  should gather its own and merge them afterwards.
+  */
+class TagRuleProfile
+{
+public:
+	//! Get the statistics of a rule
+	TagRuleStats &rule(int index);
+
+	//! Get the statistics of all rules. The vector may be shorter than the rule list.
+	const QVector<TagRuleStats> &rules() const { return m_rules; }
+
+	//! Get the combined statistics of the single tag rules (see TagImplications::apply)
+	TagRuleStats &singleTagRules() { return m_singletag; }
+
+	const TagRuleStats &singleTagRules() const { return m_singletag; }
+
+	//! Has anything been recorded?
+	bool isEmpty() const { return m_rules.isEmpty() && m_singletag.evaluations==0; }
+
+	//! Add the statistics of another profile to this one
+	void merge(const TagRuleProfile &other);
+
+	void clear();
+
+private:
+	QVector<TagRuleStats> m_rules;
+	TagRuleStats m_singletag;
+};
+
 //! Unparsed tag implication/tag alias rule
 struct TagRuleExpression {
 	enum Type {ALIAS, IMPLICATION};
@@ -57,6 +116,7 @@ struct TagRuleParseException {
 };
 
 class QDir;
+class QSqlDatabase;
 
 class TagImplications
 {
@@ -78,13 +138,75 @@ public:
 	  */
 	static QList<TagRuleExpression> parseRuleFile(const QString& file, QIODevice &src, const QDir& rootdir);
 
-	//! Apply tag implications to the given tag set
-	void apply(TagIdSet &tagset) const;
+	//! Load the saved tag aliases and rules in the same form as returned by parseRuleFile
+	static QList<TagRuleExpression> loadExpressions(const Database *database);
+
+	/**
+	  \brief Find the tags of the pictures that a change in the rules may affect
+
+	  Only pictures that have one of the tags referred to by the added rules or
+	  one of the tags added by the removed rules can get different implied tags.
+	  Changed aliases and rules that may match pictures without any of the tags
+	  they refer to (e.g. "!a --> b") can affect any picture, and so can reordered
+	  rules when some rule depends on the order (e.g. "a, !x --> y").
+	  \param database the database whose tags are used
+	  \param oldrules the rules the tag index was built with
+	  \param newrules the new rules
+	  \param tags receives the IDs of the affected tags
+	  \return false if every picture may be affected
+	  */
+	static bool affectedTags(Database *database, const QList<TagRuleExpression>& oldrules, const QList<TagRuleExpression>& newrules, QSet<int> &tags);
+
+	/**
+	  \brief Apply tag implications to the given tag set
+
+	  The implications of single tag rules are added first. The other rules are
+	  then applied in order, repeatedly, until no rule adds any more tags.
+	  \param tagset the tag set to add the implied tags to
+	  \param profile if not null, the rule statistics are added to this profile
+	  */
+	void apply(TagIdSet &tagset, TagRuleProfile *profile=0) const;
+
+	//! Do the rules have wildcard patterns? Those don't match tags created after loading.
+	bool hasWildcards() const { return m_haswildcards; }
+
+	/**
+	  \brief Report a profile gathered with these rules
+
+	  The most expensive rules are written in the debug log and
+	  the ruleprofile table is replaced with the full profile.
+	  \param profile the profile to report
+	  \param db the database connection to use
+	  */
+	void saveProfile(const TagRuleProfile &profile, QSqlDatabase db) const;
 
 private:
 	void applyRule(TagIdSet &tagset, const TagMatchResults &results, const TagIdSet& newtags) const;
 
+	/**
+	  \brief Prepare the loaded rules for applying
+
+	  Single tag rules whose order can't matter are collapsed into the
+	  closure table and the trigger index is built for the rest.
+	  */
+	void compile();
+
+	//! Add the tags implied by the given tags to a set
+	void addImplied(TagIdSet &tagset, int set, const TagIdVector &tags) const;
+
+	//! Rules other than the collapsed single tag implications
 	QList<TagImplication> m_rules;
+
+	//! Tag ID -> all tags implied by it through collapsed single tag rules (a --> b, c)
+	QHash<int, TagIdVector> m_closure;
+
+	//! Tag ID -> rules whose queries refer to the tag
+	QHash<int, QVector<int> > m_triggers;
+
+	//! Rules whose results may change when a new tag set is added (see TagQuery::isMonotonic())
+	QVector<int> m_setsensitive;
+
+	bool m_haswildcards;
 };
 
 #endif // TAGIMPLICATIONS_H
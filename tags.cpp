@@ -19,13 +19,20 @@
 #include <QDebug>
 #include <QSqlError>
 #include <QCompleter>
+#include <QtAlgorithms>
 
 #include "tags.h"
 #include "database.h"
+#include "tagindex.h"
+#include "tagstore.h"
+#include "savedqueries.h"
 #include "util.h"
 
+//! Maximum number of cached normalized tag names
+static const int CLEAN_NAME_CACHE = 100000;
+
 Tags::Tags(Database *parent) :
-	QAbstractListModel(parent), m_database(parent)
+	QAbstractListModel(parent), m_database(parent), m_taggedcount(0), m_patternindex(false), m_aliasesloaded(false)
 {
 }
 
@@ -60,11 +67,22 @@ void Tags::createTables(bool dropfirst)
 			qDebug() << "Couldn't drop tagmap:" << q.lastError().text();
 		if(!q.exec("DROP TABLE IF EXISTS tag"))
 			qDebug() << "Couldn't drop tag table:" << q.lastError().text();
+		Database::bumpTagMapGeneration(m_database->get());
 
 		beginResetModel();
 		m_tags.clear();
 		m_taghash.clear();
+		m_patternindex = false;
 		endResetModel();
+
+		m_frequency.clear();
+		m_taggedcount = 0;
+		m_database->tagIndex()->clear();
+		m_database->tagStore()->clear();
+		m_database->savedQueries()->clearResults();
+
+		// The compiled rules refer to the old tag IDs
+		m_database->tagRulesChanged();
 	}
 
 	// Tags
@@ -74,15 +92,19 @@ void Tags::createTables(bool dropfirst)
 		   ")");
 
 	// Tag <-> picture associations
-	q.exec("CREATE TABLE IF NOT EXISTS tagmap ("
+	q.exec(tagMapSql("tagmap"));
+}
+
+QString Tags::tagMapSql(const QString& table)
+{
+	return "CREATE TABLE IF NOT EXISTS " + table + " ("
 		   "picid INTEGER NOT NULL,"
 		   "tagid INTEGER NOT NULL,"
 		   "tagset INTEGER NOT NULL,"
 		   "PRIMARY KEY (picid, tagid, tagset),"
 		   "FOREIGN KEY (picid) REFERENCES picture ON DELETE CASCADE ON UPDATE CASCADE,"
 		   "FOREIGN KEY (tagid) REFERENCES tag ON DELETE CASCADE ON UPDATE CASCADE"
-		   ")");
-
+		   ")";
 }
 
 void Tags::reload()
@@ -90,6 +112,7 @@ void Tags::reload()
 	beginResetModel();
 	m_tags.clear();
 	m_taghash.clear();
+	m_patternindex = false;
 
 	QSqlQuery q("SELECT tagid, tag FROM tag ORDER BY tag ASC", m_database->get());
 	while(q.next()) {
@@ -98,6 +121,81 @@ void Tags::reload()
 	}
 
 	endResetModel();
+
+	reloadAliases();
+	reloadFrequencies();
+}
+
+void Tags::reloadAliases()
+{
+	m_aliasesloaded = false;
+	m_aliases.clear();
+}
+
+/**
+  The alias table is loaded into memory on first use.
+  */
+QString Tags::resolve(const QString& name) const
+{
+	QHash<QString, QString>::const_iterator clean = m_cleannames.constFind(name);
+	QString normalized;
+	if(clean != m_cleannames.constEnd()) {
+		normalized = clean.value();
+	} else {
+		normalized = Util::cleanTagName(name);
+		if(m_cleannames.count() >= CLEAN_NAME_CACHE)
+			m_cleannames.clear();
+		m_cleannames.insert(name, normalized);
+	}
+
+	if(!m_aliasesloaded) {
+		m_aliases.clear();
+		QSqlQuery q(m_database->get());
+		q.setForwardOnly(true);
+		if(!q.exec("SELECT alias, tag FROM tagalias"))
+			qDebug() << "Couldn't load tag aliases:" << q.lastError().text();
+		while(q.next())
+			m_aliases.insert(q.value(0).toString(), q.value(1).toString());
+		m_aliasesloaded = true;
+	}
+
+	return m_aliases.value(normalized, normalized);
+}
+
+void Tags::reloadFrequencies()
+{
+	m_frequency.clear();
+	m_taggedcount = 0;
+
+	QSqlQuery q(m_database->get());
+	q.setForwardOnly(true);
+	if(!q.exec("SELECT tagid, COUNT(DISTINCT picid) FROM tagmap GROUP BY tagid"))
+		qDebug() << "Couldn't get tag frequencies:" << q.lastError().text();
+	while(q.next())
+		m_frequency.insert(q.value(0).toInt(), q.value(1).toInt());
+
+	if(q.exec("SELECT COUNT(DISTINCT picid) FROM tagmap") && q.next())
+		m_taggedcount = q.value(0).toInt();
+}
+
+void Tags::updateFrequencies(const QVector<int>& oldtags, const QVector<int>& newtags)
+{
+	foreach(int tag, oldtags) {
+		if(!newtags.contains(tag)) {
+			QHash<int, int>::iterator i = m_frequency.find(tag);
+			if(i != m_frequency.end() && --i.value() <= 0)
+				m_frequency.erase(i);
+		}
+	}
+
+	foreach(int tag, newtags)
+		if(tag>0 && !oldtags.contains(tag))
+			++m_frequency[tag];
+
+	if(oldtags.isEmpty() && !newtags.isEmpty())
+		++m_taggedcount;
+	else if(!oldtags.isEmpty() && newtags.isEmpty())
+		--m_taggedcount;
 }
 
 /**
@@ -105,40 +203,42 @@ void Tags::reload()
   */
 int Tags::getOrCreate(const QString& name)
 {
-	QString normalized = Util::cleanTagName(name);
+	const QString normalized = resolve(name);
 	if(normalized.length()==0)
 		return -1;
 
-	QSqlQuery q(m_database->get());
-
-	// See if the tag has been aliased
-	q.prepare("SELECT tag FROM tagalias WHERE alias=?");
-	q.bindValue(0, normalized);
-	if(!q.exec())
-		qDebug() << "Couldn't get ID for tag" << name << q.lastError().text();
-	if(q.next())
-		normalized = q.value(0).toString();
-
-	// Okay, we got an alias. Now get the real tag
 	int tag = m_taghash.value(normalized);
 	if(tag>0)
 		return tag;
 
-	// If it does not exist, create it
-	q.prepare("INSERT INTO tag (tag) VALUES (?)");
+	// If it does not exist, create it. A background tag index rebuild
+	// may have created it already without our knowing.
+	QSqlQuery q(m_database->get());
+	q.prepare("INSERT OR IGNORE INTO tag (tag) VALUES (?)");
 	q.addBindValue(normalized);
 	if(!q.exec()) {
 		qDebug() << "Couldn't insert tag" << name << q.lastError().text();
 		return -1;
 	}
 
-	tag = q.lastInsertId().toInt();
+	q.prepare("SELECT tagid FROM tag WHERE tag=?");
+	q.addBindValue(normalized);
+	if(!q.exec() || !q.next()) {
+		qDebug() << "Couldn't get ID of tag" << name << q.lastError().text();
+		return -1;
+	}
+
+	tag = q.value(0).toInt();
 
 	beginInsertRows(QModelIndex(), m_tags.count(), m_tags.count());
 	m_tags.append(normalized);
 	m_taghash.insert(normalized, tag);
+	m_patternindex = false;
 	endInsertRows();
 
+	// Wildcard patterns in the tag rules were expanded without this tag
+	m_database->tagCreated();
+
 	return tag;
 }
 
@@ -147,16 +247,124 @@ int Tags::getOrCreate(const QString& name)
   */
 int Tags::get(const QString& name) const
 {
-	QString normalized = Util::cleanTagName(name);
+	return m_taghash.value(resolve(name), -1);
+}
 
-	QSqlQuery q(m_database->get());
-	// See if the tag has been aliased
-	q.prepare("SELECT tag FROM tagalias WHERE alias=?");
-	q.bindValue(0, normalized);
-	if(!q.exec())
-		qDebug() << "Couldn't get ID for tag" << name << q.lastError().text();
-	if(q.next())
-		normalized = q.value(0).toString();
-
-	return m_taghash.value(normalized, -1);
+namespace {
+	//! Pack three characters into a trigram index key
+	inline quint64 trigram(const QChar *chrs)
+	{
+		return (quint64(chrs[0].unicode()) << 32) | (quint64(chrs[1].unicode()) << 16) | chrs[2].unicode();
+	}
+
+	/**
+	  Match a name against a wildcard pattern.
+	  \param parts the pattern split at the wildcards
+	  \param name the name to match
+	  */
+	bool wildcardMatch(const QStringList& parts, const QString& name)
+	{
+		if(parts.count()==1)
+			return name == parts.first();
+
+		if(!name.startsWith(parts.first()) || !name.endsWith(parts.last()))
+			return false;
+
+		int pos = parts.first().length();
+		const int end = name.length() - parts.last().length();
+		if(end < pos)
+			return false;
+
+		for(int i=1;i<parts.count()-1;++i) {
+			const int found = name.indexOf(parts.at(i), pos);
+			if(found<0 || found + parts.at(i).length() > end)
+				return false;
+			pos = found + parts.at(i).length();
+		}
+		return true;
+	}
+}
+
+void Tags::buildPatternIndex() const
+{
+	if(m_patternindex)
+		return;
+
+	m_sortednames = m_taghash.keys();
+	qSort(m_sortednames);
+
+	m_sortedids.clear();
+	m_sortedids.reserve(m_sortednames.count());
+	m_trigrams.clear();
+
+	for(int row=0;row<m_sortednames.count();++row) {
+		const QString &name = m_sortednames.at(row);
+		m_sortedids.append(m_taghash.value(name));
+
+		const QChar *chrs = name.constData();
+		for(int i=0;i+3<=name.length();++i) {
+			QVector<int> &rows = m_trigrams[trigram(chrs + i)];
+			// A trigram may appear more than once in the same name
+			if(rows.isEmpty() || rows.last() != row)
+				rows.append(row);
+		}
+	}
+
+	m_patternindex = true;
+}
+
+/**
+  Patterns with a literal prefix only look at the range of names with that prefix.
+  Otherwise, the rarest trigram of the longest literal part of the pattern is used
+  to pick the names to check. Patterns with no literal part of at least three
+  characters are matched against all tag names.
+  */
+QVector<int> Tags::match(const QString& pattern) const
+{
+	QVector<int> ids;
+	const QStringList parts = Util::cleanTagName(pattern).split('*');
+
+	if(parts.count()==1) {
+		const int id = get(parts.first());
+		if(id>0)
+			ids.append(id);
+		return ids;
+	}
+
+	buildPatternIndex();
+
+	const QString &prefix = parts.first();
+	if(!prefix.isEmpty()) {
+		int row = qLowerBound(m_sortednames.constBegin(), m_sortednames.constEnd(), prefix) - m_sortednames.constBegin();
+		for(;row<m_sortednames.count() && m_sortednames.at(row).startsWith(prefix);++row)
+			if(wildcardMatch(parts, m_sortednames.at(row)))
+				ids.append(m_sortedids.at(row));
+		return ids;
+	}
+
+	QString longest;
+	foreach(const QString &part, parts)
+		if(part.length() > longest.length())
+			longest = part;
+
+	if(longest.length() < 3) {
+		for(int row=0;row<m_sortednames.count();++row)
+			if(wildcardMatch(parts, m_sortednames.at(row)))
+				ids.append(m_sortedids.at(row));
+		return ids;
+	}
+
+	const QVector<int> *rarest = 0;
+	for(int i=0;i+3<=longest.length();++i) {
+		QHash<quint64, QVector<int> >::const_iterator rows = m_trigrams.constFind(trigram(longest.constData() + i));
+		if(rows == m_trigrams.constEnd())
+			return ids;
+		if(rarest==0 || rows.value().count() < rarest->count())
+			rarest = &rows.value();
+	}
+
+	foreach(int row, *rarest)
+		if(wildcardMatch(parts, m_sortednames.at(row)))
+			ids.append(m_sortedids.at(row));
+	return ids;
 }
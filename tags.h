@@ -20,6 +20,7 @@
 #include <QAbstractListModel>
 #include <QStringList>
 #include <QHash>
+#include <QVector>
 
 class Database;
 class QCompleter;
@@ -30,18 +31,55 @@ class Tags : public QAbstractListModel
 public:
 	explicit Tags(Database *database);
 
+	//! Get the database these tags belong to
+	Database *database() const { return m_database; }
+
 	//! Get the ID for the given tag, creating it if it doesn't exist already
 	int getOrCreate(const QString& name);
 
 	//! Get the ID for the given tag
 	int get(const QString& name) const;
 
+	/**
+	  \brief Get the IDs of the tags matching a wildcard pattern
+
+	  The pattern may contain any number of * wildcards, which match any
+	  string. Prefix patterns (e.g. "cat*") are looked up in a sorted list
+	  of tag names, other patterns (e.g. "*:portrait") with a trigram index.
+	  Aliases are not expanded.
+	  \param pattern the wildcard pattern
+	  \return IDs of the matching tags, in tag name order
+	  */
+	QVector<int> match(const QString& pattern) const;
+
 	//! (Re)create the tag index tables
 	void createTables(bool dropfirst=false);
 
+	//! Get the statement for creating a tag map table with the given name
+	static QString tagMapSql(const QString& table);
+
 	//! Reload all tags from the database, including tag aliases
 	void reload();
 
+	//! Reload tag aliases. Call this after the tagalias table has been changed
+	void reloadAliases();
+
+	//! Get the number of pictures that have the given tag
+	int frequency(int tagid) const { return m_frequency.value(tagid, 0); }
+
+	//! Get the number of pictures that have any tags
+	int taggedCount() const { return m_taggedcount; }
+
+	/**
+	  \brief Update tag frequencies after a picture's tags have changed
+	  \param oldtags the picture's previous tags (without duplicates)
+	  \param newtags the picture's current tags (without duplicates)
+	  */
+	void updateFrequencies(const QVector<int>& oldtags, const QVector<int>& newtags);
+
+	//! Recount tag frequencies from the tag map
+	void reloadFrequencies();
+
 	int rowCount(const QModelIndex &parent) const;
 
 	QVariant data(const QModelIndex &index, int role) const;
@@ -55,6 +93,30 @@ private:
 	QHash<QString, int> m_taghash;
 	QStringList m_tags;
 
+	QHash<int, int> m_frequency;
+	int m_taggedcount;
+
+	//! (Re)build the indexes used for wildcard matching
+	void buildPatternIndex() const;
+
+	//! Normalize a tag name and resolve aliases
+	QString resolve(const QString& name) const;
+
+	// Alias -> tag. Loaded on demand.
+	mutable bool m_aliasesloaded;
+	mutable QHash<QString, QString> m_aliases;
+
+	//! Raw tag name -> normalized name (see Util::cleanTagName)
+	mutable QHash<QString, QString> m_cleannames;
+
+	// Wildcard pattern indexes. These are built on demand.
+	mutable bool m_patternindex;
+	mutable QStringList m_sortednames;
+	mutable QVector<int> m_sortedids;
+
+	//! Trigram -> rows of m_sortednames containing it
+	mutable QHash<quint64, QVector<int> > m_trigrams;
+
 };
 
 #endif // TAGS_H
@@ -22,6 +22,9 @@
 #include "tagset.h"
 #include "util.h"
 #include "tags.h"
+#include "tagindex.h"
+#include "tagstore.h"
+#include "savedqueries.h"
 
 TagSet::TagSet()
 {
@@ -91,6 +94,21 @@ QString TagSet::toString() const
 	return str;
 }
 
+TagSet TagSet::normalized(const QHash<QString, QString>& aliases) const
+{
+	TagSet tags;
+	tags.m_sets.clear();
+	foreach(const QStringList& set, m_sets) {
+		QStringList names;
+		foreach(const QString& tag, set) {
+			const QString name = Util::cleanTagName(tag);
+			names.append(aliases.value(name, name));
+		}
+		tags.m_sets.append(names);
+	}
+	return tags;
+}
+
 TagSet TagSet::getForPicture(const Database *db, int picid)
 {
 	QSqlQuery q(db->get());
@@ -126,9 +144,19 @@ TagIdSet::TagIdSet(const TagSet &tagset, Tags *tags, int pictureid)
 {
 	for(int i=0;i<=tagset.sets();++i) {
 		foreach(const QString& tag, tagset.tags(i)) {
-			int id = tags->getOrCreate(tag);
-			if(!m_sets[i].contains(id))
-				m_sets[i].append(id);
+			m_sets[i].insert(tags->getOrCreate(tag));
+		}
+	}
+}
+
+TagIdSet::TagIdSet(const TagSet &tagset, const QHash<QString, int>& tagids, int pictureid)
+	: m_picid(pictureid), m_sets(tagset.sets()+1)
+{
+	for(int i=0;i<=tagset.sets();++i) {
+		foreach(const QString& tag, tagset.tags(i)) {
+			const int id = tagids.value(tag, -1);
+			if(id>0)
+				m_sets[i].insert(id);
 		}
 	}
 }
@@ -159,7 +187,7 @@ TagIdSet TagIdSet::getFromResults(QSqlQuery &query)
 				tags.m_sets.append(TagIdVector());
 			}
 
-			tags.m_sets.last().append(query.value(1).toInt());
+			tags.m_sets.last().insert(query.value(1).toInt());
 		} while(query.next());
 	}
 
@@ -177,30 +205,20 @@ int TagIdSet::totalCount() const
 
 void TagIdSet::insertTags(const TagIdVector& tags, int set)
 {
-	foreach(int tag, tags) {
-		if(!m_sets[set].contains(tag))
-			m_sets[set].append(tag);
-	}
+	m_sets[set].unite(tags);
 }
 
 void TagIdSet::insertSet(const TagIdVector& tags)
 {
 	for(int i=1;i<m_sets.count();++i) {
-		bool subset = true;
-		for(int j=0;j<tags.count();++j) {
-			if(!m_sets.at(i).contains(tags.at(j))) {
-				subset = false;
-				break;
-			}
-		}
-		if(subset)
+		if(tags.isSubsetOf(m_sets.at(i)))
 			return;
 	}
 
 	m_sets.append(tags);
 }
 
-void TagIdSet::save(const Database *db, bool transaction)
+void TagIdSet::save(Database *db, bool transaction)
 {
 	if(m_picid<=0) {
 		qDebug() << "ERROR: trying to save TagIdSet with invalid picture id";
@@ -211,6 +229,31 @@ void TagIdSet::save(const Database *db, bool transaction)
 	if(transaction)
 		db->get().transaction();
 	QSqlQuery q(db->get());
+
+	// The old tags are needed to update the tag statistics and index
+	TagIdVector oldall;
+	QVector<TagIdVector> oldsets;
+	q.exec("SELECT tagid, tagset FROM tagmap WHERE picid=" + QString::number(m_picid));
+	while(q.next()) {
+		const int set = q.value(1).toInt();
+		if(set >= oldsets.count())
+			oldsets.resize(set+1);
+		oldsets[set].insert(q.value(0).toInt());
+		oldall.insert(q.value(0).toInt());
+	}
+
+	QVector<int> oldtags;
+	foreach(int tag, oldall)
+		oldtags.append(tag);
+
+	// Were the tags grouped into sets differently? This matters to set queries.
+	bool regrouped = false;
+	for(int set=1;set<qMax(oldsets.count(), m_sets.count()) && !regrouped;++set) {
+		const TagIdVector oldset = set<oldsets.count() ? oldsets.at(set) : TagIdVector();
+		const TagIdVector newset = set<m_sets.count() ? m_sets.at(set) : TagIdVector();
+		regrouped = !(oldset == newset);
+	}
+
 	q.exec("DELETE FROM tagmap WHERE picid=" + QString::number(m_picid));
 
 	// Insert new ones
@@ -227,6 +270,23 @@ void TagIdSet::save(const Database *db, bool transaction)
 		}
 	}
 
+	Database::bumpTagMapGeneration(db->get());
+
 	if(transaction)
 		db->get().commit();
+
+	TagIdVector alltags;
+	foreach(const TagIdVector& tags, m_sets)
+		alltags.unite(tags);
+
+	QVector<int> newtags;
+	foreach(int tag, alltags)
+		if(tag>0)
+			newtags.append(tag);
+
+	db->tags()->updateFrequencies(oldtags, newtags);
+	db->tagIndex()->update(m_picid, oldtags, newtags);
+	db->tagStore()->update(*this);
+	db->savedQueries()->update(*this, oldtags, newtags, regrouped);
+	db->tagsSaved(m_picid);
 }
@@ -19,6 +19,9 @@
 
 #include <QStringList>
 #include <QVector>
+#include <QHash>
+
+#include "tagidvector.h"
 
 class Database;
 class QSqlQuery;
@@ -51,12 +54,18 @@ public:
 	//! Get the tag set in the same format as accepted by parse(QString)
 	QString toString() const;
 
+	/**
+	  \brief Get a copy with normalized tag names and aliases resolved
+
+	  This does not touch the database, so it can be used from any thread.
+	  \param aliases alias -> tag mapping
+	  */
+	TagSet normalized(const QHash<QString, QString>& aliases) const;
+
 private:
 	QList<QStringList> m_sets;
 };
 
-typedef QVector<int> TagIdVector;
-
 /**
   A variant of TagSet except for tag IDs. This is for tag query matching.
   */
@@ -69,6 +78,14 @@ public:
 	//! Construct from a tag set
 	TagIdSet(const TagSet &tagset, Tags *tags, int pictureid=-1);
 
+	/**
+	  \brief Construct from a normalized tag set using a prepared name -> ID mapping
+
+	  Tags missing from the mapping are left out.
+	  \see TagSet::normalized
+	  */
+	TagIdSet(const TagSet &tagset, const QHash<QString, int>& tagids, int pictureid=-1);
+
 	//! Get the tagset for a picture from an open result set
 	static TagIdSet getFromResults(QSqlQuery &query);
 
@@ -92,7 +109,7 @@ public:
 	//! Insert tags to the given set, ignoring duplicates
 	void insertTags(const TagIdVector& tags, int set);
 
-	//! Insert a new tag set, unless a set containing the same values already exists
+	//! Insert a new tag set, unless an existing set already contains all the same values
 	void insertSet(const TagIdVector& tags);
 
 	/**
@@ -104,10 +121,12 @@ public:
 
 	/**
 	 * \brief Save the tags
+	 *
+	 * The tag frequencies, the tag index and the tag store are updated as well.
 	 * \param db the database to use
 	 * \param transaction if true, a new transaction is started and committed.
 	 */
-	void save(const Database *db, bool transaction=true);
+	void save(Database *db, bool transaction=true);
 
 private:
 	int m_picid;
@@ -0,0 +1,240 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QVariant>
+#include <QTime>
+#include <QtAlgorithms>
+
+#include <algorithm>
+
+#include "tagstore.h"
+#include "tagset.h"
+#include "database.h"
+
+bool TagStoreEntry::contains(int set, int tag) const
+{
+	const int *begin = m_tagids + m_setstart[set];
+	const int *end = m_tagids + m_setstart[set+1];
+
+	// Sets are usually small, so a linear scan of the sorted tags is fastest
+	for(const int *t=begin;t<end;++t) {
+		if(*t >= tag)
+			return *t == tag;
+	}
+	return false;
+}
+
+bool TagStoreEntry::contains(int tag) const
+{
+	for(int i=0;i<m_setcount;++i)
+		if(contains(i, tag))
+			return true;
+	return false;
+}
+
+QVector<int> TagStoreEntry::tags() const
+{
+	QVector<int> tags;
+	tags.reserve(m_setstart[m_setcount] - m_setstart[0]);
+	for(const int *t=m_tagids + m_setstart[0];t<m_tagids + m_setstart[m_setcount];++t)
+		tags.append(*t);
+
+	// Sets are sorted individually, so there may be duplicates across sets
+	if(m_setcount>1) {
+		qSort(tags);
+		tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+	}
+	return tags;
+}
+
+TagStore::TagStore(Database *database)
+	: m_database(database), m_loaded(false)
+{
+}
+
+void TagStore::load() const
+{
+	if(!m_loaded) {
+		QTime timer;
+		timer.start();
+
+		rebuild();
+		m_loaded = true;
+
+		qDebug() << "Tag store loaded:" << m_picids.size() << "pictures," << m_tagids.size() << "tags in" << timer.elapsed() << "ms";
+	}
+
+	if(!m_pending.isEmpty())
+		merge();
+}
+
+TagStoreEntry TagStore::entry(int row) const
+{
+	Q_ASSERT(m_pending.isEmpty());
+	const int first = m_firstset.at(row);
+	return TagStoreEntry(m_picids.at(row), m_setstart.constData() + first, m_firstset.at(row+1) - first, m_tagids.constData());
+}
+
+int TagStore::lowerBound(int picid) const
+{
+	return qLowerBound(m_picids.constBegin(), m_picids.constEnd(), picid) - m_picids.constBegin();
+}
+
+void TagStore::rebuild() const
+{
+	m_picids.clear();
+	m_firstset.clear();
+	m_setstart.clear();
+	m_tagids.clear();
+	m_pending.clear();
+
+	QSqlQuery q(m_database->get());
+	q.setForwardOnly(true);
+	if(!q.exec("SELECT picid, tagid, tagset FROM tagmap ORDER BY picid, tagset, tagid"))
+		qDebug() << "Couldn't read tag map:" << q.lastError().text();
+
+	// Set numbering follows TagIdSet::getFromResults
+	int picid = -1;
+	int lastset = 0;
+	while(q.next()) {
+		const int id = q.value(0).toInt();
+		const int set = q.value(2).toInt();
+		if(id != picid) {
+			picid = id;
+			lastset = 0;
+			m_picids.append(id);
+			m_firstset.append(m_setstart.size());
+			m_setstart.append(m_tagids.size());
+			// No zero set tags: the zero set stays empty
+			if(set > lastset) {
+				lastset = set;
+				m_setstart.append(m_tagids.size());
+			}
+		} else if(set > lastset) {
+			lastset = set;
+			m_setstart.append(m_tagids.size());
+		}
+		m_tagids.append(q.value(1).toInt());
+	}
+	m_firstset.append(m_setstart.size());
+	m_setstart.append(m_tagids.size());
+}
+
+/**
+  Merge the pending updates into the arrays. The merge is a single
+  pass over the arrays, so many updates cost as much as one.
+  */
+void TagStore::merge() const
+{
+	QVector<int> updated = m_pending.keys().toVector();
+	qSort(updated);
+
+	QVector<int> picids, firstset, setstart, tagids;
+	picids.reserve(m_picids.size() + updated.size());
+	firstset.reserve(m_firstset.size() + updated.size());
+	setstart.reserve(m_setstart.size());
+	tagids.reserve(m_tagids.size());
+
+	int row = 0, u = 0;
+	while(row < m_picids.size() || u < updated.size()) {
+		if(u >= updated.size() || (row < m_picids.size() && m_picids.at(row) < updated.at(u))) {
+			// Copy an unchanged picture
+			picids.append(m_picids.at(row));
+			firstset.append(setstart.size());
+			const int offset = tagids.size() - m_setstart.at(m_firstset.at(row));
+			for(int s=m_firstset.at(row);s<m_firstset.at(row+1);++s)
+				setstart.append(m_setstart.at(s) + offset);
+			for(int t=m_setstart.at(m_firstset.at(row));t<m_setstart.at(m_firstset.at(row+1));++t)
+				tagids.append(m_tagids.at(t));
+			++row;
+		} else {
+			// Insert the new tags of an updated picture
+			const int picid = updated.at(u++);
+			if(row < m_picids.size() && m_picids.at(row) == picid)
+				++row;
+
+			const QVector<QVector<int> > &sets = m_pending[picid];
+			if(sets.isEmpty())
+				continue;
+
+			picids.append(picid);
+			firstset.append(setstart.size());
+			foreach(const QVector<int> &set, sets) {
+				setstart.append(tagids.size());
+				tagids += set;
+			}
+		}
+	}
+	firstset.append(setstart.size());
+	setstart.append(tagids.size());
+
+	m_picids = picids;
+	m_firstset = firstset;
+	m_setstart = setstart;
+	m_tagids = tagids;
+	m_pending.clear();
+}
+
+void TagStore::update(const TagIdSet &tags)
+{
+	if(!m_loaded)
+		return;
+
+	// Empty sets are dropped, as they are not stored in the tag map
+	QVector<QVector<int> > sets;
+	int count = 0;
+	for(int i=0;i<=tags.sets();++i) {
+		QVector<int> set;
+		foreach(int tag, tags.tags(i))
+			if(tag>0)
+				set.append(tag);
+		if(set.isEmpty() && i>0)
+			continue;
+		qSort(set);
+		sets.append(set);
+		count += set.size();
+	}
+	if(count==0)
+		sets.clear();
+
+	m_pending.insert(tags.pictureId(), sets);
+}
+
+void TagStore::clear()
+{
+	m_picids.clear();
+	m_firstset.clear();
+	m_setstart.clear();
+	m_tagids.clear();
+	m_pending.clear();
+
+	m_firstset.append(0);
+	m_setstart.append(0);
+	m_loaded = true;
+}
+
+void TagStore::invalidate()
+{
+	m_picids.clear();
+	m_firstset.clear();
+	m_setstart.clear();
+	m_tagids.clear();
+	m_pending.clear();
+	m_loaded = false;
+}
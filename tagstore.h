@@ -0,0 +1,135 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef TAGSTORE_H
+#define TAGSTORE_H
+
+#include <QVector>
+#include <QHash>
+
+class Database;
+class TagIdSet;
+
+/**
+  \brief A read-only view of one picture's tags in the tag store
+
+  The view points directly into the store's arrays, so it is only valid
+  until the store is next modified.
+  */
+class TagStoreEntry
+{
+	friend class TagStore;
+public:
+	//! Get the ID of the picture
+	int pictureId() const { return m_picid; }
+
+	//! Get the number of tag sets (not counting the zero set)
+	int sets() const { return m_setcount-1; }
+
+	//! Is the tag in the given set
+	bool contains(int set, int tag) const;
+
+	//! Is the tag in any set
+	bool contains(int tag) const;
+
+	//! Get the tags of all sets, sorted and without duplicates
+	QVector<int> tags() const;
+
+private:
+	TagStoreEntry(int picid, const int *setstart, int setcount, const int *tagids)
+		: m_picid(picid), m_setstart(setstart), m_setcount(setcount), m_tagids(tagids)
+	{ }
+
+	int m_picid;
+	const int *m_setstart;
+	int m_setcount;
+	const int *m_tagids;
+};
+
+/**
+  \brief In-memory copy of the tag map for query matching
+
+  The tags of all pictures are kept in compressed sparse row layout:
+  the pictures index into a table of tag set boundaries, which index
+  into a single array of tag IDs. The tags in each set are sorted.
+
+  The store is loaded from the tagmap table on first use. Changes made
+  with update() are collected separately and merged into the arrays the
+  next time the store is read.
+  */
+class TagStore
+{
+public:
+	TagStore(Database *database);
+
+	//! Is the store loaded into memory
+	bool isLoaded() const { return m_loaded; }
+
+	/**
+	  \brief Make sure the store is loaded and up to date
+
+	  This must be called before reading the store.
+	  */
+	void load() const;
+
+	//! Get the number of pictures in the store
+	int count() const { return m_picids.size(); }
+
+	//! Get the tags of the picture at the given row. Rows are in picture ID order.
+	TagStoreEntry entry(int row) const;
+
+	//! Get the row of the first picture whose ID is not less than the given one
+	int lowerBound(int picid) const;
+
+	/**
+	  \brief Replace the tags of a picture
+
+	  Does nothing if the store is not loaded.
+	  */
+	void update(const TagIdSet &tags);
+
+	//! Empty the store. This is called when the tag tables are recreated.
+	void clear();
+
+	//! Drop the store. It will be reloaded when needed.
+	void invalidate();
+
+private:
+	void rebuild() const;
+	void merge() const;
+
+	Database *m_database;
+
+	// The store is loaded on demand, even through a const reference
+	mutable bool m_loaded;
+
+	//! Picture IDs in ascending order
+	mutable QVector<int> m_picids;
+
+	//! Index of each picture's first set in m_setstart. The last item is the total number of sets.
+	mutable QVector<int> m_firstset;
+
+	//! Index of each set's first tag in m_tagids. The last item is the total number of tags.
+	mutable QVector<int> m_setstart;
+
+	//! Tag IDs of all sets of all pictures
+	mutable QVector<int> m_tagids;
+
+	//! Updated pictures not yet merged into the arrays. An empty list means the picture has no tags.
+	mutable QHash<int, QVector<QVector<int> > > m_pending;
+};
+
+#endif // TAGSTORE_H
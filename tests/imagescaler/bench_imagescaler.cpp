@@ -0,0 +1,98 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QtTest>
+#include <QImage>
+
+#include "imagescaler.h"
+
+/**
+  Compares ImageScaler with QImage::scaled(..., Qt::SmoothTransformation)
+  on the same images. Run with e.g. -tickcounter or -iterations for
+  steadier numbers.
+  */
+class BenchImageScaler : public QObject
+{
+	Q_OBJECT
+private slots:
+	void scale_data();
+	void scale();
+
+private:
+	static QImage testImage(const QSize& size);
+};
+
+//! A noisy RGB32 image, like a decoded photo. Noise defeats any shortcuts for flat areas.
+QImage BenchImageScaler::testImage(const QSize& size)
+{
+	QImage image(size, QImage::Format_RGB32);
+	quint32 seed = 1;
+	for(int y=0;y<image.height();++y) {
+		quint32 *line = reinterpret_cast<quint32*>(image.scanLine(y));
+		for(int x=0;x<image.width();++x) {
+			seed = seed * 1664525u + 1013904223u;
+			line[x] = 0xff000000 | (seed >> 8);
+		}
+	}
+	return image;
+}
+
+void BenchImageScaler::scale_data()
+{
+	QTest::addColumn<QSize>("source");
+	QTest::addColumn<QSize>("target");
+	QTest::addColumn<bool>("qt");
+
+	const QSize camera(4000, 3000);
+	const QSize small(1600, 1200);
+
+	QTest::newRow("12MP to thumbnail, ImageScaler") << camera << QSize(256, 192) << false;
+	QTest::newRow("12MP to thumbnail, QImage::scaled") << camera << QSize(256, 192) << true;
+	QTest::newRow("12MP to 1920x1440, ImageScaler") << camera << QSize(1920, 1440) << false;
+	QTest::newRow("12MP to 1920x1440, QImage::scaled") << camera << QSize(1920, 1440) << true;
+	QTest::newRow("2MP to thumbnail, ImageScaler") << small << QSize(256, 192) << false;
+	QTest::newRow("2MP to thumbnail, QImage::scaled") << small << QSize(256, 192) << true;
+}
+
+void BenchImageScaler::scale()
+{
+	QFETCH(QSize, source);
+	QFETCH(QSize, target);
+	QFETCH(bool, qt);
+
+	const QImage image = testImage(source);
+	QImage result;
+	if(qt) {
+		QBENCHMARK {
+			result = image.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+		}
+	} else {
+		QBENCHMARK {
+			result = ImageScaler::scale(image, target);
+		}
+	}
+	QCOMPARE(result.size(), target);
+}
+
+// No QApplication: the benchmark needs no display
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	BenchImageScaler bench;
+	return QTest::qExec(&bench, argc, argv);
+}
+
+#include "bench_imagescaler.moc"
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# ImageScaler benchmark against QImage::scaled
+#
+#-------------------------------------------------
+
+QT       += core gui testlib
+
+TARGET = bench_imagescaler
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+
+SOURCES += bench_imagescaler.cpp \
+    ../../imagescaler.cpp
+
+HEADERS  += ../../imagescaler.h
@@ -0,0 +1,194 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QtTest>
+#include <QDir>
+#include <QSqlQuery>
+#include <QThreadPool>
+
+#include "database.h"
+#include "tags.h"
+#include "tagset.h"
+#include "tagquery.h"
+#include "tagstore.h"
+
+//! Number of pictures in the tag store benchmark
+static const int STORE_PICTURES = 200000;
+
+/**
+  Benchmarks of tag query matching. The set query cases cover pictures
+  with more than 64 tag sets, where the sets already used by a query
+  no longer fit in one word. The tag store case measures how set query
+  matching scales with the number of threads.
+  */
+class BenchTagQuery : public QObject
+{
+	Q_OBJECT
+private slots:
+	void initTestCase();
+	void cleanupTestCase();
+
+	void setQuery_data();
+	void setQuery();
+
+	void storeMatch_data();
+	void storeMatch();
+
+private:
+	QDir m_dir;
+	Database *m_db;
+};
+
+void BenchTagQuery::initTestCase()
+{
+	m_dir = QDir::temp();
+	const QString name = "piqs-tagquery-" + QString::number(QCoreApplication::applicationPid());
+	QVERIFY(m_dir.mkpath(name));
+	QVERIFY(m_dir.cd(name));
+
+	m_db = new Database(m_dir);
+	QVERIFY(m_db->isOpen());
+}
+
+void BenchTagQuery::cleanupTestCase()
+{
+	delete m_db;
+	foreach(const QString& file, m_dir.entryList(QDir::Files))
+		m_dir.remove(file);
+	const QString name = m_dir.dirName();
+	m_dir.cdUp();
+	m_dir.rmdir(name);
+}
+
+/**
+  The picture has the groups [x, g1] ... [x, gN]. The set query has to
+  scan past all of them for its first group, which marks the last set
+  as used, and the later groups skip it. The flat query is matched
+  against each set separately.
+  */
+void BenchTagQuery::setQuery_data()
+{
+	QTest::addColumn<int>("groups");
+	QTest::addColumn<QString>("query");
+
+	const int groups[] = {8, 32, 64, 128};
+	for(unsigned int i=0;i<sizeof(groups)/sizeof(groups[0]);++i) {
+		const int n = groups[i];
+		const QString last = "g" + QString::number(n);
+		const QString prev = "g" + QString::number(n-1);
+		QTest::newRow(qPrintable(QString("%1 groups, sets").arg(n)))
+				<< n << QString("[%1], [%2, x], [x]").arg(last, prev);
+		QTest::newRow(qPrintable(QString("%1 groups, flat").arg(n)))
+				<< n << last;
+	}
+}
+
+void BenchTagQuery::setQuery()
+{
+	QFETCH(int, groups);
+	QFETCH(QString, query);
+
+	QStringList sets;
+	for(int i=1;i<=groups;++i)
+		sets << "[x, g" + QString::number(i) + "]";
+	const TagIdSet tags(TagSet::parse(sets.join(", ")), m_db->tags());
+	QCOMPARE(tags.sets(), groups);
+
+	TagQuery q(query);
+	q.init(m_db->tags());
+	QVERIFY(!q.isError());
+
+	TagMatchResults results;
+	QBENCHMARK {
+		results = q.query(tags);
+	}
+	QVERIFY(results.matched);
+}
+
+/**
+  Every picture has the groups [x, gN] and [x, gM] and a plain tag in
+  the zero set, so each one has to be matched set by set.
+  */
+void BenchTagQuery::storeMatch_data()
+{
+	QTest::addColumn<int>("threads");
+
+	const int threads[] = {1, 2, 4, 8, 16};
+	for(unsigned int i=0;i<sizeof(threads)/sizeof(threads[0]);++i)
+		QTest::newRow(qPrintable(QString("%1 threads").arg(threads[i]))) << threads[i];
+}
+
+void BenchTagQuery::storeMatch()
+{
+	QFETCH(int, threads);
+
+	TagStore *store = m_db->tagStore();
+	if(!store->isLoaded() || store->count()==0) {
+		const int x = m_db->tags()->getOrCreate("x");
+		const int y = m_db->tags()->getOrCreate("y");
+		QVector<int> g;
+		for(int i=1;i<=16;++i)
+			g.append(m_db->tags()->getOrCreate("g" + QString::number(i)));
+
+		QVERIFY(m_db->get().transaction());
+		QSqlQuery q(m_db->get());
+		q.prepare("INSERT INTO tagmap (picid, tagid, tagset) VALUES (?, ?, ?)");
+		for(int pic=1;pic<=STORE_PICTURES;++pic) {
+			const int rows[5][2] = {
+				{y, 0},
+				{x, 1}, {g.at(pic % 16), 1},
+				{x, 2}, {g.at((pic / 16) % 16), 2}
+			};
+			for(int r=0;r<5;++r) {
+				q.bindValue(0, pic);
+				q.bindValue(1, rows[r][0]);
+				q.bindValue(2, rows[r][1]);
+				QVERIFY(q.exec());
+			}
+		}
+		QVERIFY(m_db->get().commit());
+
+		store->invalidate();
+		store->load();
+	}
+	QCOMPARE(store->count(), STORE_PICTURES);
+
+	TagQuery query("[g1, x], [x, !g2]");
+	query.init(m_db->tags());
+	QVERIFY(!query.isError());
+
+	QThreadPool *pool = QThreadPool::globalInstance();
+	const int oldthreads = pool->maxThreadCount();
+	pool->setMaxThreadCount(threads);
+
+	QVector<int> matches;
+	QBENCHMARK {
+		matches = query.match(*store, 0, store->count());
+	}
+	pool->setMaxThreadCount(oldthreads);
+
+	QVERIFY(!matches.isEmpty());
+}
+
+// No QApplication: the benchmark needs no display
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	BenchTagQuery bench;
+	return QTest::qExec(&bench, argc, argv);
+}
+
+#include "bench_tagquery.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Tag query benchmarks
+#
+#-------------------------------------------------
+
+include(../tests.pri)
+
+TARGET = bench_tagquery
+
+SOURCES += bench_tagquery.cpp
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Tag rule evaluation test
+#
+#-------------------------------------------------
+
+include(../tests.pri)
+
+TARGET = tst_tagrules
+
+SOURCES += tst_tagrules.cpp
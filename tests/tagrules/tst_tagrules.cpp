@@ -0,0 +1,251 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QtTest>
+#include <QSqlQuery>
+#include <QDir>
+
+#include "database.h"
+#include "tags.h"
+#include "tagrules.h"
+
+//! Number of generated rule sets
+static const int RULESETS = 500;
+
+//! Number of generated pictures per rule set
+static const int PICTURES = 10;
+
+//! Number of distinct tags used in the rules
+static const int TAGS = 10;
+
+/**
+  Checks that TagImplications::apply gives the same results as the plain
+  fixed-point loop it replaced, which evaluated every rule on every pass.
+  */
+class TestTagRules : public QObject
+{
+	Q_OBJECT
+private slots:
+	void initTestCase();
+	void cleanupTestCase();
+
+	void sameAsFixedPoint();
+
+private:
+	struct Rule {
+		QString query;
+		QString tags;
+	};
+
+	QString randomTag() const;
+	QString randomTags(int max) const;
+	QList<Rule> randomRules() const;
+	QString randomPicture() const;
+
+	static void applyFixedPoint(const QList<TagQuery>& queries, const QList<TagIdSet>& newtags, TagIdSet &tagset);
+	static QString describe(const TagIdSet &tagset);
+
+	QDir m_dir;
+	Database *m_db;
+};
+
+void TestTagRules::initTestCase()
+{
+	m_dir = QDir::temp();
+	const QString name = "piqs-tagrules-" + QString::number(QCoreApplication::applicationPid());
+	QVERIFY(m_dir.mkpath(name));
+	QVERIFY(m_dir.cd(name));
+
+	m_db = new Database(m_dir);
+	QVERIFY(m_db->isOpen());
+
+	for(int i=0;i<TAGS;++i)
+		m_db->tags()->getOrCreate("t" + QString::number(i));
+
+	qsrand(46);
+}
+
+void TestTagRules::cleanupTestCase()
+{
+	delete m_db;
+	foreach(const QString& file, m_dir.entryList(QDir::Files))
+		m_dir.remove(file);
+	const QString name = m_dir.dirName();
+	m_dir.cdUp();
+	m_dir.rmdir(name);
+}
+
+QString TestTagRules::randomTag() const
+{
+	return "t" + QString::number(qrand() % TAGS);
+}
+
+QString TestTagRules::randomTags(int max) const
+{
+	QStringList tags;
+	const int count = 1 + qrand() % max;
+	while(tags.count() < count) {
+		const QString tag = randomTag();
+		if(!tags.contains(tag))
+			tags << tag;
+	}
+	return tags.join(", ");
+}
+
+/**
+  Most rules are single tag implications, since those are the ones
+  collapsed into the closure table. The rest are a mix of conjunctions,
+  disjunctions, negations and :any. Some rules add new tag sets.
+  */
+QList<TestTagRules::Rule> TestTagRules::randomRules() const
+{
+	QList<Rule> rules;
+	QSet<QString> queries;
+	const int count = 1 + qrand() % 12;
+	for(int i=0;i<count;++i) {
+		Rule rule;
+		switch(qrand() % 9) {
+		case 0: rule.query = randomTag() + ", " + randomTag(); break;
+		case 1: rule.query = randomTag() + " | " + randomTag(); break;
+		case 2: rule.query = randomTag() + ", !" + randomTag(); break;
+		case 3: rule.query = ":any"; break;
+		default: rule.query = randomTag(); break;
+		}
+
+		// The query is the primary key of the rule table
+		if(queries.contains(rule.query))
+			continue;
+		queries.insert(rule.query);
+
+		rule.tags = randomTags(2);
+		if(qrand() % 10 == 0)
+			rule.tags += ", [" + randomTags(2) + "]";
+		rules.append(rule);
+	}
+	return rules;
+}
+
+QString TestTagRules::randomPicture() const
+{
+	QString tags;
+	if(qrand() % 4)
+		tags = randomTags(3);
+
+	const int sets = qrand() % 3;
+	for(int i=0;i<sets;++i) {
+		if(!tags.isEmpty())
+			tags += ", ";
+		tags += "[" + randomTags(3) + "]";
+	}
+	return tags;
+}
+
+/**
+  The loop TagImplications::apply used before semi-naive evaluation
+  and the closure table of single tag rules.
+  */
+void TestTagRules::applyFixedPoint(const QList<TagQuery>& queries, const QList<TagIdSet>& newtags, TagIdSet &tagset)
+{
+	int lastcount=0;
+	while(tagset.totalCount() > lastcount) {
+		lastcount = tagset.totalCount();
+
+		for(int r=0;r<queries.count();++r) {
+			TagMatchResults results = queries.at(r).query(tagset);
+			if(!results.matched)
+				continue;
+
+			const TagIdSet &added = newtags.at(r);
+			if(results.matchsets) {
+				tagset.insertTags(added.tags(0), 0);
+				for(int i=0;i<qMin(added.sets(), results.tagsets.count());++i)
+					tagset.insertTags(added.tags(i+1), results.tagsets.at(i));
+			} else if(results.tagsets.isEmpty() || added.sets()>0) {
+				tagset.insertTags(added.tags(0), 0);
+				for(int i=1;i<=added.sets();++i)
+					tagset.insertSet(added.tags(i));
+			} else {
+				foreach(int set, results.tagsets)
+					tagset.insertTags(added.tags(0), set);
+			}
+		}
+	}
+}
+
+QString TestTagRules::describe(const TagIdSet &tagset)
+{
+	QStringList sets;
+	for(int i=0;i<=tagset.sets();++i) {
+		QStringList tags;
+		for(int t=0;t<tagset.tags(i).count();++t)
+			tags << QString::number(tagset.tags(i).at(t));
+		sets << "[" + tags.join(", ") + "]";
+	}
+	return sets.join(" ");
+}
+
+void TestTagRules::sameAsFixedPoint()
+{
+	QSqlQuery q(m_db->get());
+
+	for(int ruleset=0;ruleset<RULESETS;++ruleset) {
+		const QList<Rule> rules = randomRules();
+
+		QVERIFY(q.exec("DELETE FROM tagrule"));
+		q.prepare("INSERT INTO tagrule (rule, ruleorder, tags) VALUES (?, ?, ?)");
+		QStringList text;
+		QList<TagQuery> queries;
+		QList<TagIdSet> newtags;
+		for(int i=0;i<rules.count();++i) {
+			q.bindValue(0, rules.at(i).query);
+			q.bindValue(1, i);
+			q.bindValue(2, rules.at(i).tags);
+			QVERIFY(q.exec());
+
+			TagQuery query(rules.at(i).query);
+			query.queryInit(m_db->tags());
+			QVERIFY(!query.isError());
+			queries.append(query);
+			newtags.append(TagIdSet(TagSet::parse(rules.at(i).tags), m_db->tags()));
+			text << rules.at(i).query + " --> " + rules.at(i).tags;
+		}
+
+		const TagImplications implications = TagImplications::load(m_db);
+
+		for(int pic=0;pic<PICTURES;++pic) {
+			const QString picture = randomPicture();
+			TagIdSet expected(TagSet::parse(picture), m_db->tags());
+			TagIdSet actual = expected;
+
+			applyFixedPoint(queries, newtags, expected);
+			implications.apply(actual);
+
+			const QString message = "Rules: " + text.join("; ") + "\nPicture: " + picture +
+					"\nExpected: " + describe(expected) + "\nActual: " + describe(actual);
+			QVERIFY2(describe(actual) == describe(expected), qPrintable(message));
+		}
+	}
+}
+
+// No QApplication: the test needs no display
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	TestTagRules test;
+	return QTest::qExec(&test, argc, argv);
+}
+
+#include "tst_tagrules.moc"
@@ -0,0 +1,28 @@
+#-------------------------------------------------
+#
+# The non-GUI sources the tests are built with
+#
+#-------------------------------------------------
+
+QT       += core gui sql testlib
+
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += $$PWD/..
+
+SOURCES += $$PWD/../database.cpp \
+    $$PWD/../tags.cpp \
+    $$PWD/../tagset.cpp \
+    $$PWD/../tagidvector.cpp \
+    $$PWD/../picbitmap.cpp \
+    $$PWD/../tagindex.cpp \
+    $$PWD/../tagstore.cpp \
+    $$PWD/../savedqueries.cpp \
+    $$PWD/../tagquery.cpp \
+    $$PWD/../tagrules.cpp \
+    $$PWD/../util.cpp
+
+HEADERS  += $$PWD/../database.h \
+    $$PWD/../tags.h
@@ -0,0 +1,12 @@
+#-------------------------------------------------
+#
+# Tests and benchmarks. "make check" in the main
+# project builds these and runs the tests.
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += tagrules \
+    imagescaler \
+    tagquery
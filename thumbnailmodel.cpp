@@ -15,19 +15,39 @@
 // along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <QDir>
+#include <QDebug>
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QMimeData>
 #include <QUrl>
+#include <QTimer>
+
+#include <climits> // for INT_MAX
 
 #include "thumbnailmodel.h"
 #include "iconcache.h"
 #include "gallery.h"
 #include "tagquery.h"
+#include "tagindex.h"
+#include "tagstore.h"
+#include "picbitmap.h"
+
+//! Number of pictures matched (or results appended) per streaming step
+static const int STREAM_BATCH = 8192;
 
 ThumbnailModel::ThumbnailModel(const Gallery *gallery, QObject *parent) :
-	QAbstractListModel(parent), m_gallery(gallery), m_count(-1), m_cache(1000)
+	QAbstractListModel(parent), m_gallery(gallery), m_count(-1), m_cache(1000),
+	m_streamquery(0), m_streamnext(0), m_streampos(0), m_total(0),
+	m_scanned(0), m_matched(0), m_setuptime(0), m_matchtime(0), m_inserttime(0)
+{
+	m_streamtimer = new QTimer(this);
+	m_streamtimer->setInterval(0);
+	connect(m_streamtimer, SIGNAL(timeout()), this, SLOT(streamResults()));
+}
+
+ThumbnailModel::~ThumbnailModel()
 {
+	delete m_streamquery;
 }
 
 void ThumbnailModel::setQuery(SpecialQuery query, const QString &param)
@@ -40,32 +60,24 @@ void ThumbnailModel::setQuery(SpecialQuery query, const QString &param)
 	case QUERY_UNTAGGED:
 		sql = "SELECT * FROM picture WHERE hidden=0 AND tags=\"\" ORDER BY picid DESC";
 		break;
-	case QUERY_NEW:
-		sql = QString("SELECT * FROM picture WHERE hidden=0 AND picid>%1 ORDER BY picid DESC").arg(m_gallery->database()->getSetting("lastnewid").toInt());
-		break;
-	case QUERY_HIDDEN:
-		sql = "SELECT * FROM picture WHERE hidden=1 ORDER BY picid ASC";
-		break;
 	case QUERY_MISSING:
 		sql = "SELECT * FROM picture WHERE found=0 ORDER BY picid ASC";
 		break;
 	case QUERY_DUPLICATE:
 		sql = "SELECT * FROM picture JOIN duplicate USING (picid) ORDER BY picid ASC";
 		break;
-	case QUERY_FILENAME:
-		sql = "SELECT * FROM picture WHERE filename GLOB " + m_gallery->database()->esc("*" + param + "*") + " ORDER BY picid ASC";
-		break;
-	case QUERY_TITLE:
-		sql = "SELECT * FROM picture WHERE title LIKE " + m_gallery->database()->esc("%" + param + "%") + " ORDER BY picid ASC";
-		break;
-	case QUERY_HASH:
-		sql = "SELECT * FROM picture WHERE hash LIKE " + m_gallery->database()->esc(param + "%") + " ORDER BY picid ASC";
+	case QUERY_SAVED:
+		// Hidden pictures are left out, unless the saved query asks for them
+		sql = QString("SELECT * FROM picture WHERE ") +
+				(m_gallery->database()->savedQueries()->includesHidden(param) ? "" : "hidden=0 AND ") +
+				"picid IN (SELECT picid FROM savedresult JOIN savedquery USING (queryid) WHERE name=" + m_gallery->database()->esc(param) + ") ORDER BY picid ASC";
 		break;
 	default:
 		qFatal("Unhandled query mode");
 		return;
 	}
 
+	stopStream();
 	beginResetModel();
 
 	m_count = -1;
@@ -86,32 +98,19 @@ void ThumbnailModel::setQuery(SpecialQuery query, const QString &param)
 
 void ThumbnailModel::setQuery(const TagQuery &query)
 {
+	stopStream();
 	beginResetModel();
 
 	m_count = -1;
 	m_cache.clear();
 
-	// Get the "shortlist" and filter it
-	QSqlQuery q(m_gallery->database()->get());
+	m_querytimer.start();
+	m_scanned = -1;
+	m_matched = 0;
+	m_matchtime = 0;
+	m_inserttime = 0;
 
-	bool trivial = query.isTrivial();
-	QVector<int> shortlist;
-
-	// If query is non-trivial (e.g. contains tag sets,) match pictures in C++ code.
-	if(!trivial) {
-		q.setForwardOnly(true);
-		q.exec("SELECT picid, tagid, tagset FROM tagmap WHERE picid IN (SELECT picid FROM tagmap WHERE tagid IN (" + query.mentionedTagIds().join(",") + ") GROUP BY picid) ORDER BY picid, tagset ASC");
-		if(q.next()) {
-			while(true) {
-				TagIdSet tags = TagIdSet::getFromResults(q);
-				if(tags.pictureId()<0)
-					break;
-
-				if(query.match(tags))
-					shortlist.append(tags.pictureId());
-			}
-		}
-	}
+	QSqlQuery q(m_gallery->database()->get());
 
 	// Re-create temp table to hold query results
 	if(!q.exec("DROP TABLE IF EXISTS t_query"))
@@ -120,28 +119,212 @@ void ThumbnailModel::setQuery(const TagQuery &query)
 	if(!q.exec("CREATE TEMP TABLE t_query (picid INTEGER NOT NULL PRIMARY KEY)"))
 		Database::showError("Couldn't create new t_query", q);
 
-	// Insert results
-	if(trivial) {
-		q.exec("INSERT INTO t_query " + query.toSql());
-	} else {
-		q.prepare("INSERT INTO t_query VALUES (?)");
-		foreach(int id, shortlist) {
-			q.bindValue(0, id);
-			q.exec();
-		}
-	}
-
 	// Select filtered list view
 	if(!q.exec("DROP VIEW IF EXISTS t_picview"))
 		Database::showError("Couldn't drop old t_picview", q);
 
-	if(!q.exec("CREATE TEMP VIEW t_picview AS SELECT * FROM picture JOIN t_query USING (picid) WHERE hidden=0 ORDER BY picid ASC"))
+	// Hidden pictures are left out, unless the query asks for them
+	const QString hidden = query.includesHidden() ? "" : " WHERE hidden=0";
+	if(!q.exec("CREATE TEMP VIEW t_picview AS SELECT * FROM picture JOIN t_query USING (picid)" + hidden + " ORDER BY picid ASC"))
 		Database::showError("Couldn't create new t_picview", q);
 
+	// Queries without tag sets are matched in SQL, unless the inverted tag index
+	// is already in memory.
+	const TagIndex *index = m_gallery->database()->tagIndex();
+	const bool sets = query.hasSets();
+	const bool insql = !sets && (query.isTrivial() || !index->isLoaded());
+
+	m_setuptime = m_querytimer.nsecsElapsed() / 1000;
+
+	if(insql) {
+		// Matching and inserting happen in the same statement
+		QElapsedTimer timer;
+		timer.start();
+		if(!q.exec("INSERT INTO t_query " + query.toSql()))
+			Database::showError("Couldn't run tag query", q);
+		m_matchtime = timer.nsecsElapsed() / 1000;
+		m_matched = q.numRowsAffected();
+
+		endResetModel();
+		refreshCount();
+		reportStats();
+		return;
+	}
+
+	// Other queries are streamed: the view starts out empty and
+	// results are appended as they are found.
+	if(sets) {
+		// Tag sets are matched in the tag store, one batch of pictures at a time
+		m_streamquery = new TagQuery(query);
+		m_streamnext = 0;
+		m_scanned = 0;
+		if(query.matchesUntagged())
+			m_untaggedsql = "(" + query.untaggedSql() + ")" + (query.includesHidden() ? "" : " AND hidden=0");
+	} else {
+		// The bitmap index is fast enough to match all at once,
+		// but inserting the results is not.
+		QElapsedTimer timer;
+		timer.start();
+		m_streamlist = query.match(*index).toVector();
+		m_streampos = 0;
+		m_matchtime = timer.nsecsElapsed() / 1000;
+	}
+
+	m_count = 0;
+	m_total = m_gallery->totalCount();
 	endResetModel();
-	refreshCount();
+
+	// Show the first batch right away and the rest when idle
+	streamResults();
+	if(m_streamquery!=0 || m_streampos < m_streamlist.count())
+		m_streamtimer->start();
 }
 
+void ThumbnailModel::streamResults()
+{
+	QVector<int> results;
+	int from, to;
+	bool untagged = false;
+
+	if(m_streamquery!=0) {
+		QElapsedTimer timer;
+		timer.start();
+
+		const TagStore *store = m_gallery->database()->tagStore();
+		store->load();
+
+		// The store may have changed between batches, so the position
+		// is tracked by picture ID rather than by row.
+		const int first = store->lowerBound(m_streamnext);
+		const int last = qMin(first + STREAM_BATCH, store->count());
+		results = m_streamquery->match(*store, first, last);
+		m_scanned += last - first;
+
+		// Untagged pictures are not in the store
+		untagged = m_streamquery->matchesUntagged();
+		from = m_streamnext;
+
+		if(last < store->count()) {
+			m_streamnext = store->entry(last).pictureId();
+			to = m_streamnext;
+		} else {
+			to = INT_MAX;
+			delete m_streamquery;
+			m_streamquery = 0;
+		}
+		m_matchtime += timer.nsecsElapsed() / 1000;
+	} else {
+		const int count = qMin(STREAM_BATCH, m_streamlist.count() - m_streampos);
+		results = m_streamlist.mid(m_streampos, count);
+		from = results.isEmpty() ? 0 : results.first();
+		to = results.isEmpty() ? 0 : results.last() + 1;
+		m_streampos += count;
+		if(m_streampos >= m_streamlist.count()) {
+			m_streamlist.clear();
+			m_streampos = 0;
+		}
+	}
+
+	appendResults(results, from, to, untagged);
+
+	if(m_streamquery==0 && m_streamlist.isEmpty()) {
+		m_streamtimer->stop();
+		reportStats();
+	}
+}
+
+void ThumbnailModel::stopStream()
+{
+	m_streamtimer->stop();
+	delete m_streamquery;
+	m_streamquery = 0;
+	m_streamlist.clear();
+	m_streampos = 0;
+}
+
+/**
+  Each batch is inserted in a savepoint, so it is committed at once instead of
+  row by row. Unlike QSqlDatabase::transaction(), a savepoint also nests inside
+  a transaction that may already be open on this connection. (The tag rebuild
+  writes on its own cloned connection, not this one.)
+  */
+void ThumbnailModel::appendResults(const QVector<int>& picids, int from, int to, bool untagged)
+{
+	// The count may have been reset by refreshQuery
+	const int first = rowCount(QModelIndex());
+
+	if(picids.isEmpty() && !untagged) {
+		emit pictureCountChanged(first, m_total);
+		return;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	QSqlQuery q(m_gallery->database()->get());
+	if(!q.exec("SAVEPOINT appendresults"))
+		qDebug() << "Couldn't begin result batch:" << q.lastError().text();
+
+	q.prepare("INSERT INTO t_query VALUES (?)");
+	foreach(int id, picids) {
+		q.bindValue(0, id);
+		q.exec();
+	}
+	m_matched += picids.count();
+
+	if(untagged) {
+		q.prepare("INSERT INTO t_query SELECT picid FROM picture WHERE picid>=? AND picid<? AND " + m_untaggedsql + " AND NOT EXISTS (SELECT 1 FROM tagmap WHERE tagmap.picid=picture.picid)");
+		q.bindValue(0, from);
+		q.bindValue(1, to);
+		if(q.exec())
+			m_matched += q.numRowsAffected();
+		else
+			Database::showError("Couldn't insert untagged pictures", q);
+	}
+
+	if(!q.exec("RELEASE appendresults"))
+		qDebug() << "Couldn't commit result batch:" << q.lastError().text();
+
+	// Hidden pictures are filtered out by the view
+	q.prepare("SELECT COUNT(picid) FROM t_picview WHERE picid>=? AND picid<?");
+	q.bindValue(0, from);
+	q.bindValue(1, to);
+	if(!q.exec() || !q.next()) {
+		Database::showError("Couldn't count new results", q);
+		return;
+	}
+
+	const int added = q.value(0).toInt();
+	m_inserttime += timer.nsecsElapsed() / 1000;
+
+	if(added>0) {
+		// Results are streamed in ascending ID order, so new rows go at the end
+		beginInsertRows(QModelIndex(), first, first + added - 1);
+		m_count = first + added;
+		endInsertRows();
+	}
+
+	emit pictureCountChanged(m_count, m_total);
+}
+
+/**
+  The number of scanned rows is only known when the query is matched
+  in the tag store. Wall time includes the idle time between streamed batches.
+  */
+void ThumbnailModel::reportStats()
+{
+	QString summary = QString("%1 matched").arg(m_matched);
+	if(m_scanned>=0)
+		summary += QString(" of %1 scanned").arg(m_scanned);
+	summary += QString("; setup %1 us, match %2 us, insert %3 us, wall %4 us")
+			.arg(m_setuptime)
+			.arg(m_matchtime)
+			.arg(m_inserttime)
+			.arg(m_querytimer.nsecsElapsed() / 1000);
+
+	qDebug("Query: %s", qPrintable(summary));
+	emit queryTimed(summary);
+}
 
 void ThumbnailModel::refreshQuery()
 {
@@ -257,6 +440,21 @@ QList<Picture> ThumbnailModel::pictures(const QModelIndexList& list)
 	return pictures;
 }
 
+QVector<int> ThumbnailModel::pictureIds(int first, int count) const
+{
+	QVector<int> ids;
+	QSqlQuery q(m_gallery->database()->get());
+	q.setForwardOnly(true);
+	q.prepare("SELECT picid FROM t_picview LIMIT ? OFFSET ?");
+	q.bindValue(0, count);
+	q.bindValue(1, first);
+	if(!q.exec())
+		qWarning("Couldn't get picture IDs! (error: %s)", q.lastError().text().toLocal8Bit().constData());
+	while(q.next())
+		ids.append(q.value(0).toInt());
+	return ids;
+}
+
 void ThumbnailModel::refreshCount()
 {
 	emit pictureCountChanged(rowCount(index(0)), m_gallery->totalCount());
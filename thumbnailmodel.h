@@ -20,11 +20,14 @@
 #include <QAbstractListModel>
 #include <QStringList>
 #include <QCache>
+#include <QVector>
+#include <QElapsedTimer>
 
 #include "picture.h"
 
 class Gallery;
 class TagQuery;
+class QTimer;
 
 //! Item model for thumbnails
 /**
@@ -35,9 +38,10 @@ class ThumbnailModel : public QAbstractListModel
     Q_OBJECT
 public:
 	//! Special query modes
-	enum SpecialQuery { QUERY_ALL, QUERY_UNTAGGED, QUERY_NEW, QUERY_HIDDEN, QUERY_MISSING, QUERY_DUPLICATE, QUERY_FILENAME, QUERY_TITLE, QUERY_HASH };
+	enum SpecialQuery { QUERY_ALL, QUERY_UNTAGGED, QUERY_MISSING, QUERY_DUPLICATE, QUERY_SAVED };
 
 	ThumbnailModel(const Gallery *gallery, QObject *parent = 0);
+	~ThumbnailModel();
 
 	int rowCount(const QModelIndex &parent) const;
 
@@ -59,30 +63,92 @@ public:
 	  */
 	QList<Picture> pictures(const QModelIndexList& list);
 
+	/**
+	  \brief Get the IDs of the pictures in a range of rows
+	  \param first the first row
+	  \param count number of rows, or -1 for all remaining rows
+	  */
+	QVector<int> pictureIds(int first, int count=-1) const;
+
 	//! Remove the picture at index from the cache
 	void uncache(int index, bool removed=false);
 
 	//! Set a special (non-tag based) query and filter the view
 	void setQuery(SpecialQuery query, const QString& param=QString());
 
-	//! Set the query string and filter the view
+	/**
+	  \brief Set the query string and filter the view
+
+	  Queries that are not matched in SQL are streamed: matching pictures
+	  are appended to the view in batches, as they are found.
+	  */
 	void setQuery(const TagQuery& query);
 
 signals:
 	//! Number of shown pictures has changed
 	void pictureCountChanged(int shown, int total);
 
+	//! A tag query has been fully matched. The summary lists the time spent in each phase
+	void queryTimed(const QString& summary);
+
 public slots:
 	void refreshQuery();
 
+private slots:
+	//! Match and append the next batch of streamed results
+	void streamResults();
+
 private:
 	//! Emit the pictureCountChanged signal
 	void refreshCount();
 
+	//! Stop streaming results
+	void stopStream();
+
+	/**
+	  \brief Append matching pictures to the view
+
+	  \param picids matching pictures in ascending ID order
+	  \param from start of the range of picture IDs covered by this batch
+	  \param to end of the range (exclusive)
+	  \param untagged also append the untagged pictures in the range
+	  */
+	void appendResults(const QVector<int>& picids, int from, int to, bool untagged);
+
+	//! Log the statistics of the finished tag query and emit queryTimed
+	void reportStats();
+
 	const Gallery *m_gallery;
 
 	mutable int m_count;
 	mutable QCache<int, Picture> m_cache;
+
+	//! Timer for streaming results
+	QTimer *m_streamtimer;
+
+	//! The tag set query being streamed from the tag store, or null
+	TagQuery *m_streamquery;
+
+	//! ID of the next picture in the tag store to match
+	int m_streamnext;
+
+	//! Matched pictures not yet appended to the view
+	QVector<int> m_streamlist;
+	int m_streampos;
+
+	//! Total number of pictures, for the running count
+	int m_total;
+
+	//! SQL condition selecting the untagged pictures that match the streamed query
+	QString m_untaggedsql;
+
+	// Statistics of the current tag query. Times are in microseconds.
+	QElapsedTimer m_querytimer;
+	int m_scanned;
+	int m_matched;
+	qint64 m_setuptime;
+	qint64 m_matchtime;
+	qint64 m_inserttime;
 };
 
 #endif // THUMBNAILMODEL_H
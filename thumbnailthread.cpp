@@ -0,0 +1,124 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <QDebug>
+#include <QSqlQuery>
+#include <QVariant>
+#include <QFileInfo>
+#include <QTime>
+#include <QSet>
+
+#include "thumbnailthread.h"
+
+#include "gallery.h"
+#include "database.h"
+#include "iconcache.h"
+
+//! How long to stay paused after a pause request (milliseconds)
+static const int PAUSE_PERIOD = 500;
+
+ThumbnailThread::ThumbnailThread(const Gallery *gallery, int cpubudget, int iobudget, QObject *parent) :
+	QThread(parent), m_gallery(gallery), m_cpubudget(qBound(1, cpubudget, 100)), m_iobudget(qMax(0, iobudget)),
+	m_abortflag(false), m_pausehandled(0)
+{
+}
+
+void ThumbnailThread::run()
+{
+	QString dbname = QString("thumbnails") + m_gallery->database()->name();
+
+	// Make a list of pictures without thumbnails, newest first.
+	// Duplicate pictures share a thumbnail, so each hash is listed only once.
+	QList<Picture> pending;
+	{
+		QSqlDatabase db = QSqlDatabase::cloneDatabase(m_gallery->database()->get(), dbname);
+		if(!db.open()) {
+			emit statusChanged(tr("Couldn't open database!"));
+			qDebug() << "Couldn't open clone database!";
+			return;
+		}
+
+		QSqlQuery q(db);
+		q.setForwardOnly(true);
+		q.exec("SELECT picid, filename, hash FROM picture WHERE found=1 AND hidden=0 AND hash!=\"\" ORDER BY picid DESC");
+
+		QSet<QString> hashes;
+		while(q.next() && !m_abortflag) {
+			Picture picture(q.value(0).toInt(), q.value(1).toString(), false, QString(), QString(), 0, q.value(2).toString());
+			if(hashes.contains(picture.hash()))
+				continue;
+			hashes.insert(picture.hash());
+
+			if(!IconCache::getInstance().isCached(m_gallery, picture))
+				pending.append(picture);
+		}
+	}
+	QSqlDatabase::removeDatabase(dbname);
+
+	const int total = pending.count();
+	emit progress(0, total);
+
+	// The I/O budget is tracked over the whole run
+	QTime iotimer;
+	iotimer.start();
+	qint64 bytesread = 0;
+
+	int done = 0;
+	foreach(const Picture& picture, pending) {
+		waitWhilePaused();
+		if(m_abortflag)
+			break;
+
+		QTime timer;
+		timer.start();
+		IconCache::getInstance().generate(m_gallery, picture);
+		emit progress(++done, total);
+
+		// Stay within the CPU budget by idling in proportion to the time spent working
+		int sleeptime = timer.elapsed() * (100 - m_cpubudget) / m_cpubudget;
+
+		// Stay within the I/O budget by idling until the average read rate drops low enough
+		if(m_iobudget>0) {
+			bytesread += QFileInfo(picture.fullpath(m_gallery)).size();
+			int due = bytesread * 1000 / (qint64(m_iobudget) * 1024) - iotimer.elapsed();
+			sleeptime = qMax(sleeptime, due);
+		}
+
+		if(sleeptime>0)
+			msleep(sleeptime);
+	}
+
+	emit statusChanged(tr("Done."));
+}
+
+void ThumbnailThread::waitWhilePaused()
+{
+	// Keep sleeping as long as new pause requests come in
+	while(!m_abortflag && int(m_pauserequests) != m_pausehandled) {
+		m_pausehandled = m_pauserequests;
+		msleep(PAUSE_PERIOD);
+	}
+}
+
+void ThumbnailThread::abort()
+{
+	m_abortflag = true;
+}
+
+void ThumbnailThread::pause()
+{
+	m_pauserequests.ref();
+}
@@ -0,0 +1,66 @@
+//
+// This file is part of Piqs.
+// 
+// Piqs is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Piqs is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with Piqs.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef THUMBNAILTHREAD_H
+#define THUMBNAILTHREAD_H
+
+#include <QThread>
+#include <QAtomicInt>
+
+class Gallery;
+
+//! Generate missing thumbnails in the background
+/**
+  Pictures that have no cached thumbnail are processed newest first.
+  The generator sleeps between thumbnails to stay within its CPU and I/O
+  budget and backs off while the user is scrolling the browser view.
+  */
+class ThumbnailThread : public QThread
+{
+    Q_OBJECT
+public:
+	/**
+	  \param gallery the gallery whose thumbnails to generate
+	  \param cpubudget percentage of (one core's) time to spend generating thumbnails
+	  \param iobudget maximum number of source image kilobytes to read per second. Zero means unlimited.
+	  */
+	ThumbnailThread(const Gallery *gallery, int cpubudget, int iobudget, QObject *parent = 0);
+
+	void run();
+
+signals:
+	void statusChanged(const QString& status);
+	void progress(int done, int total);
+
+public slots:
+	void abort();
+
+	//! Pause generation for a moment (e.g. because the user is scrolling)
+	void pause();
+
+private:
+	void waitWhilePaused();
+
+	const Gallery *m_gallery;
+	int m_cpubudget;
+	int m_iobudget;
+
+	bool m_abortflag;
+	QAtomicInt m_pauserequests;
+	int m_pausehandled;
+};
+
+#endif // THUMBNAILTHREAD_H
@@ -74,8 +74,10 @@ QStringList Util::tokenize(const QString& string, const QString& tokenstring, bo
 
 QString Util::cleanTagName(const QString& name)
 {
-	static QRegExp badchars("[,|()[\\]!]");
-	return name.simplified().toLower().replace(badchars, "");
+	// QRegExp keeps the state of the last match, so each call works on its own copy
+	static const QRegExp badchars("[,|()[\\]!]");
+	QRegExp rx(badchars);
+	return name.simplified().toLower().replace(rx, "");
 }
 
 QString Util::hashFile(const QString& path)
@@ -26,7 +26,7 @@ public:
 	//! Split the string at the tokens
 	static QStringList tokenize(const QString& string, const QString& tokens, bool trim);
 
-	//! Remove illegal characters from a tag name
+	//! Remove illegal characters from a tag name. This is safe to call from any thread.
 	static QString cleanTagName(const QString& name);
 
 	//! Calculate a file's SHA-1 hash